@@ -0,0 +1,375 @@
+//! Microbenchmarks of the primitives used by elements through the C ABI.
+//!
+//! Each benchmark is warmed up, then measured in samples of about 10 ms. The median time per
+//! iteration and the median absolute deviation of the samples are reported.
+//!
+//! ```sh
+//! cargo bench --features bench --bench abi [FILTER]
+//! ```
+//!
+//! Environment variables:
+//! - `DC_BENCH_PLUGIN`: Plugin library that provides `bench-nop` and `bench-echo`, such as
+//!   `benches/c/bench_plugin.c`, to compare with native elements.
+//! - `DC_BENCH_SAVE`: File to save results to.
+//! - `DC_BENCH_BASELINE`: File saved by a previous run to compare results with.
+
+use device_connector::bench::{load_plugin, msg_clone, Loopback};
+use device_connector::common::{
+    dc_msg_buf_write, dc_msg_free, dc_msg_receiver_recv, dc_msg_receiver_recv_any,
+    dc_pipeline_check_send_msg_type, dc_pipeline_msg_buf, DcMsg, DcMsgInner,
+};
+use device_connector::element::*;
+use device_connector::error::Error;
+use device_connector::{
+    define_dc_load, EmptyElementConf, LoadedPlugin, Msg, MsgReceiver, Pipeline,
+};
+use std::collections::HashMap;
+use std::hint::black_box;
+use std::io::Write;
+use std::time::{Duration, Instant};
+
+const WARM_UP: Duration = Duration::from_millis(300);
+const SAMPLE: Duration = Duration::from_millis(10);
+const SAMPLES: usize = 50;
+/// Messages queued at once by benchmarks of receiving.
+const QUEUE: u64 = 1024;
+
+/// Returns a message buffer without changing it.
+pub struct NopElement;
+
+impl ElementBuildable for NopElement {
+    type Config = EmptyElementConf;
+
+    const NAME: &'static str = "bench-nop";
+
+    const RECV_PORTS: Port = 1;
+
+    const SEND_PORTS: Port = 1;
+
+    fn acceptable_msg_types() -> Vec<Vec<MsgType>> {
+        vec![vec![MsgType::any()]]
+    }
+
+    fn new(_conf: Self::Config) -> Result<Self, Error> {
+        Ok(NopElement)
+    }
+
+    fn next(&mut self, _pipeline: &mut Pipeline, _receiver: &mut MsgReceiver) -> ElementResult {
+        Ok(ElementValue::MsgBuf)
+    }
+}
+
+/// Copies a received message to the message buffer.
+pub struct EchoElement;
+
+impl ElementBuildable for EchoElement {
+    type Config = EmptyElementConf;
+
+    const NAME: &'static str = "bench-echo";
+
+    const RECV_PORTS: Port = 1;
+
+    const SEND_PORTS: Port = 1;
+
+    fn acceptable_msg_types() -> Vec<Vec<MsgType>> {
+        vec![vec![MsgType::any()]]
+    }
+
+    fn new(_conf: Self::Config) -> Result<Self, Error> {
+        Ok(EchoElement)
+    }
+
+    fn next(&mut self, pipeline: &mut Pipeline, receiver: &mut MsgReceiver) -> ElementResult {
+        let msg = receiver.recv(0)?;
+        pipeline.msg_buf(0).write_all(msg.as_bytes())?;
+        Ok(ElementValue::MsgBuf)
+    }
+}
+
+// The same elements called through the plugin ABI without loading a library.
+define_dc_load!(NopElement, EchoElement);
+
+struct Bencher {
+    filter: Option<String>,
+    baseline: HashMap<String, f64>,
+    results: Vec<(String, f64)>,
+}
+
+impl Bencher {
+    fn new() -> Self {
+        let filter = std::env::args().skip(1).find(|arg| !arg.starts_with("--"));
+        let baseline = std::env::var("DC_BENCH_BASELINE")
+            .ok()
+            .and_then(|path| std::fs::read_to_string(path).ok())
+            .map(|s| {
+                s.lines()
+                    .filter_map(|line| {
+                        let (name, ns) = line.rsplit_once(' ')?;
+                        Some((name.to_owned(), ns.parse().ok()?))
+                    })
+                    .collect()
+            })
+            .unwrap_or_default();
+        Bencher {
+            filter,
+            baseline,
+            results: Vec::new(),
+        }
+    }
+
+    /// Measure `f`, which runs the given number of iterations and returns the time they took.
+    fn run<F: FnMut(u64) -> Duration>(&mut self, name: &str, mut f: F) {
+        if let Some(filter) = &self.filter {
+            if !name.contains(filter.as_str()) {
+                return;
+            }
+        }
+
+        let mut iters = 1;
+        let start = Instant::now();
+        loop {
+            let elapsed = f(iters);
+            if elapsed >= SAMPLE && start.elapsed() >= WARM_UP {
+                iters =
+                    (iters as f64 * SAMPLE.as_secs_f64() / elapsed.as_secs_f64()).max(1.0) as u64;
+                break;
+            }
+            if elapsed < SAMPLE {
+                iters *= 2;
+            }
+        }
+
+        let mut samples: Vec<f64> = (0..SAMPLES)
+            .map(|_| f(iters).as_nanos() as f64 / iters as f64)
+            .collect();
+        samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let median = samples[SAMPLES / 2];
+        let mut deviations: Vec<f64> = samples.iter().map(|s| (s - median).abs()).collect();
+        deviations.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let mad = deviations[SAMPLES / 2];
+
+        let change = match self.baseline.get(name) {
+            Some(base) => format!(" ({:+.1}%)", (median / base - 1.0) * 100.0),
+            None => String::new(),
+        };
+        println!(
+            "{:<40} {:>10.1} ns/iter +/- {:.1}%{}",
+            name,
+            median,
+            mad / median * 100.0,
+            change
+        );
+        self.results.push((name.to_owned(), median));
+    }
+
+    fn save(&self) {
+        if let Ok(path) = std::env::var("DC_BENCH_SAVE") {
+            let s: String = self
+                .results
+                .iter()
+                .map(|(name, ns)| format!("{} {}\n", name, ns))
+                .collect();
+            std::fs::write(path, s).expect("cannot save results");
+        }
+    }
+}
+
+/// Run `f` for `iters` iterations split into chunks of at most `QUEUE`, timing only `timed`.
+fn chunked<S, T, F, G>(iters: u64, mut setup: F, mut timed: G) -> Duration
+where
+    F: FnMut(u64) -> S,
+    G: FnMut(S) -> T,
+{
+    let mut total = Duration::ZERO;
+    let mut left = iters;
+    while left > 0 {
+        let n = left.min(QUEUE);
+        let input = setup(n);
+        let start = Instant::now();
+        let output = timed(input);
+        total += start.elapsed();
+        drop(black_box(output));
+        left -= n;
+    }
+    total
+}
+
+fn borrowed(data: &[u8]) -> Msg<'_> {
+    unsafe {
+        Msg::new(DcMsg {
+            inner: DcMsgInner {
+                msg_ref: data.as_ptr(),
+            },
+            len: data.len(),
+            capacity: 0,
+            drop: None,
+        })
+    }
+}
+
+fn bench_msg(b: &mut Bencher, lb: &mut Loopback) {
+    for size in [64, 4096] {
+        let data = vec![0xa5; size];
+
+        b.run(&format!("dc_msg_buf_write/{}", size), |iters| {
+            let pipeline = lb.pipeline();
+            let start = Instant::now();
+            for _ in 0..iters {
+                unsafe {
+                    let msg_buf = dc_pipeline_msg_buf(pipeline);
+                    dc_msg_buf_write(msg_buf, black_box(data.as_ptr()), size);
+                }
+            }
+            start.elapsed()
+        });
+
+        unsafe { dc_msg_buf_write(dc_pipeline_msg_buf(lb.pipeline()), data.as_ptr(), size) };
+        b.run(&format!("get_msg_cloned/{}", size), |iters| {
+            chunked(
+                iters,
+                |n| (n, Vec::with_capacity(n as usize)),
+                |(n, mut msgs)| {
+                    for _ in 0..n {
+                        msgs.push(unsafe { Msg::new(lb.get_msg_cloned()) });
+                    }
+                    msgs
+                },
+            )
+        });
+
+        b.run(&format!("dc_msg_free/{}", size), |iters| {
+            chunked(
+                iters,
+                |n| (0..n).map(|_| lb.get_msg_cloned()).collect::<Vec<_>>(),
+                |msgs| {
+                    for msg in msgs {
+                        unsafe { dc_msg_free(msg) };
+                    }
+                },
+            )
+        });
+
+        let msg = borrowed(&data);
+        b.run(&format!("msg_clone/{}", size), |iters| {
+            chunked(
+                iters,
+                |n| (n, Vec::with_capacity(n as usize)),
+                |(n, mut msgs)| {
+                    for _ in 0..n {
+                        msgs.push(msg_clone(black_box(&msg)));
+                    }
+                    msgs
+                },
+            )
+        });
+    }
+}
+
+fn bench_recv(b: &mut Bencher, lb: &mut Loopback) {
+    let data = [0xa5; 64];
+
+    let receiver = lb.receiver();
+    b.run("dc_msg_receiver_recv/64", |iters| {
+        chunked(
+            iters,
+            |n| {
+                for _ in 0..n {
+                    lb.send(&data);
+                }
+                (n, Vec::with_capacity(n as usize))
+            },
+            |(n, mut msgs)| {
+                for _ in 0..n {
+                    let mut msg = unsafe { std::mem::zeroed() };
+                    unsafe { dc_msg_receiver_recv(receiver, 0, &mut msg) };
+                    msgs.push(unsafe { Msg::new(msg) });
+                }
+                msgs
+            },
+        )
+    });
+
+    b.run("dc_msg_receiver_recv_any/64", |iters| {
+        chunked(
+            iters,
+            |n| {
+                for _ in 0..n {
+                    lb.send(&data);
+                }
+                (n, Vec::with_capacity(n as usize))
+            },
+            |(n, mut msgs)| {
+                for _ in 0..n {
+                    let mut msg = unsafe { std::mem::zeroed() };
+                    let mut port = 0;
+                    unsafe { dc_msg_receiver_recv_any(receiver, &mut port, &mut msg) };
+                    msgs.push(unsafe { Msg::new(msg) });
+                }
+                msgs
+            },
+        )
+    });
+
+    b.run("dc_pipeline_check_send_msg_type", |iters| {
+        let pipeline = lb.pipeline();
+        let start = Instant::now();
+        for _ in 0..iters {
+            let msg_type = MsgType::binary().into_ffi();
+            unsafe { dc_pipeline_check_send_msg_type(pipeline, 0, msg_type) };
+        }
+        start.elapsed()
+    });
+}
+
+/// Compare calls of `next` of elements of `bank`.
+fn bench_next(b: &mut Bencher, bank: &ElementBank, kind: &str) {
+    let mut nop = Loopback::new(bank, "bench-nop", QUEUE as usize).unwrap();
+    b.run(&format!("next/{}", kind), |iters| {
+        let start = Instant::now();
+        for _ in 0..iters {
+            let _ = black_box(nop.next());
+        }
+        start.elapsed()
+    });
+
+    // Receive, copy and send back one message per iteration.
+    let mut echo = Loopback::new(bank, "bench-echo", QUEUE as usize).unwrap();
+    echo.send(&[0xa5; 64]);
+    b.run(&format!("echo/{}/64", kind), |iters| {
+        let start = Instant::now();
+        for _ in 0..iters {
+            echo.next().unwrap();
+            echo.send_msg_buf();
+        }
+        start.elapsed()
+    });
+}
+
+fn main() {
+    let mut b = Bencher::new();
+
+    let mut native = ElementBank::empty();
+    native.append_from_buildable::<NopElement>().unwrap();
+    native.append_from_buildable::<EchoElement>().unwrap();
+
+    let mut plugin = ElementBank::empty();
+    unsafe { load_plugin(&mut plugin, dc_load).unwrap() };
+    // Logging initialized by dc_load() would be measured with type checks.
+    log::set_max_level(log::LevelFilter::Warn);
+
+    let mut lb = Loopback::new(&native, "bench-nop", QUEUE as usize).unwrap();
+    bench_msg(&mut b, &mut lb);
+    bench_recv(&mut b, &mut lb);
+
+    bench_next(&mut b, &native, "native");
+    bench_next(&mut b, &plugin, "plugin");
+    if let Ok(path) = std::env::var("DC_BENCH_PLUGIN") {
+        let mut external = ElementBank::empty();
+        let loaded = LoadedPlugin::new(&[path]).unwrap();
+        loaded.load_plugins(&mut external).unwrap();
+        log::set_max_level(log::LevelFilter::Warn);
+        bench_next(&mut b, &external, "external");
+    }
+
+    b.save();
+}
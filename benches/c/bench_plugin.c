@@ -0,0 +1,63 @@
+/*
+ * Elements of the abi benchmark as a C plugin.
+ *
+ *   cargo build --release -p device-connector-common
+ *   cc -O2 -shared -fPIC -o target/release/libbench_plugin.so benches/c/bench_plugin.c \
+ *     -Icommon/include target/release/libdevice_connector_common.a -lpthread -ldl -lm
+ *   DC_BENCH_PLUGIN=target/release/libbench_plugin.so cargo bench --features bench --bench abi
+ */
+
+#include "device_connector.h"
+
+static const char *const ACCEPTABLE_MSG_TYPES[] = {"mime:*/*"};
+
+static int ELEMENT;
+
+static void *element_new(const char *config) {
+  (void)config;
+  return &ELEMENT;
+}
+
+static DcElementResult nop_next(void *element, DcPipeline *pipeline, DcMsgReceiver *receiver) {
+  (void)element;
+  (void)pipeline;
+  (void)receiver;
+  return DcElementResult_MsgBuf;
+}
+
+static DcElementResult echo_next(void *element, DcPipeline *pipeline, DcMsgReceiver *receiver) {
+  DcMsg msg;
+  (void)element;
+  if (!dc_msg_receiver_recv(receiver, 0, &msg)) {
+    return DcElementResult_Err;
+  }
+  dc_msg_buf_write(dc_pipeline_msg_buf(pipeline), msg.inner.msg_ref, msg.len);
+  dc_msg_free(msg);
+  return DcElementResult_MsgBuf;
+}
+
+static bool element_finalizer(void *element, DcFinalizer *finalizer) {
+  (void)element;
+  (void)finalizer;
+  return true;
+}
+
+static void element_free(void *element) {
+  (void)element;
+}
+
+static const DcElement ELEMENTS[] = {
+    {"bench-nop", 1, 1, ACCEPTABLE_MSG_TYPES, "json", element_new, nop_next, element_finalizer,
+     element_free},
+    {"bench-echo", 1, 1, ACCEPTABLE_MSG_TYPES, "json", element_new, echo_next, element_finalizer,
+     element_free},
+};
+
+bool dc_load(DcPlugin *plugin) {
+  dc_plugin_init(plugin, "bench_plugin");
+  plugin->version = "0.1.0";
+  plugin->n_element = sizeof(ELEMENTS) / sizeof(ELEMENTS[0]);
+  plugin->elements = ELEMENTS;
+  plugin->element_flags = NULL;
+  return true;
+}
@@ -5,6 +5,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/**
+ * Element flag that means instances of the element can process messages in parallel.
+ */
+#define DC_ELEMENT_REPLICABLE 1
+
+/**
+ * Element flag that means instances of the element can process disjoint sets of keys in parallel.
+ */
+#define DC_ELEMENT_PARTITIONABLE 2
+
 /**
  * Element result value for C
  */
@@ -26,6 +36,24 @@ typedef struct DcMsgBufInner {
  */
 typedef uint8_t Port;
 
+/**
+ * Kind of metrics registered by elements.
+ */
+typedef enum DcMetricKind {
+  /**
+   * Monotonic count. Updates add to it.
+   */
+  DcMetricKind_Counter,
+  /**
+   * Current value. Updates replace it.
+   */
+  DcMetricKind_Gauge,
+  /**
+   * Distribution of values such as latencies in nanoseconds. Updates record a value.
+   */
+  DcMetricKind_Histogram,
+} DcMetricKind;
+
 /**
  * Message buffer
  */
@@ -92,6 +120,44 @@ typedef struct DcPipelineInner {
 
 } DcPipelineInner;
 
+/**
+ * Job run on the shared worker pool.
+ */
+typedef void (*DcJobFunc)(void *arg);
+
+/**
+ * Body of a parallel loop, called with each index.
+ */
+typedef void (*DcParallelForFunc)(void *arg, size_t index);
+
+/**
+ * Point in time read from the runtime clock.
+ */
+typedef struct DcTimestamp {
+  /**
+   * `CLOCK_MONOTONIC` in nanoseconds.
+   */
+  uint64_t monotonic_ns;
+  /**
+   * Unix time in nanoseconds, derived from `monotonic_ns` and the offset between the clocks,
+   * read again every second to follow adjustments of the system time.
+   */
+  uint64_t realtime_ns;
+} DcTimestamp;
+
+/**
+ * Shared resource acquired by `dc_resource_acquire`, loaded while it is acquired.
+ */
+typedef struct DcResource {
+  const uint8_t *data;
+  size_t len;
+  /**
+   * Reference to the resource held by the runtime.
+   */
+  void *inner;
+  void (*release)(void*);
+} DcResource;
+
 /**
  * Handler for device connector pipeline.
  */
@@ -103,6 +169,19 @@ typedef struct DcPipeline {
   bool (*send_msg_type_checked)(struct DcPipelineInner*);
   bool (*check_send_msg_type)(struct DcPipelineInner*, Port, struct DcMsgType);
   struct DcMsgBuf *(*msg_buf)(struct DcPipelineInner*);
+  void *(*scratch_alloc)(struct DcPipelineInner*, size_t);
+  void (*submit_job)(struct DcPipelineInner*, DcJobFunc, void*);
+  void (*wait_jobs)(struct DcPipelineInner*);
+  void (*parallel_for)(struct DcPipelineInner*, size_t, DcParallelForFunc, void*);
+  bool (*resource)(struct DcPipelineInner*, const char*, struct DcResource*);
+  uint64_t (*timer_register)(struct DcPipelineInner*, uint64_t, bool);
+  uint64_t (*timer_expired)(struct DcPipelineInner*, uint64_t);
+  uint64_t (*timer_wait)(struct DcPipelineInner*, uint64_t);
+  void (*timer_cancel)(struct DcPipelineInner*, uint64_t);
+  struct DcTimestamp (*now)(struct DcPipelineInner*, bool);
+  void (*sleep)(struct DcPipelineInner*, uint64_t);
+  uint64_t (*metric_register)(struct DcPipelineInner*, const char*, enum DcMetricKind);
+  void (*metric_update)(struct DcPipelineInner*, uint64_t, int64_t);
 } DcPipeline;
 
 /**
@@ -155,6 +234,17 @@ typedef struct DcElement {
   void (*free)(void *element);
 } DcElement;
 
+/**
+ * Logging function of the host. Logs `msg` of `len` bytes at `level` from 1 (error) to
+ * 5 (trace). `target` and `file` are null-terminated strings or null.
+ */
+typedef void (*DcLogFunc)(uint32_t level,
+                          const char *target,
+                          const char *file,
+                          uint32_t line,
+                          const char *msg,
+                          size_t len);
+
 /**
  * Device connector plugin
  */
@@ -162,6 +252,18 @@ typedef struct DcPlugin {
   const char *version;
   size_t n_element;
   const struct DcElement *elements;
+  /**
+   * Flags for each element, or null. `DC_ELEMENT_*` values are combined.
+   */
+  const uint32_t *element_flags;
+  /**
+   * Logging function set by the host before dc_load() is called, or null.
+   */
+  DcLogFunc log;
+  /**
+   * Most verbose level logged by the host, from 1 (error) to 5 (trace), or 0 for none.
+   */
+  uint32_t log_max_level;
 } DcPlugin;
 
 #ifdef __cplusplus
@@ -169,12 +271,22 @@ extern "C" {
 #endif // __cplusplus
 
 /**
- * Initialize plugin. Must be called at first in dc_load().
+ * Initialize plugin. Must be called at first in dc_load(). `dc_plugin_init()` is preferred,
+ * which logs through the host.
  * # Safety
  * `plugin_name` must points valid null-​terminated string.
  */
 void dc_init(const char *plugin_name);
 
+/**
+ * Initialize plugin to log through the host logger if the host provides it, or as
+ * `dc_init()` otherwise. Must be called at first in dc_load() instead of `dc_init()`.
+ * # Safety
+ * `plugin` must be the pointer given to dc_load(), and `plugin_name` must points valid
+ * null-terminated string.
+ */
+void dc_plugin_init(const struct DcPlugin *plugin, const char *plugin_name);
+
 /**
  * # Safety
  * `msg_buf` and `data` must be a valid pointer.
@@ -227,6 +339,141 @@ bool dc_pipeline_check_send_msg_type(struct DcPipeline *pipeline,
  */
 struct DcMsgBuf *dc_pipeline_msg_buf(struct DcPipeline *pipeline);
 
+/**
+ * Allocates `size` bytes from the task scratch arena. The returned memory is aligned to
+ * 16 bytes, not initialized, and released automatically when `next()` returns.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+void *dc_pipeline_scratch_alloc(struct DcPipeline *pipeline, size_t size);
+
+/**
+ * Runs `func(arg)` on the shared worker pool. Use `dc_pipeline_wait_jobs` to wait for it.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer. `arg` must be valid until the job finishes.
+ */
+void dc_pipeline_submit_job(struct DcPipeline *pipeline, DcJobFunc func, void *arg);
+
+/**
+ * Waits for all jobs submitted by this task. The calling thread runs queued jobs meanwhile.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+void dc_pipeline_wait_jobs(struct DcPipeline *pipeline);
+
+/**
+ * Calls `func(arg, i)` for each `i` in `0..n` on the calling thread and the shared worker
+ * pool, and returns after all calls finish.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer. `func` must be safe to call from multiple threads.
+ */
+void dc_pipeline_parallel_for(struct DcPipeline *pipeline,
+                              size_t n,
+                              DcParallelForFunc func,
+                              void *arg);
+
+/**
+ * Acquires the shared resource `name` declared in the configuration into `resource`.
+ * Returns false if there is no such resource.
+ *
+ * The data is read-only and stays valid from any thread until `resource` is passed to
+ * `dc_resource_release`, also after the task finishes.
+ *
+ * # Safety
+ * `pipeline`, `name` and `resource` must be valid pointers.
+ */
+bool dc_resource_acquire(struct DcPipeline *pipeline,
+                         const char *name,
+                         struct DcResource *resource);
+
+/**
+ * Releases a resource acquired by `dc_resource_acquire`. Releasing it again does nothing.
+ *
+ * # Safety
+ * `resource` must be a valid pointer.
+ */
+void dc_resource_release(struct DcResource *resource);
+
+/**
+ * Starts a timer of the runtime timer service that expires after `interval_ns`, and then
+ * every `interval_ns` if `periodic`. Returns the timer id used by other `dc_pipeline_timer_*`
+ * functions of this task.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+uint64_t dc_pipeline_timer_register(struct DcPipeline *pipeline,
+                                    uint64_t interval_ns,
+                                    bool periodic);
+
+/**
+ * Returns the number of expirations of the timer since the last call, without blocking.
+ * Cheap enough to call for each message.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+uint64_t dc_pipeline_timer_expired(struct DcPipeline *pipeline, uint64_t timer);
+
+/**
+ * Blocks until the timer expires and returns the number of expirations since the last call.
+ * Returns 0 immediately for an unknown timer or a one-shot timer that already expired.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+uint64_t dc_pipeline_timer_wait(struct DcPipeline *pipeline, uint64_t timer);
+
+/**
+ * Stops the timer.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+void dc_pipeline_timer_cancel(struct DcPipeline *pipeline, uint64_t timer);
+
+/**
+ * Returns the current time. Timestamps from all tasks and plugins use the same clocks.
+ * `coarse` reads a clock updated on kernel ticks, which is cheaper for high-rate callers.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+struct DcTimestamp dc_now(struct DcPipeline *pipeline, bool coarse);
+
+/**
+ * Sleeps for `ns` nanoseconds of the runtime clock, which may be virtual.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+void dc_pipeline_sleep(struct DcPipeline *pipeline, uint64_t ns);
+
+/**
+ * Registers the metric `name`, or gets the metric already registered by any task with the
+ * same name and kind. Returns the metric id used by `dc_pipeline_metric_update`, or 0 if
+ * `name` is registered with another kind.
+ *
+ * # Safety
+ * `pipeline` and `name` must be valid pointers.
+ */
+uint64_t dc_pipeline_metric_register(struct DcPipeline *pipeline,
+                                     const char *name,
+                                     enum DcMetricKind kind);
+
+/**
+ * Adds `value` to a counter, sets a gauge to `value`, or records `value` in a histogram.
+ * Takes no lock except for the first update of each metric in a thread.
+ *
+ * # Safety
+ * `pipeline` must be a valid pointer.
+ */
+void dc_pipeline_metric_update(struct DcPipeline *pipeline, uint64_t metric, int64_t value);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif // __cplusplus
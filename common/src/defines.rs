@@ -14,6 +14,18 @@ pub enum DcElementResult {
     MsgBuf,
 }
 
+/// Kind of metrics registered by elements.
+#[repr(C)]
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum DcMetricKind {
+    /// Monotonic count. Updates add to it.
+    Counter,
+    /// Current value. Updates replace it.
+    Gauge,
+    /// Distribution of values such as latencies in nanoseconds. Updates record a value.
+    Histogram,
+}
+
 /// General element configuration type
 #[derive(Clone, PartialEq, Eq, Debug, Serialize, Deserialize)]
 #[serde(transparent)]
@@ -0,0 +1,72 @@
+use crate::{dc_init, DcPlugin};
+use libc::{c_char, size_t};
+use std::ffi::CString;
+
+/// Logging function of the host. Logs `msg` of `len` bytes at `level` from 1 (error) to
+/// 5 (trace). `target` and `file` are null-terminated strings or null.
+pub type DcLogFunc = unsafe extern "C" fn(
+    level: u32,
+    target: *const c_char,
+    file: *const c_char,
+    line: u32,
+    msg: *const c_char,
+    len: size_t,
+);
+
+/// Initialize plugin to log through the host logger if the host provides it, or as
+/// `dc_init()` otherwise. Must be called at first in dc_load() instead of `dc_init()`.
+/// # Safety
+/// `plugin` must be the pointer given to dc_load(), and `plugin_name` must points valid
+/// null-terminated string.
+#[no_mangle]
+pub unsafe extern "C" fn dc_plugin_init(plugin: *const DcPlugin, plugin_name: *const c_char) {
+    let plugin = &*plugin;
+    match plugin.log {
+        Some(log) => {
+            // Fails for elements linked into the host, which already log through it.
+            let _ = log::set_boxed_logger(Box::new(HostLogger(log)));
+            log::set_max_level(match plugin.log_max_level {
+                0 => log::LevelFilter::Off,
+                1 => log::LevelFilter::Error,
+                2 => log::LevelFilter::Warn,
+                3 => log::LevelFilter::Info,
+                4 => log::LevelFilter::Debug,
+                _ => log::LevelFilter::Trace,
+            });
+        }
+        None => dc_init(plugin_name),
+    }
+}
+
+struct HostLogger(DcLogFunc);
+
+impl log::Log for HostLogger {
+    fn enabled(&self, metadata: &log::Metadata) -> bool {
+        metadata.level() <= log::max_level()
+    }
+
+    fn log(&self, record: &log::Record) {
+        if !self.enabled(record.metadata()) {
+            return;
+        }
+        let msg = match record.args().as_str() {
+            Some(s) => std::borrow::Cow::Borrowed(s),
+            None => std::borrow::Cow::Owned(record.args().to_string()),
+        };
+        let target = CString::new(record.target()).ok();
+        let file = record.file().and_then(|file| CString::new(file).ok());
+        let as_ptr = |s: &Option<CString>| s.as_ref().map_or(std::ptr::null(), |s| s.as_ptr());
+        unsafe {
+            (self.0)(
+                record.level() as u32,
+                as_ptr(&target),
+                as_ptr(&file),
+                record.line().unwrap_or(0),
+                msg.as_ptr() as *const c_char,
+                msg.len(),
+            )
+        }
+    }
+
+    fn flush(&self) {}
+}
@@ -1,10 +1,12 @@
 mod defines;
+mod host_log;
 mod msg_buf;
 mod msg_receiver;
 mod msg_type;
 mod pipeline;
 
 pub use defines::*;
+pub use host_log::*;
 pub use msg_buf::*;
 pub use msg_receiver::*;
 pub use msg_type::*;
@@ -19,8 +21,20 @@ pub struct DcPlugin {
     pub version: *const c_char,
     pub n_element: size_t,
     pub elements: *const DcElement,
+    /// Flags for each element, or null. `DC_ELEMENT_*` values are combined.
+    pub element_flags: *const u32,
+    /// Logging function set by the host before dc_load() is called, or null.
+    pub log: Option<DcLogFunc>,
+    /// Most verbose level logged by the host, from 1 (error) to 5 (trace), or 0 for none.
+    pub log_max_level: u32,
 }
 
+/// Element flag that means instances of the element can process messages in parallel.
+pub const DC_ELEMENT_REPLICABLE: u32 = 1;
+
+/// Element flag that means instances of the element can process disjoint sets of keys in parallel.
+pub const DC_ELEMENT_PARTITIONABLE: u32 = 2;
+
 unsafe impl Send for DcPlugin {}
 
 /// Finalizer for element
@@ -61,7 +75,8 @@ pub struct DcElement {
     pub free: unsafe extern "C" fn(element: *mut c_void),
 }
 
-/// Initialize plugin. Must be called at first in dc_load().
+/// Initialize plugin. Must be called at first in dc_load(). `dc_plugin_init()` is preferred,
+/// which logs through the host.
 /// # Safety
 /// `plugin_name` must points valid null-​terminated string.
 #[no_mangle]
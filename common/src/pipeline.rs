@@ -1,4 +1,8 @@
-use crate::{DcMsgBuf, DcMsgType, MsgBuf, MsgType, Port, TypeCheckError};
+use crate::{DcMetricKind, DcMsgBuf, DcMsgType, MsgBuf, MsgType, Port, TypeCheckError};
+use libc::{c_char, c_void, size_t};
+use std::ffi::CString;
+use std::ops::Deref;
+use std::time::Duration;
 
 #[doc(hidden)]
 #[repr(C)]
@@ -12,8 +16,48 @@ pub struct DcPipeline {
     pub send_msg_type_checked: unsafe fn(*mut DcPipelineInner) -> bool,
     pub check_send_msg_type: unsafe fn(*mut DcPipelineInner, Port, DcMsgType) -> bool,
     pub msg_buf: unsafe fn(*mut DcPipelineInner) -> *mut DcMsgBuf,
+    pub scratch_alloc: unsafe fn(*mut DcPipelineInner, size_t) -> *mut c_void,
+    pub submit_job: unsafe fn(*mut DcPipelineInner, DcJobFunc, *mut c_void),
+    pub wait_jobs: unsafe fn(*mut DcPipelineInner),
+    pub parallel_for: unsafe fn(*mut DcPipelineInner, size_t, DcParallelForFunc, *mut c_void),
+    pub resource: unsafe fn(*mut DcPipelineInner, *const c_char, *mut DcResource) -> bool,
+    pub timer_register: unsafe fn(*mut DcPipelineInner, u64, bool) -> u64,
+    pub timer_expired: unsafe fn(*mut DcPipelineInner, u64) -> u64,
+    pub timer_wait: unsafe fn(*mut DcPipelineInner, u64) -> u64,
+    pub timer_cancel: unsafe fn(*mut DcPipelineInner, u64),
+    pub now: unsafe fn(*mut DcPipelineInner, bool) -> DcTimestamp,
+    pub sleep: unsafe fn(*mut DcPipelineInner, u64),
+    pub metric_register: unsafe fn(*mut DcPipelineInner, *const c_char, DcMetricKind) -> u64,
+    pub metric_update: unsafe fn(*mut DcPipelineInner, u64, i64),
 }
 
+/// Point in time read from the runtime clock.
+#[repr(C)]
+#[derive(Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash, Debug, Default)]
+pub struct DcTimestamp {
+    /// `CLOCK_MONOTONIC` in nanoseconds.
+    pub monotonic_ns: u64,
+    /// Unix time in nanoseconds, derived from `monotonic_ns` and the offset between the clocks,
+    /// read again every second to follow adjustments of the system time.
+    pub realtime_ns: u64,
+}
+
+/// Shared resource acquired by `dc_resource_acquire`, loaded while it is acquired.
+#[repr(C)]
+pub struct DcResource {
+    pub data: *const u8,
+    pub len: size_t,
+    /// Reference to the resource held by the runtime.
+    pub inner: *mut c_void,
+    pub release: Option<unsafe extern "C" fn(*mut c_void)>,
+}
+
+/// Job run on the shared worker pool.
+pub type DcJobFunc = unsafe extern "C" fn(arg: *mut c_void);
+
+/// Body of a parallel loop, called with each index.
+pub type DcParallelForFunc = unsafe extern "C" fn(arg: *mut c_void, index: size_t);
+
 unsafe impl Send for DcPipeline {}
 
 /// # Safety
@@ -44,6 +88,192 @@ pub unsafe extern "C" fn dc_pipeline_msg_buf(pipeline: *mut DcPipeline) -> *mut
     (pipeline.msg_buf)(pipeline.inner)
 }
 
+/// Allocates `size` bytes from the task scratch arena. The returned memory is aligned to
+/// 16 bytes, not initialized, and released automatically when `next()` returns.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_scratch_alloc(
+    pipeline: *mut DcPipeline,
+    size: size_t,
+) -> *mut c_void {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.scratch_alloc)(pipeline.inner, size)
+}
+
+/// Runs `func(arg)` on the shared worker pool. Use `dc_pipeline_wait_jobs` to wait for it.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer. `arg` must be valid until the job finishes.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_submit_job(
+    pipeline: *mut DcPipeline,
+    func: DcJobFunc,
+    arg: *mut c_void,
+) {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.submit_job)(pipeline.inner, func, arg)
+}
+
+/// Waits for all jobs submitted by this task. The calling thread runs queued jobs meanwhile.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_wait_jobs(pipeline: *mut DcPipeline) {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.wait_jobs)(pipeline.inner)
+}
+
+/// Calls `func(arg, i)` for each `i` in `0..n` on the calling thread and the shared worker
+/// pool, and returns after all calls finish.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer. `func` must be safe to call from multiple threads.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_parallel_for(
+    pipeline: *mut DcPipeline,
+    n: size_t,
+    func: DcParallelForFunc,
+    arg: *mut c_void,
+) {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.parallel_for)(pipeline.inner, n, func, arg)
+}
+
+/// Acquires the shared resource `name` declared in the configuration into `resource`.
+/// Returns false if there is no such resource.
+///
+/// The data is read-only and stays valid from any thread until `resource` is passed to
+/// `dc_resource_release`, also after the task finishes.
+///
+/// # Safety
+/// `pipeline`, `name` and `resource` must be valid pointers.
+#[no_mangle]
+pub unsafe extern "C" fn dc_resource_acquire(
+    pipeline: *mut DcPipeline,
+    name: *const c_char,
+    resource: *mut DcResource,
+) -> bool {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.resource)(pipeline.inner, name, resource)
+}
+
+/// Releases a resource acquired by `dc_resource_acquire`. Releasing it again does nothing.
+///
+/// # Safety
+/// `resource` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_resource_release(resource: *mut DcResource) {
+    let resource: &mut DcResource = &mut *resource;
+    if let Some(release) = resource.release.take() {
+        release(resource.inner);
+    }
+    resource.data = std::ptr::null();
+    resource.len = 0;
+}
+
+/// Starts a timer of the runtime timer service that expires after `interval_ns`, and then
+/// every `interval_ns` if `periodic`. Returns the timer id used by other `dc_pipeline_timer_*`
+/// functions of this task.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_timer_register(
+    pipeline: *mut DcPipeline,
+    interval_ns: u64,
+    periodic: bool,
+) -> u64 {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.timer_register)(pipeline.inner, interval_ns, periodic)
+}
+
+/// Returns the number of expirations of the timer since the last call, without blocking.
+/// Cheap enough to call for each message.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_timer_expired(pipeline: *mut DcPipeline, timer: u64) -> u64 {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.timer_expired)(pipeline.inner, timer)
+}
+
+/// Blocks until the timer expires and returns the number of expirations since the last call.
+/// Returns 0 immediately for an unknown timer or a one-shot timer that already expired.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_timer_wait(pipeline: *mut DcPipeline, timer: u64) -> u64 {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.timer_wait)(pipeline.inner, timer)
+}
+
+/// Stops the timer.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_timer_cancel(pipeline: *mut DcPipeline, timer: u64) {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.timer_cancel)(pipeline.inner, timer)
+}
+
+/// Returns the current time. Timestamps from all tasks and plugins use the same clocks.
+/// `coarse` reads a clock updated on kernel ticks, which is cheaper for high-rate callers.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_now(pipeline: *mut DcPipeline, coarse: bool) -> DcTimestamp {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.now)(pipeline.inner, coarse)
+}
+
+/// Sleeps for `ns` nanoseconds of the runtime clock, which may be virtual.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_sleep(pipeline: *mut DcPipeline, ns: u64) {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.sleep)(pipeline.inner, ns)
+}
+
+/// Registers the metric `name`, or gets the metric already registered by any task with the
+/// same name and kind. Returns the metric id used by `dc_pipeline_metric_update`, or 0 if
+/// `name` is registered with another kind.
+///
+/// # Safety
+/// `pipeline` and `name` must be valid pointers.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_metric_register(
+    pipeline: *mut DcPipeline,
+    name: *const c_char,
+    kind: DcMetricKind,
+) -> u64 {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.metric_register)(pipeline.inner, name, kind)
+}
+
+/// Adds `value` to a counter, sets a gauge to `value`, or records `value` in a histogram.
+/// Takes no lock except for the first update of each metric in a thread.
+///
+/// # Safety
+/// `pipeline` must be a valid pointer.
+#[no_mangle]
+pub unsafe extern "C" fn dc_pipeline_metric_update(
+    pipeline: *mut DcPipeline,
+    metric: u64,
+    value: i64,
+) {
+    let pipeline: &mut DcPipeline = &mut *pipeline;
+    (pipeline.metric_update)(pipeline.inner, metric, value)
+}
+
 /// Rusty DcPipeline for ElementBuildable::next().
 pub struct Pipeline(*mut DcPipeline);
 
@@ -91,4 +321,139 @@ impl Pipeline {
             MsgBuf::new((pipeline.msg_buf)(pipeline.inner))
         }
     }
+
+    /// Calls `f` with a zeroed buffer of `len` bytes from the task scratch arena.
+    /// The buffer is released when `next()` returns instead of going through the allocator.
+    pub fn with_scratch<F, R>(&mut self, len: usize, f: F) -> R
+    where
+        F: FnOnce(&mut Pipeline, &mut [u8]) -> R,
+    {
+        let buf = unsafe {
+            let p = dc_pipeline_scratch_alloc(self.0, len) as *mut u8;
+            std::ptr::write_bytes(p, 0, len);
+            std::slice::from_raw_parts_mut(p, len)
+        };
+        f(self, buf)
+    }
+
+    /// Runs `f` on the shared worker pool. Use `wait_jobs` to wait for it.
+    pub fn submit_job<F>(&mut self, f: F)
+    where
+        F: FnOnce() + Send + 'static,
+    {
+        unsafe extern "C" fn call<F: FnOnce()>(arg: *mut c_void) {
+            let f = Box::from_raw(arg as *mut F);
+            f();
+        }
+
+        let arg = Box::into_raw(Box::new(f)) as *mut c_void;
+        unsafe { dc_pipeline_submit_job(self.0, call::<F>, arg) }
+    }
+
+    /// Waits for all jobs submitted by this task.
+    pub fn wait_jobs(&mut self) {
+        unsafe { dc_pipeline_wait_jobs(self.0) }
+    }
+
+    /// Calls `f` for each index in `0..n` in parallel on the shared worker pool.
+    pub fn parallel_for<F>(&mut self, n: usize, f: F)
+    where
+        F: Fn(usize) + Sync,
+    {
+        unsafe extern "C" fn call<F: Fn(usize)>(arg: *mut c_void, index: size_t) {
+            (*(arg as *const F))(index)
+        }
+
+        let arg = &f as *const F as *mut c_void;
+        unsafe { dc_pipeline_parallel_for(self.0, n, call::<F>, arg) }
+    }
+
+    /// Gets the shared resource `name` declared in the configuration.
+    pub fn resource(&self, name: &str) -> Option<Resource> {
+        let name = CString::new(name).ok()?;
+        let mut resource = DcResource {
+            data: std::ptr::null(),
+            len: 0,
+            inner: std::ptr::null_mut(),
+            release: None,
+        };
+        unsafe {
+            if dc_resource_acquire(self.0, name.as_ptr(), &mut resource) {
+                Some(Resource(resource))
+            } else {
+                None
+            }
+        }
+    }
+
+    /// Starts a timer that expires after `interval`, and then every `interval` if `periodic`.
+    pub fn timer_register(&mut self, interval: Duration, periodic: bool) -> u64 {
+        let interval_ns = interval.as_nanos().min(u64::MAX as u128) as u64;
+        unsafe { dc_pipeline_timer_register(self.0, interval_ns, periodic) }
+    }
+
+    /// Returns the number of expirations since the last call without blocking.
+    pub fn timer_expired(&mut self, timer: u64) -> u64 {
+        unsafe { dc_pipeline_timer_expired(self.0, timer) }
+    }
+
+    /// Blocks until the timer expires and returns the number of expirations since the last call.
+    /// Returns 0 for a one-shot timer that already expired.
+    pub fn timer_wait(&mut self, timer: u64) -> u64 {
+        unsafe { dc_pipeline_timer_wait(self.0, timer) }
+    }
+
+    /// Stops the timer.
+    pub fn timer_cancel(&mut self, timer: u64) {
+        unsafe { dc_pipeline_timer_cancel(self.0, timer) }
+    }
+
+    /// Returns the current time. `coarse` is cheaper but only as precise as kernel ticks.
+    pub fn now(&mut self, coarse: bool) -> DcTimestamp {
+        unsafe { dc_now(self.0, coarse) }
+    }
+
+    /// Sleeps for `duration` of the runtime clock, which may be virtual.
+    pub fn sleep(&mut self, duration: Duration) {
+        let ns = duration.as_nanos().min(u64::MAX as u128) as u64;
+        unsafe { dc_pipeline_sleep(self.0, ns) }
+    }
+
+    /// Registers the metric `name`, shared by tasks that register the same name and kind.
+    /// Returns `None` if `name` is registered with another kind.
+    pub fn metric_register(&mut self, name: &str, kind: DcMetricKind) -> Option<u64> {
+        let name = CString::new(name).ok()?;
+        match unsafe { dc_pipeline_metric_register(self.0, name.as_ptr(), kind) } {
+            0 => None,
+            metric => Some(metric),
+        }
+    }
+
+    /// Adds to a counter, sets a gauge, or records in a histogram.
+    pub fn metric_update(&mut self, metric: u64, value: i64) {
+        unsafe { dc_pipeline_metric_update(self.0, metric, value) }
+    }
+}
+
+/// Data of a shared resource, kept loaded until dropped.
+pub struct Resource(DcResource);
+
+unsafe impl Send for Resource {}
+unsafe impl Sync for Resource {}
+
+impl Deref for Resource {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        if self.0.len == 0 {
+            return &[];
+        }
+        unsafe { std::slice::from_raw_parts(self.0.data, self.0.len) }
+    }
+}
+
+impl Drop for Resource {
+    fn drop(&mut self) {
+        unsafe { dc_resource_release(&mut self.0) }
+    }
 }
@@ -0,0 +1,155 @@
+//! Allocations counted for each task, enabled by the `alloc-stats` feature.
+//!
+//! `CountingAllocator`, declared as the global allocator by the binary, attributes allocations
+//! to the task running on the current thread, switching to fused child tasks while they run.
+//! Allocations of other threads are counted as "other threads". Memory allocated by dynamically
+//! loaded plugins with their own allocator, such as `malloc` in C, is not counted, while
+//! buffers of the runtime they write to are.
+
+use crate::task::TaskId;
+use once_cell::sync::Lazy;
+use std::cell::Cell;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+/// Counters for tasks. Slot 0 is for other threads, and the last one for tasks that do not fit.
+const SLOTS: usize = 256;
+
+static COUNTERS: [Counters; SLOTS] = [Counters::NEW; SLOTS];
+/// Task ids of slots from 1.
+static TASKS: Lazy<Mutex<Vec<TaskId>>> = Lazy::new(Mutex::default);
+
+thread_local! {
+    static CURRENT: Cell<usize> = const { Cell::new(0) };
+}
+
+struct Counters {
+    allocs: AtomicU64,
+    frees: AtomicU64,
+    bytes: AtomicU64,
+    msgs: AtomicU64,
+}
+
+impl Counters {
+    #[allow(clippy::declare_interior_mutable_const)]
+    const NEW: Counters = Counters {
+        allocs: AtomicU64::new(0),
+        frees: AtomicU64::new(0),
+        bytes: AtomicU64::new(0),
+        msgs: AtomicU64::new(0),
+    };
+}
+
+/// Allocator counting allocations of tasks. Binaries declare it as the `#[global_allocator]`.
+#[cfg(feature = "alloc-stats")]
+pub struct CountingAllocator;
+
+#[cfg(feature = "alloc-stats")]
+unsafe impl std::alloc::GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: std::alloc::Layout) -> *mut u8 {
+        counted_alloc(layout.size());
+        std::alloc::System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: std::alloc::Layout) -> *mut u8 {
+        counted_alloc(layout.size());
+        std::alloc::System.alloc_zeroed(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: std::alloc::Layout) {
+        current().frees.fetch_add(1, Ordering::Relaxed);
+        std::alloc::System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: std::alloc::Layout, new_size: usize) -> *mut u8 {
+        let counters = current();
+        counters.allocs.fetch_add(1, Ordering::Relaxed);
+        counters.frees.fetch_add(1, Ordering::Relaxed);
+        counters.bytes.fetch_add(new_size as u64, Ordering::Relaxed);
+        std::alloc::System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[cfg(feature = "alloc-stats")]
+#[inline]
+fn counted_alloc(size: usize) {
+    let counters = current();
+    counters.allocs.fetch_add(1, Ordering::Relaxed);
+    counters.bytes.fetch_add(size as u64, Ordering::Relaxed);
+}
+
+#[inline]
+fn current() -> &'static Counters {
+    &COUNTERS[CURRENT.try_with(Cell::get).unwrap_or(0)]
+}
+
+/// Get the slot of task `id`. Replicas of a task share it.
+pub(crate) fn register(id: TaskId) -> usize {
+    if !cfg!(feature = "alloc-stats") {
+        return 0;
+    }
+    let mut tasks = TASKS.lock().unwrap();
+    let index = match tasks.iter().position(|task| *task == id) {
+        Some(index) => index,
+        None if tasks.len() < SLOTS - 2 => {
+            tasks.push(id);
+            tasks.len() - 1
+        }
+        None => SLOTS - 2,
+    };
+    index + 1
+}
+
+/// Attribute allocations of the current thread to `slot` until dropped.
+pub(crate) struct Enter(usize);
+
+pub(crate) fn enter(slot: usize) -> Enter {
+    Enter(CURRENT.with(|current| current.replace(slot)))
+}
+
+impl Drop for Enter {
+    fn drop(&mut self) {
+        CURRENT.with(|current| current.set(self.0));
+    }
+}
+
+/// Count a message sent by the current task.
+#[inline]
+pub(crate) fn msg_sent() {
+    if cfg!(feature = "alloc-stats") {
+        current().msgs.fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// Log allocations of each task since start.
+pub(crate) fn log_stats() {
+    if !cfg!(feature = "alloc-stats") {
+        return;
+    }
+    let tasks = TASKS.lock().unwrap().clone();
+    for (slot, counters) in COUNTERS.iter().enumerate() {
+        let allocs = counters.allocs.load(Ordering::Relaxed);
+        if allocs == 0 {
+            continue;
+        }
+        let name = match slot.checked_sub(1) {
+            None => "other threads".to_owned(),
+            Some(index) if index == SLOTS - 2 => "other tasks".to_owned(),
+            Some(index) => format!("task {}", tasks[index]),
+        };
+        let msgs = counters.msgs.load(Ordering::Relaxed);
+        let per_msg = if msgs > 0 {
+            format!(", {:.2} per message", allocs as f64 / msgs as f64)
+        } else {
+            String::new()
+        };
+        log::info!(
+            "{}: {} allocations{}, {} bytes allocated, {} frees",
+            name,
+            allocs,
+            per_msg,
+            counters.bytes.load(Ordering::Relaxed),
+            counters.frees.load(Ordering::Relaxed),
+        );
+    }
+}
@@ -0,0 +1,339 @@
+use crate::element::*;
+use crate::error::Error;
+use anyhow::bail;
+use common::{MsgReceiver, MsgType, Pipeline};
+use serde_derive::Deserialize;
+use serde_with::{serde_as, DurationMilliSecondsWithFrac};
+use std::io::Write;
+use std::time::Duration;
+
+/// Bytes of the sequence number and timestamp at the head of `sequence` payloads.
+pub const LOAD_GEN_HEADER_SIZE: usize = 16;
+
+/// Generate synthetic messages at a target rate.
+pub struct LoadGenSrcElement {
+    conf: LoadGenSrcElementConf,
+    rng: u64,
+    /// Payload of the largest message. Messages are prefixes of it.
+    payload: Vec<u8>,
+    seq: u64,
+    /// Start of the next burst in open-loop mode.
+    due_ns: Option<u64>,
+    /// Start of the current burst.
+    burst_due_ns: u64,
+    burst_left: usize,
+    /// Intervals of messages sent in the current burst.
+    burst_ns: f64,
+    /// Intervals of the previous burst, waited before the next one in closed-loop mode.
+    pending_ns: f64,
+    start_ns: Option<u64>,
+}
+
+/// Configuration type for `LoadGenSrcElement`
+#[derive(Debug, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct LoadGenSrcElementConf {
+    /// Target rate in messages per second. Unlimited if neither rate is given.
+    pub rate: Option<f64>,
+    /// Target rate in bytes per second.
+    pub byte_rate: Option<f64>,
+    /// The number of messages sent back to back at each step of the rate.
+    #[serde(default = "default_burst")]
+    pub burst: usize,
+    /// Send only during `on_ms`, then pause for `off_ms`, repeatedly.
+    pub on_off: Option<LoadGenOnOffConf>,
+    /// Message size, or the minimum size if `max_size` is given.
+    #[serde(default = "default_size")]
+    pub size: usize,
+    /// Maximum message size.
+    pub max_size: Option<usize>,
+    #[serde(default)]
+    pub size_distribution: LoadGenSizeDistribution,
+    #[serde(default)]
+    pub payload: LoadGenPayload,
+    /// Seed of sizes and payload bytes, so that runs are reproducible.
+    #[serde(default)]
+    pub seed: u64,
+    /// Close after sending this number of messages.
+    pub count: Option<u64>,
+    #[serde(default)]
+    pub mode: LoadGenMode,
+}
+
+/// Alternating sending and pausing periods for `LoadGenSrcElement`
+#[serde_as]
+#[derive(Debug, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct LoadGenOnOffConf {
+    #[serde_as(as = "DurationMilliSecondsWithFrac<f64>")]
+    pub on_ms: Duration,
+    #[serde_as(as = "DurationMilliSecondsWithFrac<f64>")]
+    pub off_ms: Duration,
+}
+
+/// Distribution of message sizes between `size` and `max_size`
+#[derive(Clone, Copy, Debug, Default, Deserialize)]
+#[serde(rename_all = "kebab-case")]
+pub enum LoadGenSizeDistribution {
+    #[default]
+    Uniform,
+    /// Mostly small messages. The mean is a quarter of the range above `size`.
+    Exponential,
+}
+
+/// Content of messages for `LoadGenSrcElement`
+#[derive(Clone, Copy, Debug, Default, Deserialize)]
+#[serde(rename_all = "kebab-case")]
+pub enum LoadGenPayload {
+    /// Big endian sequence number and send time in nanoseconds of the runtime clock,
+    /// followed by pattern bytes.
+    #[default]
+    Sequence,
+    /// Pseudo random bytes from `seed`.
+    Pattern,
+    Zero,
+}
+
+/// Scheduling of `LoadGenSrcElement`
+#[derive(Clone, Copy, Debug, Default, Deserialize)]
+#[serde(rename_all = "kebab-case")]
+pub enum LoadGenMode {
+    /// Send on a fixed schedule. Sending late does not shift later messages.
+    #[default]
+    OpenLoop,
+    /// Wait the interval after each burst is accepted by the downstream.
+    ClosedLoop,
+}
+
+fn default_burst() -> usize {
+    1
+}
+
+fn default_size() -> usize {
+    64
+}
+
+impl ElementBuildable for LoadGenSrcElement {
+    type Config = LoadGenSrcElementConf;
+
+    const NAME: &'static str = "load-gen-src";
+
+    const SEND_PORTS: Port = 1;
+
+    fn new(mut conf: Self::Config) -> Result<Self, Error> {
+        if conf.rate.is_some() && conf.byte_rate.is_some() {
+            bail!("load-gen-src accepts only one of rate and byte_rate");
+        }
+        if conf
+            .rate
+            .into_iter()
+            .chain(conf.byte_rate)
+            .any(|rate| rate <= 0.0)
+        {
+            bail!("rate of load-gen-src must be positive");
+        }
+        if conf.max_size.map_or(false, |max_size| max_size < conf.size) {
+            bail!("max_size of load-gen-src is less than size");
+        }
+        conf.burst = conf.burst.max(1);
+
+        let mut rng = conf.seed;
+        let max_size = conf.max_size.unwrap_or(conf.size);
+        let payload = match conf.payload {
+            LoadGenPayload::Zero => vec![0; max_size],
+            LoadGenPayload::Sequence | LoadGenPayload::Pattern => {
+                (0..max_size).map(|_| splitmix64(&mut rng) as u8).collect()
+            }
+        };
+
+        Ok(LoadGenSrcElement {
+            conf,
+            rng,
+            payload,
+            seq: 0,
+            due_ns: None,
+            burst_due_ns: 0,
+            burst_left: 0,
+            burst_ns: 0.0,
+            pending_ns: 0.0,
+            start_ns: None,
+        })
+    }
+
+    fn next(&mut self, pipeline: &mut Pipeline, _receiver: &mut MsgReceiver) -> ElementResult {
+        if !pipeline.send_msg_type_checked() {
+            pipeline.check_send_msg_type(0, MsgType::binary)?;
+        }
+        if self.conf.count.map_or(false, |count| self.seq >= count) {
+            return Ok(ElementValue::Close);
+        }
+
+        if self.burst_left == 0 {
+            let now = pipeline.now(false).monotonic_ns;
+            let due = self.start_burst(now);
+            if due > now {
+                pipeline.sleep(Duration::from_nanos(due - now));
+            }
+        }
+
+        let size = self.next_size();
+        let mut buf = pipeline.msg_buf(0);
+        let body = if let LoadGenPayload::Sequence = self.conf.payload {
+            let header = sequence_header(self.seq, self.burst_due_ns);
+            let header_len = size.min(LOAD_GEN_HEADER_SIZE);
+            buf.write_all(&header[..header_len])?;
+            &self.payload[header_len..size]
+        } else {
+            &self.payload[..size]
+        };
+        buf.write_all(body)?;
+        self.sent(size);
+
+        Ok(ElementValue::MsgBuf)
+    }
+}
+
+impl LoadGenSrcElement {
+    /// Get the time the next burst is due at `now` and start it.
+    fn start_burst(&mut self, now: u64) -> u64 {
+        let start = *self.start_ns.get_or_insert(now);
+        let mut due = match self.conf.mode {
+            LoadGenMode::OpenLoop => self.due_ns.unwrap_or(now),
+            LoadGenMode::ClosedLoop => now + self.pending_ns as u64,
+        };
+
+        if let Some(on_off) = &self.conf.on_off {
+            let on = on_off.on_ms.as_nanos() as u64;
+            let cycle = on + on_off.off_ms.as_nanos() as u64;
+            if cycle > 0 {
+                let phase = (due - start) % cycle;
+                if phase >= on {
+                    due += cycle - phase;
+                }
+            }
+        }
+
+        self.burst_due_ns = due;
+        self.burst_left = self.conf.burst;
+        due
+    }
+
+    /// Account a message of `size` bytes in the current burst.
+    fn sent(&mut self, size: usize) {
+        self.seq += 1;
+        self.burst_ns += self.interval_ns(size);
+        self.burst_left -= 1;
+        if self.burst_left == 0 {
+            match self.conf.mode {
+                LoadGenMode::OpenLoop => {
+                    self.due_ns = Some(self.burst_due_ns + self.burst_ns as u64);
+                }
+                LoadGenMode::ClosedLoop => self.pending_ns = self.burst_ns,
+            }
+            self.burst_ns = 0.0;
+        }
+    }
+
+    fn next_size(&mut self) -> usize {
+        let min = self.conf.size;
+        let range = match self.conf.max_size {
+            Some(max_size) if max_size > min => (max_size - min) as u64,
+            _ => return min,
+        };
+        let extra = match self.conf.size_distribution {
+            LoadGenSizeDistribution::Uniform => splitmix64(&mut self.rng) % (range + 1),
+            LoadGenSizeDistribution::Exponential => {
+                // Uniform in (0, 1].
+                let u = ((splitmix64(&mut self.rng) >> 11) + 1) as f64 / (1u64 << 53) as f64;
+                ((-u.ln() * range as f64 / 4.0) as u64).min(range)
+            }
+        };
+        min + extra as usize
+    }
+
+    fn interval_ns(&self, size: usize) -> f64 {
+        if let Some(rate) = self.conf.rate {
+            1e9 / rate
+        } else if let Some(byte_rate) = self.conf.byte_rate {
+            size as f64 * 1e9 / byte_rate
+        } else {
+            0.0
+        }
+    }
+}
+
+/// Big endian sequence number and send time at the head of `sequence` payloads.
+fn sequence_header(seq: u64, time_ns: u64) -> [u8; LOAD_GEN_HEADER_SIZE] {
+    let mut header = [0; LOAD_GEN_HEADER_SIZE];
+    header[..8].copy_from_slice(&seq.to_be_bytes());
+    header[8..].copy_from_slice(&time_ns.to_be_bytes());
+    header
+}
+
+fn splitmix64(state: &mut u64) -> u64 {
+    *state = state.wrapping_add(0x9e3779b97f4a7c15);
+    let mut z = *state;
+    z = (z ^ (z >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)).wrapping_mul(0x94d049bb133111eb);
+    z ^ (z >> 31)
+}
+
+#[test]
+fn load_gen_test() {
+    let conf = |size_distribution| LoadGenSrcElementConf {
+        rate: Some(1000.0),
+        byte_rate: None,
+        burst: 2,
+        on_off: Some(LoadGenOnOffConf {
+            on_ms: Duration::from_millis(3),
+            off_ms: Duration::from_millis(2),
+        }),
+        size: 16,
+        max_size: Some(1024),
+        size_distribution,
+        payload: LoadGenPayload::Sequence,
+        seed: 1,
+        count: None,
+        mode: LoadGenMode::OpenLoop,
+    };
+
+    // The same seed gives the same sizes.
+    for distribution in [
+        LoadGenSizeDistribution::Uniform,
+        LoadGenSizeDistribution::Exponential,
+    ] {
+        let mut a = LoadGenSrcElement::new(conf(distribution)).unwrap();
+        let mut b = LoadGenSrcElement::new(conf(distribution)).unwrap();
+        assert_eq!(a.payload, b.payload);
+        let sizes: Vec<usize> = (0..1000).map(|_| a.next_size()).collect();
+        assert!(sizes.iter().all(|size| (16..=1024).contains(size)));
+        assert!(sizes
+            .iter()
+            .eq((0..1000).map(|_| b.next_size()).collect::<Vec<_>>().iter()));
+        let mean = sizes.iter().sum::<usize>() as f64 / sizes.len() as f64;
+        match distribution {
+            LoadGenSizeDistribution::Uniform => assert!((470.0..570.0).contains(&mean)),
+            LoadGenSizeDistribution::Exponential => assert!((230.0..300.0).contains(&mean)),
+        }
+    }
+
+    let header = sequence_header(0x0102, 0x0a0b0c);
+    assert_eq!(header[..8], [0, 0, 0, 0, 0, 0, 1, 2]);
+    assert_eq!(header[8..], [0, 0, 0, 0, 0, 0x0a, 0x0b, 0x0c]);
+
+    // Bursts of 2 messages every 2 ms, skipping the 2 ms off period after 3 ms on.
+    let mut element = LoadGenSrcElement::new(conf(LoadGenSizeDistribution::Uniform)).unwrap();
+    let mut dues = Vec::new();
+    for _ in 0..6 {
+        let due = element.start_burst(*dues.last().unwrap_or(&0));
+        dues.push(due);
+        element.sent(16);
+        assert_eq!(element.burst_left, 1);
+        element.sent(16);
+    }
+    assert_eq!(element.seq, 12);
+    assert_eq!(
+        dues,
+        [0, 2, 5, 7, 10, 12].map(|ms: u64| ms * 1_000_000).to_vec()
+    );
+}
@@ -9,6 +9,7 @@ use serde_derive::Deserialize;
 pub struct EmptyElementConf {}
 
 mod file;
+mod load_gen;
 mod null;
 mod print_log;
 mod process;
@@ -17,6 +18,7 @@ mod stdout;
 mod text;
 
 pub use file::*;
+pub use load_gen::*;
 pub use null::*;
 pub use print_log::*;
 pub use process::*;
@@ -27,6 +29,7 @@ pub use text::*;
 pub(crate) fn append_to_bank(bank: &mut ElementBank) {
     bank.append_from_buildable::<FileSinkElement>().unwrap();
     bank.append_from_buildable::<FileSrcElement>().unwrap();
+    bank.append_from_buildable::<LoadGenSrcElement>().unwrap();
     bank.append_from_buildable::<PrintLogFilterElement>()
         .unwrap();
     bank.append_from_buildable::<StatFilterElement>().unwrap();
@@ -1,12 +1,61 @@
+use crate::base::LOAD_GEN_HEADER_SIZE;
 use crate::element::*;
 use crate::error::Error;
+use crate::histogram::Histogram;
 use common::{MsgReceiver, MsgType, Pipeline};
+use serde_derive::Deserialize;
+use std::sync::{Arc, Mutex};
+
+/// Interval to hand a copy of the measurement to the finalizer while receiving.
+const PUBLISH_INTERVAL_NS: u64 = 1_000_000_000;
 
 /// Null message sink.
-pub struct NullSinkElement;
+pub struct NullSinkElement {
+    measurement: Option<Box<Measurement>>,
+    /// Measurement handed to the finalizer, periodically and when receiving ends.
+    report: Arc<Mutex<Report>>,
+    published_ns: u64,
+    load_gen_header: bool,
+}
+
+#[derive(Default)]
+struct Report {
+    measurement: Option<Box<Measurement>>,
+    /// The measurement is final, not a periodic copy.
+    finished: bool,
+}
+
+/// Configuration type for `NullSinkElement`
+#[derive(Debug, Default, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct NullSinkElementConf {
+    /// Measure received messages and print a summary at shutdown.
+    #[serde(default)]
+    pub measure: bool,
+    /// Measure latency, loss and reordering from headers added by `load-gen-src`.
+    #[serde(default)]
+    pub load_gen_header: bool,
+}
+
+#[derive(Clone, Default)]
+struct Measurement {
+    msgs: u64,
+    bytes: u64,
+    first_ns: u64,
+    last_ns: u64,
+    inter_arrival: Histogram,
+    last_gap_ns: Option<u64>,
+    /// Sum of differences between consecutive inter-arrival times.
+    jitter_ns: u128,
+    latency: Histogram,
+    /// Next expected sequence number for each port.
+    next_seq: Vec<u64>,
+    lost: u64,
+    reordered: u64,
+}
 
 impl ElementBuildable for NullSinkElement {
-    type Config = crate::base::EmptyElementConf;
+    type Config = NullSinkElementConf;
 
     const NAME: &'static str = "null-sink";
 
@@ -16,13 +65,168 @@ impl ElementBuildable for NullSinkElement {
         vec![vec![MsgType::any(); Self::RECV_PORTS as usize]]
     }
 
-    fn new(_conf: Self::Config) -> Result<Self, Error> {
-        Ok(NullSinkElement)
+    fn new(conf: Self::Config) -> Result<Self, Error> {
+        let measurement = conf.measure.then(|| {
+            Box::new(Measurement {
+                next_seq: vec![0; Self::RECV_PORTS as usize],
+                ..Default::default()
+            })
+        });
+        Ok(NullSinkElement {
+            measurement,
+            report: Arc::default(),
+            published_ns: 0,
+            load_gen_header: conf.load_gen_header,
+        })
     }
 
-    fn next(&mut self, _pipeline: &mut Pipeline, receiver: &mut MsgReceiver) -> ElementResult {
+    fn next(&mut self, pipeline: &mut Pipeline, receiver: &mut MsgReceiver) -> ElementResult {
+        if self.measurement.is_none() {
+            loop {
+                let _msg = receiver.recv_any_port()?;
+            }
+        }
+
         loop {
-            let _msg = receiver.recv_any_port()?;
+            let (port, msg) = match receiver.recv_any_port() {
+                Ok(received) => received,
+                Err(e) => {
+                    // The runtime may exit before the element is dropped.
+                    self.publish(true);
+                    return Err(e.into());
+                }
+            };
+            let now = pipeline.now(false).monotonic_ns;
+            let measurement = self.measurement.as_mut().unwrap();
+            measurement.record(now, msg.as_bytes().len());
+            if self.load_gen_header {
+                measurement.record_header(now, port, msg.as_bytes());
+            }
+            if now.saturating_sub(self.published_ns) >= PUBLISH_INTERVAL_NS {
+                self.published_ns = now;
+                self.publish(false);
+            }
+        }
+    }
+
+    fn finalizer(&mut self) -> Result<Option<ElementFinalizer>, Error> {
+        if self.measurement.is_none() {
+            return Ok(None);
+        }
+        let report = self.report.clone();
+        let load_gen_header = self.load_gen_header;
+        Ok(Some(Box::new(move || {
+            let report = report.lock().unwrap();
+            if !report.finished {
+                log::warn!("null-sink did not finish, printing its last periodic measurement");
+            }
+            if let Some(measurement) = &report.measurement {
+                measurement.print(load_gen_header);
+            }
+            Ok(())
+        })))
+    }
+}
+
+impl NullSinkElement {
+    /// Hand the measurement to the finalizer, or a copy of it unless `finished`.
+    fn publish(&mut self, finished: bool) {
+        let measurement = if finished {
+            self.measurement.take()
+        } else {
+            self.measurement.clone()
+        };
+        if measurement.is_some() {
+            *self.report.lock().unwrap() = Report {
+                measurement,
+                finished,
+            };
         }
     }
 }
+
+impl Drop for NullSinkElement {
+    fn drop(&mut self) {
+        self.publish(true);
+    }
+}
+
+impl Measurement {
+    fn record(&mut self, now: u64, size: usize) {
+        if self.msgs == 0 {
+            self.first_ns = now;
+        } else {
+            let gap = now.saturating_sub(self.last_ns);
+            self.inter_arrival.record(gap);
+            if let Some(last_gap) = self.last_gap_ns {
+                self.jitter_ns += gap.abs_diff(last_gap) as u128;
+            }
+            self.last_gap_ns = Some(gap);
+        }
+        self.last_ns = now;
+        self.msgs += 1;
+        self.bytes += size as u64;
+    }
+
+    fn record_header(&mut self, now: u64, port: Port, msg: &[u8]) {
+        if msg.len() < LOAD_GEN_HEADER_SIZE {
+            return;
+        }
+        let seq = u64::from_be_bytes(msg[..8].try_into().unwrap());
+        let sent = u64::from_be_bytes(msg[8..16].try_into().unwrap());
+        self.latency.record(now.saturating_sub(sent));
+
+        let next_seq = &mut self.next_seq[port as usize];
+        if seq >= *next_seq {
+            self.lost += seq - *next_seq;
+            *next_seq = seq + 1;
+        } else {
+            // A late message fills a gap counted as lost.
+            self.reordered += 1;
+            self.lost = self.lost.saturating_sub(1);
+        }
+    }
+
+    fn print(&self, load_gen_header: bool) {
+        let secs = self.last_ns.saturating_sub(self.first_ns) as f64 / 1e9;
+        let (rate, byte_rate) = if secs > 0.0 {
+            (self.msgs as f64 / secs, self.bytes as f64 / secs)
+        } else {
+            (0.0, 0.0)
+        };
+        let jitter = if self.msgs > 2 {
+            self.jitter_ns as f64 / (self.msgs - 2) as f64
+        } else {
+            0.0
+        };
+        eprintln!(
+            "null-sink: {} msgs, {} bytes in {:.3} s, {:.1} msgs/s, {:.1} bytes/s",
+            self.msgs, self.bytes, secs, rate, byte_rate
+        );
+        eprintln!(
+            "null-sink: inter-arrival {}, jitter {:.0} ns",
+            summary(&self.inter_arrival),
+            jitter
+        );
+        if load_gen_header {
+            eprintln!(
+                "null-sink: latency {}, lost {}, reordered {}",
+                summary(&self.latency),
+                self.lost,
+                self.reordered
+            );
+        }
+    }
+}
+
+fn summary(h: &Histogram) -> String {
+    format!(
+        "min {} mean {:.0} p50 {} p99 {} p99.9 {} max {} ns",
+        h.min(),
+        h.mean(),
+        h.value_at_quantile(0.5),
+        h.value_at_quantile(0.99),
+        h.value_at_quantile(0.999),
+        h.max()
+    )
+}
@@ -4,14 +4,14 @@ use common::{MsgReceiver, MsgType, Pipeline};
 use serde_derive::Deserialize;
 use serde_with::{serde_as, DurationMilliSecondsWithFrac};
 use std::io::Write;
-use std::time::{Duration, Instant};
+use std::time::Duration;
 
 /// Count passed message size and print statistics.
 pub struct PrintLogFilterElement {
     conf: PrintLogFilterElementConf,
     count: usize,
     bytes: usize,
-    before: Instant,
+    timer: Option<u64>,
 }
 
 /// Configuration type for `PrintLogFilterElement`
@@ -51,7 +51,7 @@ impl ElementBuildable for PrintLogFilterElement {
             conf,
             count: 0,
             bytes: 0,
-            before: Instant::now(),
+            timer: None,
         })
     }
 
@@ -61,23 +61,24 @@ impl ElementBuildable for PrintLogFilterElement {
         self.count += 1;
         self.bytes += msg_size;
 
-        let now = Instant::now();
-        let since = now.duration_since(self.before);
+        let interval = self.conf.interval_ms;
+        let due = interval.is_zero() || {
+            let timer = *self
+                .timer
+                .get_or_insert_with(|| pipeline.timer_register(interval, true));
+            pipeline.timer_expired(timer) > 0
+        };
 
-        if since > self.conf.interval_ms {
-            let s = format!(
-                "[{}] {} msgs, {} bytes",
-                self.conf.tag, self.count, self.bytes
-            );
+        if due {
+            let (tag, count, bytes) = (&self.conf.tag, self.count, self.bytes);
             match self.conf.output {
                 PrintLogFilterElementConfOutput::LogTrace => {
-                    log::trace!("{}", s);
+                    log::trace!("[{}] {} msgs, {} bytes", tag, count, bytes);
                 }
                 PrintLogFilterElementConfOutput::Stderr => {
-                    eprintln!("{}", s);
+                    eprintln!("[{}] {} msgs, {} bytes", tag, count, bytes);
                 }
             }
-            self.before = now;
             self.count = 0;
             self.bytes = 0;
         }
@@ -4,14 +4,14 @@ use common::{MsgReceiver, MsgType, Pipeline};
 use serde_derive::Deserialize;
 use serde_with::{serde_as, DurationMilliSecondsWithFrac};
 use std::io::Write;
-use std::time::{Duration, Instant};
+use std::time::Duration;
 
 /// Count passed message size and print statistics.
 pub struct StatFilterElement {
     conf: StatFilterElementConf,
     count: usize,
     total_msg_size: usize,
-    before: Instant,
+    timer: Option<u64>,
 }
 
 /// Configuration type for `StatFilterElement`
@@ -41,7 +41,7 @@ impl ElementBuildable for StatFilterElement {
             conf,
             count: 0,
             total_msg_size: 0,
-            before: Instant::now(),
+            timer: None,
         })
     }
 
@@ -51,15 +51,19 @@ impl ElementBuildable for StatFilterElement {
         self.count += 1;
         self.total_msg_size += msg_size;
 
-        let now = Instant::now();
-        let since = now.duration_since(self.before);
+        let interval = self.conf.interval_ms;
+        let due = interval.is_zero() || {
+            let timer = *self
+                .timer
+                .get_or_insert_with(|| pipeline.timer_register(interval, true));
+            pipeline.timer_expired(timer) > 0
+        };
 
-        if since > self.conf.interval_ms {
+        if due {
             eprintln!(
                 "count = {}, total_msg_size = {}",
                 self.count, self.total_msg_size
             );
-            self.before = now;
         }
 
         let mut buf = pipeline.msg_buf(0);
@@ -4,13 +4,13 @@ use common::{MsgReceiver, MsgType, Pipeline};
 use serde_derive::Deserialize;
 use serde_with::{serde_as, DurationMilliSecondsWithFrac};
 use std::io::Write;
-use std::thread::sleep;
 use std::time::Duration;
 
 /// Generate text message.
 pub struct TextSrcElement {
     conf: TextSrcElementConf,
     count: usize,
+    timer: Option<u64>,
 }
 
 /// Configuration type for `TextSrcElement`
@@ -41,7 +41,11 @@ impl ElementBuildable for TextSrcElement {
         if conf.repeat == 0 {
             conf.repeat = 1;
         }
-        Ok(TextSrcElement { conf, count: 0 })
+        Ok(TextSrcElement {
+            conf,
+            count: 0,
+            timer: None,
+        })
     }
 
     fn next(&mut self, pipeline: &mut Pipeline, _receiver: &mut MsgReceiver) -> ElementResult {
@@ -49,13 +53,19 @@ impl ElementBuildable for TextSrcElement {
             pipeline.check_send_msg_type(0, MsgType::binary)?;
         }
 
-        let mut buf = pipeline.msg_buf(0);
-
         self.count += 1;
         if self.count == self.conf.repeat {
-            sleep(self.conf.interval_ms);
+            if !self.conf.interval_ms.is_zero() {
+                let interval = self.conf.interval_ms;
+                let timer = *self
+                    .timer
+                    .get_or_insert_with(|| pipeline.timer_register(interval, true));
+                pipeline.timer_wait(timer);
+            }
             self.count = 0;
         }
+
+        let mut buf = pipeline.msg_buf(0);
         buf.write_all(self.conf.text.as_bytes())?;
 
         Ok(ElementValue::MsgBuf)
@@ -0,0 +1,124 @@
+//! Internals used by the benchmarks in `benches/`. Not a stable API.
+
+use crate::channel::{ChannelBuilder, EdgeOptions, EdgeSender};
+use crate::conf::{MemoryBudgetPolicy, TaskConf};
+use crate::element::{ElementBank, ElementNextBoxed};
+use crate::msg_buf::MsgBufInner;
+use crate::pipeline::PipelineInner;
+use crate::resource::ResourceRegistry;
+use crate::task::TaskId;
+use crate::type_check::TypeChecker;
+use crate::ElementConf;
+use anyhow::Result;
+use common::{DcMsg, DcMsgReceiver, DcPipeline, DcPlugin, ElementResult, Msg, SendableMsg};
+use std::sync::Arc;
+
+pub use crate::msg_buf::msg_clone;
+
+/// A task whose sending port 0 is connected to its own receiving port 0.
+pub struct Loopback {
+    pipeline: DcPipeline,
+    receiver: DcMsgReceiver,
+    sender: EdgeSender,
+    next: ElementNextBoxed,
+}
+
+impl Loopback {
+    /// Build `element` of `bank` with the default configuration.
+    pub fn new(bank: &ElementBank, element: &str, capacity: usize) -> Result<Self> {
+        let task_conf: TaskConf = serde_json::from_value(serde_json::json!({
+            "id": 1,
+            "element": element,
+            "from": [["1"]],
+        }))?;
+        let tc = TypeChecker::new(bank, &[task_conf])?;
+        let mut pipeline = PipelineInner::new(tc, Arc::new(ResourceRegistry::default()));
+        pipeline.self_taskid = Some(TaskId(1));
+
+        let (recv_ports, send_ports) = bank.ports(element)?;
+        let mut builder = ChannelBuilder::new(
+            recv_ports,
+            send_ports,
+            EdgeOptions {
+                capacity,
+                max_batch: 1,
+                budget: None,
+                budget_policy: MemoryBudgetPolicy::default(),
+            },
+        );
+        let sender = builder.get_sender(0);
+        let (_, receiver) = builder.build().split();
+
+        let next = bank
+            .pre_build(element, ElementConf::default())?
+            .build()?
+            .next_boxed;
+
+        Ok(Loopback {
+            pipeline: pipeline.into_ffi(),
+            receiver: receiver.into_ffi(),
+            sender,
+            next,
+        })
+    }
+
+    pub fn pipeline(&mut self) -> *mut DcPipeline {
+        &mut self.pipeline
+    }
+
+    pub fn receiver(&mut self) -> *mut DcMsgReceiver {
+        &mut self.receiver
+    }
+
+    /// Call `next` of the element once.
+    pub fn next(&mut self) -> ElementResult {
+        let result = (self.next)(&mut self.pipeline, &mut self.receiver);
+        self.pipeline_inner().scratch.reset();
+        result
+    }
+
+    /// Send a copy of the message buffer to the receiving port, as a task does after `next`.
+    pub fn send_msg_buf(&mut self) {
+        let msg = unsafe { Msg::new(self.get_msg_cloned()) };
+        let _ = self.sender.send(SendableMsg(msg));
+    }
+
+    /// Send `data` to the receiving port.
+    pub fn send(&mut self, data: &[u8]) {
+        let _ = self
+            .sender
+            .send(msg_clone(&unsafe { Msg::new(borrowed(data)) }));
+    }
+
+    /// Copy the message buffer into an owned message.
+    pub fn get_msg_cloned(&mut self) -> DcMsg {
+        let msg_buf = self.pipeline_inner().msg_buf.inner as *mut MsgBufInner;
+        unsafe { (*msg_buf).get_msg_cloned() }
+    }
+
+    fn pipeline_inner(&mut self) -> &mut PipelineInner {
+        unsafe { &mut *(self.pipeline.inner as *mut PipelineInner) }
+    }
+}
+
+/// Register elements of a plugin linked into the benchmark binary.
+///
+/// # Safety
+/// `dc_load` must follow the plugin ABI.
+pub unsafe fn load_plugin(
+    bank: &mut ElementBank,
+    dc_load: unsafe extern "C" fn(*mut DcPlugin) -> bool,
+) -> Result<()> {
+    crate::loaded_plugin::load_plugin(bank, dc_load, "benchmark")
+}
+
+fn borrowed(data: &[u8]) -> DcMsg {
+    DcMsg {
+        inner: common::DcMsgInner {
+            msg_ref: data.as_ptr(),
+        },
+        len: data.len(),
+        capacity: 0,
+        drop: None,
+    }
+}
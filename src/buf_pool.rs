@@ -0,0 +1,160 @@
+//! Pools of message buffers.
+
+use crate::conf::BufferPoolConf;
+use anyhow::{bail, Result};
+use common::{DcMsg, DcMsgInner};
+use crossbeam_channel::{bounded, Receiver, Sender};
+use std::io;
+
+const HUGE_PAGE_SIZE: usize = 2 * 1024 * 1024;
+const PAGE_SIZE: usize = 4096;
+
+/// Space before the data of each buffer. Holds a pointer to the owner pool.
+const HEADER_SIZE: usize = 64;
+
+const MPOL_PREFERRED: libc::c_int = 1;
+
+/// Fixed size buffers for messages sent by one task.
+///
+/// Pools are leaked when built because sent messages may outlive the task.
+pub struct BufPool {
+    buf_size: usize,
+    free_sender: Sender<usize>,
+    free_receiver: Receiver<usize>,
+}
+
+impl BufPool {
+    /// Map a pool. Memory is bound to `numa_node` if given.
+    pub fn new(conf: &BufferPoolConf, numa_node: Option<usize>) -> Result<&'static BufPool> {
+        if conf.bufs == 0 {
+            bail!("buffer pool must have at least one buffer");
+        }
+
+        let slot_size = round_up(HEADER_SIZE + conf.buf_size, HEADER_SIZE);
+        let len = slot_size * conf.bufs;
+        let (region, len, huge) = map_region(len, conf.huge_pages)?;
+
+        if let Some(node) = numa_node {
+            if let Err(e) = bind_node(region, len, node) {
+                log::warn!("cannot bind buffer pool to NUMA node {}: {}", node, e);
+            }
+        }
+
+        if conf.prefault {
+            for offset in (0..len).step_by(PAGE_SIZE) {
+                unsafe { std::ptr::write_volatile(region.add(offset), 0) };
+            }
+        }
+
+        let (free_sender, free_receiver) = bounded(conf.bufs);
+        let pool: &'static BufPool = Box::leak(Box::new(BufPool {
+            buf_size: conf.buf_size,
+            free_sender,
+            free_receiver,
+        }));
+
+        for i in 0..conf.bufs {
+            unsafe {
+                let slot = region.add(slot_size * i);
+                *(slot as *mut *const BufPool) = pool;
+                pool.free_sender.send(slot as usize).unwrap();
+            }
+        }
+
+        log::info!(
+            "buffer pool mapped: {} x {} bytes, huge pages: {}, NUMA node: {:?}",
+            conf.bufs,
+            conf.buf_size,
+            huge,
+            numa_node
+        );
+
+        Ok(pool)
+    }
+
+    /// Copy `data` into a pooled buffer.
+    /// Returns None if `data` is too large or no buffer is free.
+    pub fn get_msg(&self, data: &[u8]) -> Option<DcMsg> {
+        if data.len() > self.buf_size {
+            return None;
+        }
+        let slot = self.free_receiver.try_recv().ok()? as *mut u8;
+
+        unsafe {
+            let p = slot.add(HEADER_SIZE);
+            std::ptr::copy_nonoverlapping(data.as_ptr(), p, data.len());
+            Some(DcMsg {
+                inner: DcMsgInner { owned: p },
+                len: data.len(),
+                capacity: self.buf_size,
+                drop: Some(pooled_msg_drop),
+            })
+        }
+    }
+}
+
+unsafe extern "C" fn pooled_msg_drop(p: *mut u8, _len: usize, _capacity: usize) {
+    let slot = p.sub(HEADER_SIZE);
+    let pool: &BufPool = &**(slot as *const *const BufPool);
+    let _ = pool.free_sender.try_send(slot as usize);
+}
+
+fn round_up(n: usize, align: usize) -> usize {
+    (n + align - 1) / align * align
+}
+
+/// Map anonymous memory. Tries explicit huge pages first, then transparent huge pages.
+fn map_region(len: usize, huge_pages: bool) -> Result<(*mut u8, usize, bool)> {
+    let prot = libc::PROT_READ | libc::PROT_WRITE;
+    let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS;
+
+    if huge_pages {
+        let huge_len = round_up(len, HUGE_PAGE_SIZE);
+        let p = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                huge_len,
+                prot,
+                flags | libc::MAP_HUGETLB,
+                -1,
+                0,
+            )
+        };
+        if p != libc::MAP_FAILED {
+            return Ok((p as *mut u8, huge_len, true));
+        }
+        log::debug!("huge pages unavailable, fall back to transparent huge pages");
+    }
+
+    let p = unsafe { libc::mmap(std::ptr::null_mut(), len, prot, flags, -1, 0) };
+    if p == libc::MAP_FAILED {
+        bail!("cannot map buffer pool: {}", io::Error::last_os_error());
+    }
+    if huge_pages {
+        unsafe { libc::madvise(p, len, libc::MADV_HUGEPAGE) };
+    }
+    Ok((p as *mut u8, len, false))
+}
+
+fn bind_node(region: *mut u8, len: usize, node: usize) -> io::Result<()> {
+    const MASK_BITS: usize = 64;
+    if node >= MASK_BITS {
+        return Err(io::Error::from(io::ErrorKind::InvalidInput));
+    }
+    let mask: u64 = 1 << node;
+    let result = unsafe {
+        libc::syscall(
+            libc::SYS_mbind,
+            region,
+            len,
+            MPOL_PREFERRED,
+            &mask as *const u64,
+            MASK_BITS + 1,
+            0,
+        )
+    };
+    if result != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
@@ -1,10 +1,63 @@
+use crate::conf::{MemoryBudgetPolicy, WaitConf};
 use crate::element::Port;
 use crate::error::ReceiveError;
+use crate::mem_budget::EdgeAccount;
 // use crate::message::{ReceivedMsg, ReceivedMsgInner, SendableMsg};
 use crate::msg_buf::msg_clone;
 use crate::task::ChildTask;
+use crate::task_stats;
+use crate::trace::{self, Kind};
+use crate::usdt::probe;
+use crate::virtual_time;
+use crate::wait::Waiter;
+use crate::watchdog;
 use common::{DcMsg, DcMsgReceiver, DcMsgReceiverInner, Msg, SendableMsg};
-use crossbeam_channel::{bounded, Receiver, Select, SendError, Sender};
+use crossbeam_channel::{bounded, Receiver, SendError, Sender, TryRecvError, TrySendError};
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+/// Capacity of each receiving port if not configured.
+pub const DEFAULT_CHANNEL_CAPACITY: usize = 16;
+
+/// Maximum number of messages in a batch if not configured.
+pub const DEFAULT_MAX_BATCH: usize = 16;
+
+/// Options for the edges to receiving ports of one task.
+#[derive(Clone, Copy, Debug)]
+pub struct EdgeOptions {
+    /// Capacity of the queue in envelopes.
+    pub capacity: usize,
+    /// Maximum number of messages in one envelope. 1 disables batching.
+    pub max_batch: usize,
+    pub budget: Option<usize>,
+    pub budget_policy: MemoryBudgetPolicy,
+}
+
+/// Item in a queue. Messages are batched while the receiver is busy.
+enum Envelope {
+    One(Queued),
+    Batch(Vec<Queued>),
+}
+
+/// Message in a queue with the id linking its send and receive in the trace.
+struct Queued {
+    msg: SendableMsg,
+    flow_id: u64,
+}
+
+/// Messages held back by a sender while the queue is not empty.
+///
+/// The receiver takes them when it finds the queue empty, so that a held message
+/// never waits for the next send.
+type PendingBatch = Arc<Pending>;
+
+#[derive(Default)]
+struct Pending {
+    msgs: Mutex<Vec<Queued>>,
+    /// Whether `msgs` may not be empty, so that the lock is skipped while nothing is held.
+    held: AtomicBool,
+}
 
 pub struct Channel {
     pub(crate) sender: MsgSender,
@@ -18,15 +71,16 @@ impl Channel {
 }
 
 pub(crate) struct MsgSender {
-    mpsc_channel: Vec<Vec<Sender<SendableMsg>>>,
+    mpsc_channel: Vec<Vec<EdgeSender>>,
 }
 
 impl MsgSender {
     pub fn send(&self, msg: SendableMsg, port: Port) -> Result<(), SendError<SendableMsg>> {
-        let sender = &self.mpsc_channel[port as usize];
+        let senders = &self.mpsc_channel[port as usize];
+        probe!(send, port, msg.0.as_bytes().len());
 
-        for (i, sender) in sender.iter().enumerate() {
-            if i == self.mpsc_channel.len() - 1 {
+        for (i, sender) in senders.iter().enumerate() {
+            if i == senders.len() - 1 {
                 sender.send(msg)?;
                 return Ok(());
             }
@@ -36,41 +90,312 @@ impl MsgSender {
     }
 }
 
+/// Sender to a receiving port of other task.
+#[derive(Clone)]
+pub struct EdgeSender {
+    sender: Sender<Envelope>,
+    account: Arc<EdgeAccount>,
+    pending: PendingBatch,
+    flow_ids: Arc<trace::FlowIds>,
+    max_batch: usize,
+    /// Counters of the live graph, only if it is written.
+    counters: Option<Arc<EdgeCounters>>,
+}
+
+/// Messages sent through an edge, not counting dropped ones.
+#[derive(Default)]
+pub(crate) struct EdgeCounters {
+    pub msgs: AtomicU64,
+    pub bytes: AtomicU64,
+}
+
+impl EdgeSender {
+    pub(crate) fn send(&self, msg: SendableMsg) -> Result<(), SendError<SendableMsg>> {
+        let size = msg.0.as_bytes().len();
+        let span = trace::start();
+        let flow_id = self.flow_ids.next();
+        let mut msg = Queued { msg, flow_id };
+        virtual_time::begin();
+        if !self.account.acquire(size) {
+            probe!(drop, size);
+            virtual_time::end();
+            return Ok(());
+        }
+        if let Some(counters) = &self.counters {
+            counters.msgs.fetch_add(1, Ordering::Relaxed);
+            counters.bytes.fetch_add(size as u64, Ordering::Relaxed);
+        }
+
+        // Nothing is held and the receiver is idle, so there is nothing to batch with.
+        let envelope = if !self.pending.held.load(Ordering::Acquire) && self.sender.is_empty() {
+            Envelope::One(msg)
+        } else {
+            let mut pending = self.pending.msgs.lock().unwrap();
+            // The receiver is busy. Hold the message to send it with following ones.
+            if !self.sender.is_empty() && pending.len() + 1 < self.max_batch {
+                pending.push(msg);
+                // Mark it held before checking the queue again. A receiver that drains the
+                // queue after the check then sees the mark, and one that drained it before
+                // makes the check fail.
+                self.pending.held.store(true, Ordering::SeqCst);
+                if !self.sender.is_empty() {
+                    trace::end(Kind::Send, span, flow_id);
+                    return Ok(());
+                }
+                msg = pending.pop().unwrap();
+            }
+
+            // The lock is released at the end of this block before a blocking send, or the
+            // receiver may wait for it forever.
+            let envelope = if pending.is_empty() {
+                Envelope::One(msg)
+            } else {
+                let mut batch =
+                    std::mem::replace(&mut *pending, Vec::with_capacity(self.max_batch));
+                batch.push(msg);
+                Envelope::Batch(batch)
+            };
+            self.pending.held.store(false, Ordering::SeqCst);
+            envelope
+        };
+        let result = match self.sender.try_send(envelope) {
+            Ok(()) => Ok(()),
+            Err(TrySendError::Full(envelope)) => {
+                let _blocked = task_stats::Blocked::send();
+                let _wait = watchdog::Wait::send();
+                let _span = trace::Span::new(Kind::SendWait);
+                probe!(send_blocked, size);
+                let result = self.sender.send(envelope);
+                probe!(send_unblocked, size);
+                result
+            }
+            Err(TrySendError::Disconnected(envelope)) => Err(SendError(envelope)),
+        };
+        trace::end(Kind::Send, span, flow_id);
+        result.map_err(|SendError(envelope)| {
+            let mut msgs = match envelope {
+                Envelope::One(msg) => vec![msg],
+                Envelope::Batch(msgs) => msgs,
+            };
+            for queued in &msgs {
+                self.account.release(queued.msg.0.as_bytes().len());
+                virtual_time::end();
+            }
+            SendError(msgs.pop().unwrap().msg)
+        })
+    }
+
+    /// Count messages sent through this sender in `counters`.
+    pub(crate) fn set_counters(&mut self, counters: Arc<EdgeCounters>) {
+        self.counters = Some(counters);
+    }
+}
+
+/// Depths of the receiving ports of a task, read without locking.
+///
+/// Only accounts are held, so that queues are disconnected when the receiver is dropped.
+#[derive(Clone, Default)]
+pub(crate) struct QueueDepths {
+    accounts: Vec<Arc<EdgeAccount>>,
+}
+
+/// Messages queued for a receiving port, including ones held back by senders for batching.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub(crate) struct QueueDepth {
+    pub msgs: usize,
+    pub bytes: usize,
+}
+
+impl QueueDepths {
+    pub fn get(&self) -> Vec<QueueDepth> {
+        self.accounts
+            .iter()
+            .map(|account| QueueDepth {
+                msgs: account.msgs(),
+                bytes: account.bytes(),
+            })
+            .collect()
+    }
+}
+
+impl std::fmt::Display for QueueDepth {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "{} queued messages of {} bytes", self.msgs, self.bytes)
+    }
+}
+
 #[derive(Default)]
 pub struct MsgReceiverInner {
     child: Option<Box<ChildTask>>,
-    recvs: Vec<Receiver<SendableMsg>>,
+    recvs: Vec<Receiver<Envelope>>,
+    accounts: Vec<Arc<EdgeAccount>>,
+    pending: Vec<Vec<PendingBatch>>,
+    /// Received but not yet returned messages for each port.
+    batches: Vec<VecDeque<Queued>>,
+    waiter: Waiter,
+    /// The number of messages returned from queues.
+    received: u64,
+    /// Called with `received` before waiting for a message.
+    on_idle: Option<Box<dyn FnMut(u64) + Send>>,
 }
 
 impl MsgReceiverInner {
     /// Receive message from specified port.
     #[allow(clippy::needless_lifetimes)]
     pub fn recv<'a>(&'a mut self, port: Port) -> Result<Msg<'a>, ReceiveError> {
-        if let Some(child) = self.child.as_mut() {
-            return child.next();
+        if self.child.is_some() {
+            return self.child.as_mut().unwrap().next();
         }
-
-        self.recvs[port as usize]
-            .recv()
-            .map(|msg| msg.0)
-            .map_err(|_| ReceiveError)
+        self.recv_queued(port as usize)
     }
 
     /// Receive message from any port.
     #[allow(clippy::needless_lifetimes)]
     pub fn recv_any_port<'a>(&'a mut self) -> Result<(Port, Msg<'a>), ReceiveError> {
-        if let Some(child) = self.child.as_mut() {
-            return child.next().map(|result| (0, result));
+        if self.child.is_some() {
+            return self
+                .child
+                .as_mut()
+                .unwrap()
+                .next()
+                .map(|result| (0, result));
+        }
+        self.recv_any_queued()
+    }
+
+    fn recv_queued(&mut self, port: usize) -> Result<Msg<'static>, ReceiveError> {
+        if self.batches[port].is_empty() {
+            let envelope = match self.recvs[port].try_recv() {
+                Ok(envelope) => envelope,
+                Err(e) => {
+                    if self.take_pending(port) {
+                        return Ok(self.pop_batch(port));
+                    }
+                    if matches!(e, TryRecvError::Disconnected) {
+                        return Err(ReceiveError);
+                    }
+                    self.idle();
+                    let _idle = virtual_time::Idle::new();
+                    let _blocked = task_stats::Blocked::recv();
+                    let _wait = watchdog::Wait::recv(port);
+                    let _span = trace::Span::new(Kind::RecvWait);
+                    match self.waiter.recv(&self.recvs[port]) {
+                        Ok(envelope) => envelope,
+                        // Senders may have held messages before disconnecting.
+                        Err(_) if self.take_pending(port) => return Ok(self.pop_batch(port)),
+                        Err(_) => return Err(ReceiveError),
+                    }
+                }
+            };
+            self.unpack(port, envelope);
+        }
+        Ok(self.pop_batch(port))
+    }
+
+    fn recv_any_queued(&mut self) -> Result<(Port, Msg<'static>), ReceiveError> {
+        if let Some(port) = self.batches.iter().position(|batch| !batch.is_empty()) {
+            return Ok((port as Port, self.pop_batch(port)));
+        }
+
+        let mut disconnected = false;
+        for port in 0..self.recvs.len() {
+            match self.recvs[port].try_recv() {
+                Ok(envelope) => {
+                    self.unpack(port, envelope);
+                    return Ok((port as Port, self.pop_batch(port)));
+                }
+                Err(e) => disconnected |= matches!(e, TryRecvError::Disconnected),
+            }
+        }
+        for port in 0..self.recvs.len() {
+            if self.take_pending(port) {
+                return Ok((port as Port, self.pop_batch(port)));
+            }
+        }
+        if disconnected {
+            return Err(ReceiveError);
         }
 
-        let mut sel = Select::new();
-        for r in &self.recvs {
-            sel.recv(r);
+        self.idle();
+        let result = {
+            let _idle = virtual_time::Idle::new();
+            let _blocked = task_stats::Blocked::recv();
+            let _wait = watchdog::Wait::recv_any();
+            let _span = trace::Span::new(Kind::RecvWait);
+            self.waiter.recv_any(&self.recvs)
+        };
+        let (port, envelope) = match result {
+            Ok(received) => received,
+            Err(_) => {
+                // Senders may have held messages before disconnecting.
+                for port in 0..self.recvs.len() {
+                    if self.take_pending(port) {
+                        return Ok((port as Port, self.pop_batch(port)));
+                    }
+                }
+                return Err(ReceiveError);
+            }
+        };
+        self.unpack(port, envelope);
+        Ok((port as Port, self.pop_batch(port)))
+    }
+
+    fn unpack(&mut self, port: usize, envelope: Envelope) {
+        match envelope {
+            Envelope::One(msg) => self.batches[port].push_back(msg),
+            Envelope::Batch(msgs) => self.batches[port].extend(msgs),
+        }
+    }
+
+    /// Take messages held by senders to `port`. Returns false if there is none.
+    fn take_pending(&mut self, port: usize) -> bool {
+        for pending in &self.pending[port] {
+            if !pending.held.load(Ordering::SeqCst) {
+                continue;
+            }
+            let mut msgs = pending.msgs.lock().unwrap();
+            // Held messages are newer than queued ones from the same sender.
+            if !self.recvs[port].is_empty() {
+                break;
+            }
+            self.batches[port].extend(msgs.drain(..));
+            pending.held.store(false, Ordering::Release);
+        }
+        !self.batches[port].is_empty()
+    }
+
+    fn pop_batch(&mut self, port: usize) -> Msg<'static> {
+        let Queued { msg, flow_id } = self.batches[port].pop_front().unwrap();
+        trace::instant(Kind::Recv, flow_id);
+        probe!(recv, port, msg.0.as_bytes().len());
+        self.accounts[port].release(msg.0.as_bytes().len());
+        virtual_time::end();
+        watchdog::msg_received();
+        self.received += 1;
+        msg.0
+    }
+
+    fn idle(&mut self) {
+        if let Some(on_idle) = self.on_idle.as_mut() {
+            on_idle(self.received);
         }
-        let oper = sel.select();
-        let index = oper.index();
-        let msg = oper.recv(&self.recvs[index]).map_err(|_| ReceiveError)?;
-        Ok((index as Port, msg.0))
+    }
+
+    /// Get a handle to read the depths of receiving ports from other threads.
+    pub(crate) fn queue_depths(&self) -> QueueDepths {
+        QueueDepths {
+            accounts: self.accounts.clone(),
+        }
+    }
+
+    /// Get the number of messages received from queues.
+    pub fn received(&self) -> u64 {
+        self.received
+    }
+
+    /// Set a function called with `received()` each time before waiting for a message.
+    pub fn set_on_idle(&mut self, on_idle: Box<dyn FnMut(u64) + Send>) {
+        self.on_idle = Some(on_idle);
     }
 
     pub fn into_ffi(self) -> DcMsgReceiver {
@@ -110,14 +435,24 @@ unsafe extern "C" fn recv_any(
     }
 }
 
+/// Queue of a receiving port and its senders' pending batches.
+struct PortQueue {
+    sender: Sender<Envelope>,
+    receiver: Receiver<Envelope>,
+    account: Arc<EdgeAccount>,
+    pending: Vec<PendingBatch>,
+}
+
 pub struct ChannelBuilder {
     sender: MsgSender,
-    self_mpsc: Vec<Option<(Sender<SendableMsg>, Receiver<SendableMsg>)>>,
+    self_mpsc: Vec<Option<PortQueue>>,
+    options: EdgeOptions,
+    waiter: Waiter,
     pub(crate) child_task: Option<Box<ChildTask>>,
 }
 
 impl ChannelBuilder {
-    pub fn new(recv_port: Port, send_port: Port) -> ChannelBuilder {
+    pub fn new(recv_port: Port, send_port: Port, options: EdgeOptions) -> ChannelBuilder {
         let recv_port: usize = recv_port.into();
         let send_port: usize = send_port.into();
 
@@ -126,20 +461,43 @@ impl ChannelBuilder {
                 mpsc_channel: vec![vec![]; send_port],
             },
             self_mpsc: std::iter::from_fn(|| Some(None)).take(recv_port).collect(),
+            options,
+            waiter: Waiter::default(),
             child_task: None,
         }
     }
 
-    pub fn set_sender(&mut self, sender: Sender<SendableMsg>, port: Port) {
+    pub fn set_sender(&mut self, sender: EdgeSender, port: Port) {
         self.sender.mpsc_channel[port as usize].push(sender);
     }
 
-    pub fn get_sender(&mut self, port: Port) -> Sender<SendableMsg> {
-        let self_mpsc = &mut self.self_mpsc[port as usize];
-        if self_mpsc.is_none() {
-            *self_mpsc = Some(bounded(16));
+    pub fn get_sender(&mut self, port: Port) -> EdgeSender {
+        let options = &self.options;
+        let queue = self.self_mpsc[port as usize].get_or_insert_with(|| {
+            let (sender, receiver) = bounded(options.capacity);
+            let account = EdgeAccount::new(options.budget, options.budget_policy);
+            PortQueue {
+                sender,
+                receiver,
+                account: Arc::new(account),
+                pending: Vec::new(),
+            }
+        });
+        let pending = PendingBatch::default();
+        queue.pending.push(pending.clone());
+        EdgeSender {
+            sender: queue.sender.clone(),
+            account: queue.account.clone(),
+            pending,
+            flow_ids: Arc::default(),
+            max_batch: options.max_batch.max(1),
+            counters: None,
         }
-        self_mpsc.as_ref().unwrap().0.clone()
+    }
+
+    /// Set how to wait for messages on receiving ports.
+    pub fn set_wait(&mut self, conf: &WaitConf) {
+        self.waiter = Waiter::new(conf);
     }
 
     pub(crate) fn set_child(&mut self, child_task: ChildTask) {
@@ -147,18 +505,161 @@ impl ChannelBuilder {
     }
 
     pub fn build(self) -> Channel {
-        let recvs = self
-            .self_mpsc
-            .into_iter()
-            .filter_map(|mpsc| mpsc.map(|(_sender, receiver)| receiver))
-            .collect();
+        let mut recvs = Vec::new();
+        let mut accounts = Vec::new();
+        let mut pending = Vec::new();
+        for queue in self.self_mpsc.into_iter().flatten() {
+            recvs.push(queue.receiver);
+            accounts.push(queue.account);
+            pending.push(queue.pending);
+        }
+        let batches = (0..recvs.len()).map(|_| VecDeque::new()).collect();
 
         Channel {
             sender: self.sender,
             receiver: MsgReceiverInner {
                 child: self.child_task,
                 recvs,
+                accounts,
+                pending,
+                batches,
+                waiter: self.waiter,
+                received: 0,
+                on_idle: None,
             },
         }
     }
 }
+
+#[cfg(test)]
+fn test_channel(capacity: usize, max_batch: usize, senders: usize) -> (Vec<EdgeSender>, Channel) {
+    let options = EdgeOptions {
+        capacity,
+        max_batch,
+        budget: None,
+        budget_policy: MemoryBudgetPolicy::Block,
+    };
+    let mut builder = ChannelBuilder::new(1, 0, options);
+    let senders = (0..senders).map(|_| builder.get_sender(0)).collect();
+    (senders, builder.build())
+}
+
+#[cfg(test)]
+fn test_msg(data: &[u8]) -> SendableMsg {
+    use common::DcMsgInner;
+
+    let msg = DcMsg {
+        inner: DcMsgInner {
+            msg_ref: data.as_ptr(),
+        },
+        len: data.len(),
+        capacity: 0,
+        drop: None,
+    };
+    msg_clone(&unsafe { Msg::new(msg) })
+}
+
+#[test]
+fn batch_order_test() {
+    const N: u32 = 10000;
+    let (senders, channel) = test_channel(2, 4, 2);
+    let (_, mut receiver) = channel.split();
+
+    let threads: Vec<_> = senders
+        .into_iter()
+        .enumerate()
+        .map(|(i, sender)| {
+            std::thread::spawn(move || {
+                for seq in 0..N {
+                    let mut data = vec![i as u8];
+                    data.extend(seq.to_be_bytes());
+                    sender.send(test_msg(&data)).unwrap();
+                }
+            })
+        })
+        .collect();
+
+    let mut next = [0; 2];
+    for _ in 0..2 * N {
+        let msg = receiver.recv(0).unwrap();
+        let data = msg.as_bytes();
+        let seq = u32::from_be_bytes(data[1..].try_into().unwrap());
+        assert_eq!(seq, next[data[0] as usize]);
+        next[data[0] as usize] += 1;
+    }
+    for thread in threads {
+        thread.join().unwrap();
+    }
+    assert!(receiver.recv(0).is_err());
+}
+
+#[test]
+fn batch_idle_receiver_test() {
+    let (mut senders, channel) = test_channel(16, 4, 1);
+    let sender = senders.pop().unwrap();
+    let (_, mut receiver) = channel.split();
+    let (ack_sender, ack) = crossbeam_channel::unbounded();
+
+    let thread = std::thread::spawn(move || {
+        while receiver.recv(0).is_ok() {
+            if receiver.recv(0).is_err() {
+                break;
+            }
+            let _ = ack_sender.send(());
+        }
+    });
+    // The second message of each round may be held while the receiver goes idle.
+    for _ in 0..10000 {
+        sender.send(test_msg(b"a")).unwrap();
+        sender.send(test_msg(b"b")).unwrap();
+        ack.recv_timeout(std::time::Duration::from_secs(5))
+            .expect("held message was not delivered");
+    }
+    drop(sender);
+    thread.join().unwrap();
+}
+
+#[test]
+fn batch_disconnect_test() {
+    for any_port in [false, true] {
+        let (mut senders, channel) = test_channel(16, 4, 1);
+        let sender = senders.pop().unwrap();
+        let (_, mut receiver) = channel.split();
+
+        // The second message is held because the first one is queued.
+        sender.send(test_msg(b"a")).unwrap();
+        sender.send(test_msg(b"b")).unwrap();
+        assert!(sender.pending.held.load(Ordering::SeqCst));
+        drop(sender);
+
+        let recv = |receiver: &mut MsgReceiverInner| {
+            if any_port {
+                receiver
+                    .recv_any_port()
+                    .map(|(_, msg)| msg.as_bytes().to_vec())
+            } else {
+                receiver.recv(0).map(|msg| msg.as_bytes().to_vec())
+            }
+        };
+        assert_eq!(recv(&mut receiver).unwrap(), b"a");
+        assert_eq!(recv(&mut receiver).unwrap(), b"b");
+        assert!(recv(&mut receiver).is_err());
+    }
+
+    // The receiver waits for messages when senders hold one and disconnect.
+    let (mut senders, channel) = test_channel(16, 4, 1);
+    let sender = senders.pop().unwrap();
+    let (_, mut receiver) = channel.split();
+    let thread = std::thread::spawn(move || {
+        let mut received = Vec::new();
+        while let Ok(msg) = receiver.recv(0) {
+            received.push(msg.as_bytes().to_vec());
+        }
+        received
+    });
+    for data in [b"a", b"b", b"c"] {
+        sender.send(test_msg(data)).unwrap();
+    }
+    drop(sender);
+    assert_eq!(thread.join().unwrap(), [b"a", b"b", b"c"]);
+}
@@ -0,0 +1,62 @@
+//! Monotonic and realtime timestamps shared by the runtime and plugins.
+//!
+//! Both follow the virtual clock if it is enabled.
+
+use common::DcTimestamp;
+use std::sync::atomic::{AtomicI64, AtomicU64, Ordering};
+
+/// Interval to read the offset of the realtime clock again, which NTP may step or slew.
+const OFFSET_REFRESH_NS: u64 = 1_000_000_000;
+
+/// Realtime minus monotonic time, so that both clocks of a timestamp agree.
+static REALTIME_OFFSET_NS: AtomicI64 = AtomicI64::new(0);
+/// Monotonic time when the offset was read, or 0 before the first read.
+static OFFSET_READ_NS: AtomicU64 = AtomicU64::new(0);
+
+/// Get the current time. `coarse` uses the clock updated on kernel ticks, which is cheaper
+/// but only as precise as the tick.
+pub(crate) fn now(coarse: bool) -> DcTimestamp {
+    let monotonic_ns = if crate::virtual_time::enabled() {
+        crate::virtual_time::now_ns()
+    } else if coarse {
+        read(libc::CLOCK_MONOTONIC_COARSE)
+    } else {
+        monotonic_ns()
+    };
+    DcTimestamp {
+        monotonic_ns,
+        realtime_ns: (monotonic_ns as i64 + realtime_offset_ns(monotonic_ns)) as u64,
+    }
+}
+
+/// Get the realtime offset, read again by one caller once it is older than the interval.
+fn realtime_offset_ns(monotonic_ns: u64) -> i64 {
+    let read_ns = OFFSET_READ_NS.load(Ordering::Relaxed);
+    let stale = monotonic_ns.wrapping_sub(read_ns) >= OFFSET_REFRESH_NS
+        && OFFSET_READ_NS
+            .compare_exchange(read_ns, monotonic_ns, Ordering::Relaxed, Ordering::Relaxed)
+            .is_ok();
+    if read_ns == 0 || stale {
+        let offset = read(libc::CLOCK_REALTIME) as i64 - read(libc::CLOCK_MONOTONIC) as i64;
+        REALTIME_OFFSET_NS.store(offset, Ordering::Relaxed);
+        return offset;
+    }
+    REALTIME_OFFSET_NS.load(Ordering::Relaxed)
+}
+
+/// Get `CLOCK_MONOTONIC` or the virtual clock in nanoseconds.
+pub(crate) fn monotonic_ns() -> u64 {
+    if crate::virtual_time::enabled() {
+        return crate::virtual_time::now_ns();
+    }
+    read(libc::CLOCK_MONOTONIC)
+}
+
+fn read(clock: libc::clockid_t) -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(clock, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
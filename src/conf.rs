@@ -18,6 +18,9 @@ pub struct Conf {
     pub tasks: Vec<TaskConf>,
     #[serde(default)]
     pub bg_processes: Vec<BgProcessConf>,
+    /// Data loaded once and shared by elements.
+    #[serde(default)]
+    pub resources: Vec<ResourceConf>,
     #[serde(default, alias = "before_script")]
     pub before_task: Vec<String>,
     #[serde(default, alias = "after_script")]
@@ -40,6 +43,185 @@ impl Conf {
 #[serde(deny_unknown_fields)]
 pub struct RunnerConf {
     pub channel_capacity: Option<usize>,
+    /// Maximum number of messages batched into one channel item while the receiver is busy.
+    pub max_batch: Option<usize>,
+    #[serde(default)]
+    pub memory_budget: MemoryBudgetConf,
+    pub buffer_pool: Option<BufferPoolConf>,
+    #[serde(default)]
+    pub realtime: RealtimeConf,
+    /// Default wait strategy of receiving ports.
+    #[serde(default)]
+    pub wait: WaitConf,
+    #[serde(default)]
+    pub worker_pool: WorkerPoolConf,
+    /// Run with a virtual clock that jumps to the next timer expiration when all tasks wait.
+    /// Elements must wait with pipeline timers or `Pipeline::sleep`.
+    #[serde(default)]
+    pub virtual_time: bool,
+    /// Log CPU time and blocked time of each task.
+    pub task_stats: Option<TaskStatsConf>,
+    /// Record a timeline of task execution.
+    pub trace: Option<TraceConf>,
+    #[serde(default)]
+    pub log: LogConf,
+    /// Report tasks that make no progress.
+    pub watchdog: Option<WatchdogConf>,
+    /// Take snapshots of the runtime state on demand.
+    pub snapshot: Option<SnapshotConf>,
+}
+
+/// Per-task CPU time and scheduling statistics
+///
+/// Statistics are taken per thread, so the time of a fused child task, which runs in the thread
+/// of the task receiving from it, is counted in that task.
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct TaskStatsConf {
+    /// Interval to log statistics and metrics of elements. Statistics are logged at shutdown
+    /// in any case.
+    pub interval_ms: Option<u64>,
+}
+
+/// Timeline of task execution in the Chrome trace event format
+#[derive(Clone, PartialEq, Debug, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct TraceConf {
+    /// File to write the trace to at exit.
+    pub path: PathBuf,
+    /// The number of latest events kept for each thread.
+    pub events_per_thread: Option<usize>,
+    /// Also write the trace when this signal is received.
+    pub dump_signal: Option<BgProcessWaitSignal>,
+}
+
+/// Detection of tasks that make no progress
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct WatchdogConf {
+    /// Time a task may run `next` or block in send without receiving or sending a message
+    /// before it is reported. Waiting for messages or timers is not reported. Defaults to 10000.
+    pub threshold_ms: Option<u64>,
+    /// Also print stacks of reported tasks to stderr.
+    #[serde(default)]
+    pub stack_trace: bool,
+}
+
+/// Snapshots of task states, queue depths and metrics in JSON
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct SnapshotConf {
+    /// Take a snapshot when this signal is received.
+    pub signal: Option<BgProcessWaitSignal>,
+    /// File to write snapshots taken on the signal to. They are logged if not set.
+    pub path: Option<PathBuf>,
+    /// Unix socket that sends a snapshot to each connection.
+    pub socket: Option<PathBuf>,
+    /// File to write the task graph in DOT to with snapshots taken on the signal. Edges are
+    /// labeled with rates since the previous snapshot and fill levels of queues.
+    pub dot_path: Option<PathBuf>,
+}
+
+/// Logging by the runtime and plugins
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct LogConf {
+    /// Messages logged per second from each callsite before the rest are suppressed and
+    /// counted. 0 disables the limit. Defaults to 100.
+    pub rate_limit: Option<u32>,
+}
+
+/// Worker threads shared by elements for parallel work
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct WorkerPoolConf {
+    /// The number of worker threads. Defaults to the number of CPUs not pinned by tasks.
+    pub threads: Option<usize>,
+}
+
+/// Options to avoid page faults after start
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct RealtimeConf {
+    /// Lock all current and future memory with `mlockall`.
+    #[serde(default)]
+    pub mlockall: bool,
+    /// Bytes of each task stack to touch before the task starts.
+    pub prefault_stack_bytes: Option<usize>,
+    /// Default stack size of task threads.
+    pub stack_size: Option<usize>,
+    /// Bytes of message buffers and scratch arenas to allocate and touch at build time.
+    pub preallocate_bytes: Option<usize>,
+}
+
+/// Byte budget of messages held in channels
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct MemoryBudgetConf {
+    /// Limit of bytes queued in all channels.
+    pub total_bytes: Option<usize>,
+    /// Default limit of bytes queued for each receiving port.
+    pub edge_bytes: Option<usize>,
+    /// Behavior when a limit is exceeded.
+    #[serde(default)]
+    pub policy: MemoryBudgetPolicy,
+}
+
+/// Behavior when a memory budget is exceeded
+#[derive(Clone, Copy, PartialEq, Eq, Debug, Default, Serialize, Deserialize)]
+#[serde(rename_all = "kebab-case")]
+pub enum MemoryBudgetPolicy {
+    /// Block the sender until queued messages are received.
+    #[default]
+    Block,
+    /// Drop the message to send.
+    Drop,
+}
+
+/// How a task waits for messages on its receiving ports
+#[derive(Clone, PartialEq, Debug, Default, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct WaitConf {
+    #[serde(default)]
+    pub strategy: WaitStrategy,
+    /// Polls before yielding for `spin-then-park`.
+    pub spin_count: Option<u32>,
+    /// Upper bound of spinning time in microseconds for `spin-then-park`.
+    pub spin_us: Option<u64>,
+    /// Polls with `sched_yield` before parking for `spin-then-park`.
+    pub yield_count: Option<u32>,
+}
+
+/// Wait strategy for receiving messages
+#[derive(Clone, Copy, PartialEq, Eq, Debug, Default, Serialize, Deserialize)]
+#[serde(rename_all = "kebab-case")]
+pub enum WaitStrategy {
+    /// Park the thread until a message arrives.
+    #[default]
+    Park,
+    /// Poll without sleeping. Occupies a CPU.
+    BusyPoll,
+    /// Spin, then yield, then park.
+    SpinThenPark,
+}
+
+/// Message buffer pool configuration
+#[derive(Clone, PartialEq, Debug, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct BufferPoolConf {
+    /// Size of each buffer. Larger messages are allocated from heap.
+    pub buf_size: usize,
+    /// The number of buffers for each sending task.
+    pub bufs: usize,
+    /// Back pools by 2 MiB huge pages, falling back to transparent huge pages.
+    #[serde(default)]
+    pub huge_pages: bool,
+    /// Allocate pools on the NUMA node of the consuming task's CPU.
+    #[serde(default)]
+    pub numa: bool,
+    /// Touch all pages of pools at startup.
+    #[serde(default)]
+    pub prefault: bool,
 }
 
 /// Plugin configuration
@@ -61,6 +243,71 @@ pub struct TaskConf {
     pub from: Vec<Vec<TaskPort>>,
     pub conf_file: Option<PathBuf>,
     pub conf: Option<ElementConf>,
+    /// Limit of bytes queued for each receiving port of this task.
+    pub edge_budget_bytes: Option<usize>,
+    /// CPUs to pin the task thread to.
+    #[serde(default)]
+    pub cpu_affinity: Vec<usize>,
+    /// Stack size of the task thread.
+    pub stack_size: Option<usize>,
+    /// Wait strategy of receiving ports of this task.
+    pub wait: Option<WaitConf>,
+    /// The number of element instances that process messages in parallel.
+    /// The element must be replicable.
+    pub parallelism: Option<usize>,
+    /// How messages are distributed to parallel instances. Defaults to `round-robin`.
+    pub dispatch: Option<DispatchPolicy>,
+    /// Key of messages for the `hash` dispatch policy.
+    pub partition_key: Option<PartitionKeyConf>,
+    /// Threshold of the watchdog for this task.
+    pub watchdog_threshold_ms: Option<u64>,
+}
+
+/// Distribution of messages to parallel instances of a task
+#[derive(Clone, Copy, PartialEq, Eq, Debug, Default, Serialize, Deserialize)]
+#[serde(rename_all = "kebab-case")]
+pub enum DispatchPolicy {
+    /// Send to instances in turn.
+    #[default]
+    RoundRobin,
+    /// Send to the instance with the fewest unfinished messages.
+    LeastLoaded,
+    /// Send by the hash of the partition key, so that each key is processed by one instance.
+    /// Outputs keep their order for each key only.
+    Hash,
+}
+
+/// Byte range of a message used as the partition key
+#[derive(Clone, PartialEq, Debug, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct PartitionKeyConf {
+    /// Offset of the key in bytes.
+    #[serde(default)]
+    pub offset: usize,
+    /// Length of the key in bytes. The key extends to the end of the message if not given.
+    pub len: Option<usize>,
+}
+
+impl PartitionKeyConf {
+    /// Get the key of `msg`. Out of range bytes are ignored.
+    pub fn key<'a>(&self, msg: &'a [u8]) -> &'a [u8] {
+        let start = self.offset.min(msg.len());
+        let end = self
+            .len
+            .map_or(msg.len(), |len| start.saturating_add(len).min(msg.len()));
+        &msg[start..end]
+    }
+}
+
+/// Immutable data shared by elements through `Pipeline::resource`
+#[derive(Clone, PartialEq, Debug, Serialize, Deserialize)]
+#[serde(deny_unknown_fields)]
+pub struct ResourceConf {
+    pub name: String,
+    pub path: PathBuf,
+    /// Map the file instead of reading it, so that only accessed pages are loaded.
+    #[serde(default)]
+    pub mmap: bool,
 }
 
 /// Background process configuration
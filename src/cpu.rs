@@ -0,0 +1,51 @@
+//! CPU affinity and NUMA topology helpers.
+
+use std::io;
+
+/// Pin the current thread to `cpus`.
+pub(crate) fn pin_current_thread(cpus: &[usize]) -> io::Result<()> {
+    unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_ZERO(&mut set);
+        for &cpu in cpus {
+            if cpu >= libc::CPU_SETSIZE as usize {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidInput,
+                    format!("CPU {} is out of range", cpu),
+                ));
+            }
+            libc::CPU_SET(cpu, &mut set);
+        }
+        if libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set) != 0 {
+            return Err(io::Error::last_os_error());
+        }
+    }
+    Ok(())
+}
+
+/// Get CPUs the process is allowed to run on.
+pub(crate) fn allowed_cpus() -> Vec<usize> {
+    unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        if libc::sched_getaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &mut set) != 0 {
+            let n = std::thread::available_parallelism().map_or(1, |n| n.get());
+            return (0..n).collect();
+        }
+        (0..libc::CPU_SETSIZE as usize)
+            .filter(|&cpu| libc::CPU_ISSET(cpu, &set))
+            .collect()
+    }
+}
+
+/// Get the NUMA node that `cpu` belongs to.
+pub(crate) fn numa_node_of_cpu(cpu: usize) -> Option<usize> {
+    let dir = std::fs::read_dir(format!("/sys/devices/system/cpu/cpu{}", cpu)).ok()?;
+    dir.filter_map(|entry| entry.ok()).find_map(|entry| {
+        entry
+            .file_name()
+            .to_str()?
+            .strip_prefix("node")?
+            .parse()
+            .ok()
+    })
+}
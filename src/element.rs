@@ -2,7 +2,10 @@
 
 use crate::error::{ElementAppendError, ElementBuildError, UnknownElementError};
 use crate::ElementConf;
-use common::{DcElement, DcMsgReceiver, DcPipeline, MsgReceiver, Pipeline};
+use common::{
+    DcElement, DcMsgReceiver, DcPipeline, MsgReceiver, Pipeline, DC_ELEMENT_PARTITIONABLE,
+    DC_ELEMENT_REPLICABLE,
+};
 pub use common::{ElementResult, ElementValue, MsgType, Port};
 use serde::de::DeserializeOwned;
 use std::collections::HashMap;
@@ -62,6 +65,14 @@ pub trait ElementBuildable: Sized + Send + 'static {
     /// The number of sending ports
     const SEND_PORTS: Port = 0;
 
+    /// Whether instances of this element can process messages of one task in parallel.
+    /// Each input message must be processed without state shared with other messages.
+    const REPLICABLE: bool = false;
+
+    /// Whether instances of this element can process messages of one task in parallel
+    /// when messages are partitioned by key. State may be kept for each key.
+    const PARTITIONABLE: bool = Self::REPLICABLE;
+
     /// Returns acceptable message type of this element
     fn acceptable_msg_types() -> Vec<Vec<MsgType>> {
         Vec::new()
@@ -102,6 +113,19 @@ pub trait ElementBuildable: Sized + Send + 'static {
     }
 }
 
+/// Get `DC_ELEMENT_*` flags of a buildable element.
+#[doc(hidden)]
+pub fn buildable_flags<E: ElementBuildable>() -> u32 {
+    let mut flags = 0;
+    if E::REPLICABLE {
+        flags |= DC_ELEMENT_REPLICABLE;
+    }
+    if E::PARTITIONABLE {
+        flags |= DC_ELEMENT_PARTITIONABLE;
+    }
+    flags
+}
+
 type RecvMsgTypeGetter = Box<dyn Fn() -> Vec<Vec<MsgType>>>;
 
 /// Holds buildable element list.
@@ -109,6 +133,7 @@ pub struct ElementBank {
     builders: HashMap<String, ElementBuilder>,
     acceptable_msg_types: HashMap<String, RecvMsgTypeGetter>,
     ports: HashMap<String, (Port, Port)>,
+    flags: HashMap<String, u32>,
 }
 
 impl Default for ElementBank {
@@ -124,6 +149,7 @@ impl ElementBank {
             builders: HashMap::default(),
             acceptable_msg_types: HashMap::default(),
             ports: HashMap::default(),
+            flags: HashMap::default(),
         }
     }
 
@@ -134,6 +160,7 @@ impl ElementBank {
         builder: ElementBuilder,
         acceptable_msg_types: RecvMsgTypeGetter,
         ports: (Port, Port),
+        flags: u32,
     ) -> Result<(), ElementAppendError> {
         if self.builders.contains_key(name) {
             return Err(ElementAppendError(format!(
@@ -146,6 +173,7 @@ impl ElementBank {
         self.acceptable_msg_types
             .insert(name.to_owned(), acceptable_msg_types);
         self.ports.insert(name.to_owned(), ports);
+        self.flags.insert(name.to_owned(), flags);
 
         log::trace!("append \"{}\" to element bank", name);
         Ok(())
@@ -160,6 +188,7 @@ impl ElementBank {
             ElementBuilder::Native(E::element_conf_to_executable),
             Box::new(E::acceptable_msg_types),
             (E::RECV_PORTS, E::SEND_PORTS),
+            buildable_flags::<E>(),
         )
     }
 
@@ -200,6 +229,25 @@ impl ElementBank {
             .ok_or_else(|| UnknownElementError(name.into()))
     }
 
+    /// Get whether the element can be replicated.
+    pub fn replicable(&self, name: &str) -> Result<bool, UnknownElementError> {
+        self.flags(name)
+            .map(|flags| flags & DC_ELEMENT_REPLICABLE != 0)
+    }
+
+    /// Get whether the element can be replicated with messages partitioned by key.
+    pub fn partitionable(&self, name: &str) -> Result<bool, UnknownElementError> {
+        self.flags(name)
+            .map(|flags| flags & DC_ELEMENT_PARTITIONABLE != 0)
+    }
+
+    fn flags(&self, name: &str) -> Result<u32, UnknownElementError> {
+        self.flags
+            .get(name)
+            .copied()
+            .ok_or_else(|| UnknownElementError(name.into()))
+    }
+
     /// New ElementBank with core elements.
     pub fn new() -> Self {
         let mut bank = Self::empty();
@@ -1,4 +1,5 @@
 use crate::element::ElementFinalizer;
+use crate::usdt::probe;
 use once_cell::sync::Lazy;
 use std::sync::Mutex;
 
@@ -24,9 +25,17 @@ pub(crate) fn finalize() {
     let mut lock = FINALIZER_HOLDER.lock().unwrap();
 
     if let Some(fh) = lock.take() {
+        crate::task_stats::log_summary();
+        crate::metrics::log_metrics();
+        crate::alloc_stats::log_stats();
+        crate::trace::dump();
+
         log::info!("execute finalizers");
-        for finalizer in fh.finalizers.into_iter() {
-            if let Err(e) = finalizer() {
+        for (i, finalizer) in fh.finalizers.into_iter().enumerate() {
+            probe!(finalizer_entry, i);
+            let result = finalizer();
+            probe!(finalizer_exit, i, result.is_err());
+            if let Err(e) = result {
                 log::error!("error in finalizer\n{:?}", e);
             }
         }
@@ -36,5 +45,6 @@ pub(crate) fn finalize() {
         if let Err(e) = crate::process::exec_script_lines(after_script) {
             log::error!("{:?}", e);
         }
+        log::logger().flush();
     }
 }
@@ -0,0 +1,294 @@
+//! Task graph in the DOT language of Graphviz.
+//!
+//! Tasks are grouped into clusters of the threads that run them, so fused child tasks are
+//! drawn in the cluster of their parent, and edges to them are dashed. The live graph
+//! written with snapshots labels edges with message and byte rates since the previous one
+//! and the fill level of the receiving port.
+//!
+//! ```sh
+//! device-connector-run --config conf.yml --dot - | dot -Tsvg > graph.svg
+//! ```
+
+use crate::channel::EdgeCounters;
+use crate::element::Port;
+use crate::task::{TaskId, TaskPort};
+use once_cell::sync::{Lazy, OnceCell};
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Instant;
+
+static GRAPH: OnceCell<Graph> = OnceCell::new();
+static LIVE: AtomicBool = AtomicBool::new(false);
+static EDGES: Lazy<Mutex<Vec<(TaskPort, TaskPort, Arc<EdgeCounters>)>>> = Lazy::new(Mutex::default);
+/// Time and counts of edges when the live graph was last written.
+static PREVIOUS: Lazy<Mutex<(Instant, HashMap<(TaskPort, TaskPort), (u64, u64)>)>> =
+    Lazy::new(|| Mutex::new((Instant::now(), HashMap::new())));
+
+pub(crate) struct Graph {
+    pub tasks: Vec<GraphTask>,
+    pub edges: Vec<GraphEdge>,
+}
+
+pub(crate) struct GraphTask {
+    pub id: TaskId,
+    pub element: String,
+    pub ports: (Port, Port),
+    /// Task whose thread runs this task.
+    pub thread: TaskId,
+    pub parallelism: usize,
+    pub cpu_affinity: Vec<usize>,
+    /// Limit of bytes queued for each receiving port.
+    pub budget: Option<usize>,
+}
+
+pub(crate) struct GraphEdge {
+    pub from: TaskPort,
+    pub to: TaskPort,
+    /// The receiving task runs the sending task as its child.
+    pub fused: bool,
+}
+
+/// Keep `graph` to write it with current rates later.
+pub(crate) fn set(graph: Graph) {
+    Lazy::force(&PREVIOUS);
+    let _ = GRAPH.set(graph);
+}
+
+/// Get the graph kept by `set`.
+pub(crate) fn get() -> Option<&'static Graph> {
+    GRAPH.get()
+}
+
+/// Count messages sent through edges registered after this for the live graph.
+pub(crate) fn enable_live() {
+    LIVE.store(true, Ordering::SeqCst);
+}
+
+/// Get counters of messages sent through the edge `from` -> `to`, if the live graph is
+/// written. Otherwise senders count nothing.
+pub(crate) fn register_edge(from: TaskPort, to: TaskPort) -> Option<Arc<EdgeCounters>> {
+    if !LIVE.load(Ordering::Relaxed) {
+        return None;
+    }
+    let counters = Arc::<EdgeCounters>::default();
+    EDGES.lock().unwrap().push((from, to, counters.clone()));
+    Some(counters)
+}
+
+/// Get the graph kept by `set` with rates since the previous call.
+pub(crate) fn live_dot() -> Option<String> {
+    let graph = GRAPH.get()?;
+
+    let mut previous = PREVIOUS.lock().unwrap();
+    let secs = previous.0.elapsed().as_secs_f64().max(f64::EPSILON);
+    let mut counts = HashMap::new();
+    for (from, to, counters) in EDGES.lock().unwrap().iter() {
+        let count = counts.entry((*from, *to)).or_insert((0, 0));
+        count.0 += counters.msgs.load(Ordering::Relaxed);
+        count.1 += counters.bytes.load(Ordering::Relaxed);
+    }
+
+    let mut labels = HashMap::new();
+    for (edge, (msgs, bytes)) in &counts {
+        let (prev_msgs, prev_bytes) = previous.1.get(edge).copied().unwrap_or((0, 0));
+        let mut label = format!(
+            "{:.1} msg/s\\n{:.0} B/s",
+            msgs.saturating_sub(prev_msgs) as f64 / secs,
+            bytes.saturating_sub(prev_bytes) as f64 / secs
+        );
+        let to = edge.1;
+        let depth = crate::watchdog::queue_depth(to);
+        let task = graph.tasks.iter().find(|task| task.id == to.0);
+        if let Some(depth) = depth {
+            let _ = write!(label, "\\nqueued {} msgs, {} B", depth.msgs, depth.bytes);
+            if let Some(budget) = task.and_then(|task| task.budget) {
+                let _ = write!(label, " of {} B", budget);
+            }
+        }
+        labels.insert(*edge, label);
+    }
+    *previous = (Instant::now(), counts);
+
+    Some(graph.write_dot(&labels))
+}
+
+impl Graph {
+    /// Write the graph without rates.
+    pub fn to_dot(&self) -> String {
+        self.write_dot(&HashMap::new())
+    }
+
+    fn write_dot(&self, labels: &HashMap<(TaskPort, TaskPort), String>) -> String {
+        let mut out = String::from("digraph device_connector {\n");
+        out.push_str("  rankdir=LR;\n  node [shape=record];\n");
+
+        let mut threads: Vec<TaskId> = self.tasks.iter().map(|task| task.thread).collect();
+        threads.sort();
+        threads.dedup();
+        for thread in threads {
+            let root = self.tasks.iter().find(|task| task.id == thread).unwrap();
+            let mut label = if root.parallelism > 1 {
+                format!(
+                    "{} threads of task {} with a dispatcher and a merger",
+                    root.parallelism, thread
+                )
+            } else {
+                format!("thread of task {}", thread)
+            };
+            if !root.cpu_affinity.is_empty() {
+                let cpus: Vec<String> = root.cpu_affinity.iter().map(usize::to_string).collect();
+                let _ = write!(label, " on CPU {}", cpus.join(","));
+            }
+            let _ = writeln!(out, "  subgraph cluster_{} {{", thread);
+            let _ = writeln!(out, "    label=\"{}\";", label);
+            for task in self.tasks.iter().filter(|task| task.thread == thread) {
+                let _ = writeln!(out, "    t{} [label=\"{}\"];", task.id, node_label(task));
+            }
+            out.push_str("  }\n");
+        }
+
+        for edge in &self.edges {
+            let _ = write!(
+                out,
+                "  t{}:o{} -> t{}:i{}",
+                edge.from.0, edge.from.1, edge.to.0, edge.to.1
+            );
+            if edge.fused {
+                out.push_str(" [style=dashed, label=\"fused\"]");
+            } else if let Some(label) = labels.get(&(edge.from, edge.to)) {
+                let _ = write!(out, " [label=\"{}\"]", label);
+            }
+            out.push_str(";\n");
+        }
+        out.push_str("}\n");
+        out
+    }
+}
+
+/// Record label with receiving ports on the left and sending ports on the right.
+fn node_label(task: &GraphTask) -> String {
+    let ports = |prefix: &str, n: Port| {
+        let ports: Vec<String> = (0..n).map(|i| format!("<{}{}>{}", prefix, i, i)).collect();
+        format!("{{{}}}", ports.join("|"))
+    };
+    let mut name = format!("{}: {}", task.id, escape(&task.element));
+    if task.parallelism > 1 {
+        let _ = write!(name, " x{}", task.parallelism);
+    }
+
+    let mut fields = Vec::new();
+    if task.ports.0 > 0 {
+        fields.push(ports("i", task.ports.0));
+    }
+    fields.push(name);
+    if task.ports.1 > 0 {
+        fields.push(ports("o", task.ports.1));
+    }
+    format!("{{{}}}", fields.join("|"))
+}
+
+fn escape(s: &str) -> String {
+    let mut escaped = String::new();
+    for c in s.chars() {
+        if "{}|<>\"\\ ".contains(c) {
+            escaped.push('\\');
+        }
+        escaped.push(c);
+    }
+    escaped
+}
+
+#[test]
+fn dot_test() {
+    let task = |id: u64, element: &str, ports: (Port, Port), thread: u64, parallelism| GraphTask {
+        id: TaskId(id),
+        element: element.to_owned(),
+        ports,
+        thread: TaskId(thread),
+        parallelism,
+        cpu_affinity: if parallelism > 1 { vec![1, 2] } else { vec![] },
+        budget: None,
+    };
+    let edge = |from: u64, to: u64, fused| GraphEdge {
+        from: TaskPort(TaskId(from), 0),
+        to: TaskPort(TaskId(to), 0),
+        fused,
+    };
+    let graph = Graph {
+        tasks: vec![
+            task(1, "text-src", (0, 1), 2, 1),
+            task(2, "stat-filter", (1, 1), 2, 1),
+            task(3, "stdout-sink", (1, 0), 3, 4),
+        ],
+        edges: vec![edge(1, 2, true), edge(2, 3, false)],
+    };
+    let mut labels = HashMap::new();
+    labels.insert(
+        (graph.edges[0].from, graph.edges[0].to),
+        "ignored".to_owned(),
+    );
+    labels.insert(
+        (graph.edges[1].from, graph.edges[1].to),
+        "1.0 msg/s".to_owned(),
+    );
+    let dot = graph.write_dot(&labels);
+
+    // The fused child is drawn in the cluster of its parent.
+    assert!(!dot.contains("cluster_1"));
+    let cluster = &dot[dot.find("subgraph cluster_2").unwrap()..];
+    let cluster = &cluster[..cluster.find("  }").unwrap()];
+    assert!(cluster.contains("label=\"thread of task 2\";"));
+    assert!(cluster.contains("t1 [label=\"{1: text-src|{<o0>0}}\"];"));
+    assert!(cluster.contains("t2 [label=\"{{<i0>0}|2: stat-filter|{<o0>0}}\"];"));
+    assert!(dot.contains("  t1:o0 -> t2:i0 [style=dashed, label=\"fused\"];\n"));
+
+    // Replicas are one cluster with their threads and CPUs.
+    assert!(
+        dot.contains("label=\"4 threads of task 3 with a dispatcher and a merger on CPU 1,2\";")
+    );
+    assert!(dot.contains("t3 [label=\"{{<i0>0}|3: stdout-sink x4}\"];"));
+    assert!(dot.contains("  t2:o0 -> t3:i0 [label=\"1.0 msg/s\"];\n"));
+    assert_eq!(graph.to_dot().matches("msg/s").count(), 0);
+}
+
+#[test]
+fn fused_conflict_test() {
+    use crate::conf::Conf;
+    use crate::{ElementBank, LoadedPlugin, RunnerBuilder};
+
+    // Task 1 is the only origin of both tasks, which both would run it as a child.
+    let conf = Conf::from_yaml(
+        r#"
+task:
+  - id: 1
+    element: text-src
+    conf:
+      text: "a"
+      interval_ms: 10
+  - id: 2
+    element: stdout-sink
+    from:
+      - - 1
+    conf:
+      separator: "\n"
+  - id: 3
+    element: stdout-sink
+    from:
+      - - 1
+    conf:
+      separator: "\n"
+"#,
+    )
+    .unwrap();
+    let bank = ElementBank::new();
+    let loaded_plugin = LoadedPlugin::from_conf(&conf.plugin).unwrap();
+    let mut runner_builder = RunnerBuilder::new(&bank, &loaded_plugin, &conf);
+    runner_builder.append_from_conf(&conf.tasks).unwrap();
+    let e = runner_builder.dot().unwrap_err();
+    assert_eq!(
+        e.to_string(),
+        "task 1 cannot run in the threads of both task 2 and task 3"
+    );
+}
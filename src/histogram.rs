@@ -0,0 +1,179 @@
+//! Log-linear histogram of nanoseconds or sizes, similar to HdrHistogram.
+//!
+//! Values below `SUB_COUNT` are exact. Larger values fall into buckets of 64 sub-buckets
+//! per power of two, which keeps the relative error under 1.6%.
+
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering::Relaxed;
+
+const SUB_BITS: u32 = 7;
+const SUB_COUNT: usize = 1 << SUB_BITS;
+const HALF_COUNT: usize = SUB_COUNT / 2;
+const BUCKETS: usize = SUB_COUNT + (64 - SUB_BITS as usize) * HALF_COUNT;
+
+/// Histogram of `u64` values.
+#[derive(Clone, Debug)]
+pub struct Histogram {
+    counts: Vec<u64>,
+    total: u64,
+    sum: u128,
+    min: u64,
+    max: u64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Histogram {
+            counts: vec![0; BUCKETS],
+            total: 0,
+            sum: 0,
+            min: u64::MAX,
+            max: 0,
+        }
+    }
+}
+
+impl Histogram {
+    pub fn record(&mut self, value: u64) {
+        self.counts[index(value)] += 1;
+        self.total += 1;
+        self.sum += value as u128;
+        self.min = self.min.min(value);
+        self.max = self.max.max(value);
+    }
+
+    /// Add values recorded in `other`.
+    pub fn merge(&mut self, other: &Histogram) {
+        for (count, other) in self.counts.iter_mut().zip(&other.counts) {
+            *count += other;
+        }
+        self.total += other.total;
+        self.sum += other.sum;
+        self.min = self.min.min(other.min);
+        self.max = self.max.max(other.max);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.total
+    }
+
+    pub fn min(&self) -> u64 {
+        if self.total == 0 {
+            0
+        } else {
+            self.min
+        }
+    }
+
+    pub fn max(&self) -> u64 {
+        self.max
+    }
+
+    pub fn mean(&self) -> f64 {
+        if self.total == 0 {
+            0.0
+        } else {
+            self.sum as f64 / self.total as f64
+        }
+    }
+
+    /// Get the highest value equivalent to the value at `quantile` in `0.0..=1.0`.
+    pub fn value_at_quantile(&self, quantile: f64) -> u64 {
+        if self.total == 0 {
+            return 0;
+        }
+        let rank = ((quantile.clamp(0.0, 1.0) * self.total as f64).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (i, &count) in self.counts.iter().enumerate() {
+            seen += count;
+            if seen >= rank {
+                return highest_equivalent(i).min(self.max);
+            }
+        }
+        self.max
+    }
+}
+
+/// Histogram written by one thread and read by others without locking.
+pub struct AtomicHistogram {
+    counts: Box<[AtomicU64]>,
+    sum: AtomicU64,
+    min: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Default for AtomicHistogram {
+    fn default() -> Self {
+        AtomicHistogram {
+            counts: (0..BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            sum: AtomicU64::new(0),
+            min: AtomicU64::new(u64::MAX),
+            max: AtomicU64::new(0),
+        }
+    }
+}
+
+impl AtomicHistogram {
+    /// Record `value`. Must not be called by multiple threads at once.
+    #[inline]
+    pub fn record(&self, value: u64) {
+        let add = |a: &AtomicU64, v: u64| a.store(a.load(Relaxed).wrapping_add(v), Relaxed);
+        add(&self.counts[index(value)], 1);
+        add(&self.sum, value);
+        if value < self.min.load(Relaxed) {
+            self.min.store(value, Relaxed);
+        }
+        if value > self.max.load(Relaxed) {
+            self.max.store(value, Relaxed);
+        }
+    }
+
+    /// Copy recorded values. Values recorded meanwhile may be partially included.
+    pub fn snapshot(&self) -> Histogram {
+        let counts: Vec<u64> = self.counts.iter().map(|c| c.load(Relaxed)).collect();
+        Histogram {
+            total: counts.iter().sum(),
+            counts,
+            sum: self.sum.load(Relaxed) as u128,
+            min: self.min.load(Relaxed),
+            max: self.max.load(Relaxed),
+        }
+    }
+}
+
+fn index(value: u64) -> usize {
+    if value < SUB_COUNT as u64 {
+        return value as usize;
+    }
+    let shift = 63 - value.leading_zeros() - (SUB_BITS - 1);
+    let sub = (value >> shift) as usize;
+    SUB_COUNT + (shift as usize - 1) * HALF_COUNT + (sub - HALF_COUNT)
+}
+
+fn highest_equivalent(index: usize) -> u64 {
+    if index < SUB_COUNT {
+        return index as u64;
+    }
+    let shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    let sub = ((index - SUB_COUNT) % HALF_COUNT + HALF_COUNT) as u64;
+    (sub << shift) + ((1u64 << shift) - 1)
+}
+
+#[test]
+fn histogram_test() {
+    let mut h = Histogram::default();
+    for v in 1..=10000 {
+        h.record(v * 1000);
+    }
+    assert_eq!(h.min(), 1000);
+    assert_eq!(h.max(), 10_000_000);
+
+    let p50 = h.value_at_quantile(0.5) as f64;
+    assert!((p50 / 5_000_000.0 - 1.0).abs() < 0.016);
+    let p99 = h.value_at_quantile(0.99) as f64;
+    assert!((p99 / 9_900_000.0 - 1.0).abs() < 0.016);
+    assert_eq!(h.value_at_quantile(1.0), 10_000_000);
+
+    h.record(u64::MAX);
+    assert_eq!(h.value_at_quantile(1.0), u64::MAX);
+}
@@ -1,30 +1,61 @@
 pub extern crate device_connector_common as common;
 
+mod alloc_stats;
 /// Basic elements for Device Connector.
 pub mod base;
+mod buf_pool;
 mod channel;
+mod clock;
 mod close;
 /// Configuration types.
 pub mod conf;
+mod cpu;
 pub mod element;
 /// Error types.
 pub mod error;
 mod finalizer;
+mod graph;
+mod histogram;
 mod loaded_plugin;
+mod logger;
+mod mem_budget;
+mod metrics;
 mod msg_buf;
 mod pipeline;
 mod plugin;
 pub mod process;
+mod realtime;
+mod replica;
+mod resource;
 mod runner;
+mod scratch;
+mod snapshot;
 mod task;
+mod task_stats;
+mod timer;
+mod trace;
 mod type_check;
+mod usdt;
+mod virtual_time;
+mod wait;
+mod watchdog;
+mod worker_pool;
 
+#[cfg(feature = "bench")]
+#[doc(hidden)]
+pub mod bench;
 #[doc(hidden)]
 pub mod macros;
 
+#[cfg(feature = "alloc-stats")]
+pub use alloc_stats::CountingAllocator;
 pub use element::*;
 pub use error::Error;
+pub use histogram::Histogram;
 pub use loaded_plugin::*;
+pub use logger::init_logger;
+pub use mem_budget::{memory_usage, MemoryUsage};
+pub use metrics::{metrics, MetricValue};
 pub use runner::*;
 pub use task::task_closing;
 
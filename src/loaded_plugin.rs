@@ -34,22 +34,40 @@ impl LoadedPlugin {
         for (path, lib) in &self.library_list {
             log::trace!("loading plugin from \"{}\"", path.display());
 
-            let plugin = unsafe {
-                let dc_load: libloading::Symbol<
-                    unsafe extern "C" fn(plugin: *mut DcPlugin) -> bool,
-                > = lib.get(b"dc_load")?;
-                let mut plugin = std::mem::zeroed();
-                if !dc_load(&mut plugin) {
-                    bail!("dc_load() failed for \"{}\"", path.display());
-                }
-                plugin
-            };
-
-            for i in 0..plugin.n_element {
-                let element = unsafe { *plugin.elements.add(i) };
-                bank.append_plugin(element)?;
+            unsafe {
+                let dc_load: libloading::Symbol<DcLoadFunc> = lib.get(b"dc_load")?;
+                load_plugin(bank, *dc_load, &path.display().to_string())?;
             }
         }
         Ok(())
     }
 }
+
+type DcLoadFunc = unsafe extern "C" fn(plugin: *mut DcPlugin) -> bool;
+
+/// Call `dc_load` and append the elements of the plugin to `bank`.
+pub(crate) unsafe fn load_plugin(
+    bank: &mut ElementBank,
+    dc_load: DcLoadFunc,
+    name: &str,
+) -> Result<()> {
+    let mut plugin: DcPlugin = std::mem::zeroed();
+    if let Some((log, max_level)) = crate::logger::plugin_logger() {
+        plugin.log = Some(log);
+        plugin.log_max_level = max_level;
+    }
+    if !dc_load(&mut plugin) {
+        bail!("dc_load() failed for \"{}\"", name);
+    }
+
+    for i in 0..plugin.n_element {
+        let element = *plugin.elements.add(i);
+        let flags = if plugin.element_flags.is_null() {
+            0
+        } else {
+            *plugin.element_flags.add(i)
+        };
+        bank.append_plugin(element, flags)?;
+    }
+    Ok(())
+}
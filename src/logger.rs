@@ -0,0 +1,335 @@
+//! Asynchronous logger shared by the runtime and plugins.
+//!
+//! Records are formatted by the logging thread and queued to a writer thread, so logging does
+//! not wait for stderr. Messages from a callsite beyond the rate limit in a second are
+//! suppressed and counted, and so are messages that do not fit in the queue. The writer
+//! reports the counts instead. Callsites are hashed into a fixed table of counters, so
+//! rate limiting takes no lock either. A counter belongs to the first callsite hashed to it,
+//! and other callsites colliding with it are not limited.
+
+use crate::conf::LogConf;
+use crossbeam_channel::{bounded, RecvTimeoutError, Sender};
+use libc::{c_char, size_t};
+use once_cell::sync::OnceCell;
+use std::ffi::CStr;
+use std::hash::Hasher;
+use std::io::Write;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::time::{Duration, Instant, SystemTime};
+
+const QUEUE: usize = 4096;
+const CALLSITES: usize = 1024;
+const DEFAULT_RATE_LIMIT: u32 = 100;
+
+static LOGGER: OnceCell<AsyncLogger> = OnceCell::new();
+
+struct AsyncLogger {
+    filter: env_logger::Logger,
+    sender: Sender<Entry>,
+    rate_limit: AtomicU32,
+    callsites: Box<[Callsite]>,
+    /// Messages dropped because the queue was full.
+    dropped: AtomicU64,
+}
+
+enum Entry {
+    Line(String),
+    Flush(Sender<()>),
+}
+
+#[derive(Default)]
+struct Callsite {
+    /// File, or target if unknown, and line of the callsite the counter belongs to.
+    key: OnceCell<(String, u32)>,
+    /// Second of the monotonic clock that `count` is for.
+    window: AtomicU64,
+    count: AtomicU32,
+    suppressed: AtomicU64,
+}
+
+/// Install the asynchronous logger, filtered by `RUST_LOG` or at info level if it is not set.
+pub fn init_logger() -> Result<(), log::SetLoggerError> {
+    let filter = if std::env::var("RUST_LOG").is_ok() {
+        env_logger::Builder::from_env("RUST_LOG").build()
+    } else {
+        env_logger::Builder::new()
+            .filter_level(log::LevelFilter::Info)
+            .build()
+    };
+    let max_level = filter.filter();
+
+    let (sender, receiver) = bounded(QUEUE);
+    let logger = AsyncLogger {
+        filter,
+        sender,
+        rate_limit: AtomicU32::new(DEFAULT_RATE_LIMIT),
+        callsites: (0..CALLSITES).map(|_| Callsite::default()).collect(),
+        dropped: AtomicU64::new(0),
+    };
+    if LOGGER.set(logger).is_err() {
+        // Already installed, which fails in the same way.
+        return log::set_logger(LOGGER.get().unwrap());
+    }
+    let logger = LOGGER.get().unwrap();
+    log::set_logger(logger)?;
+    log::set_max_level(max_level);
+
+    std::thread::Builder::new()
+        .name("logger".to_owned())
+        .spawn(move || {
+            let stderr = std::io::stderr();
+            let mut last_report = Instant::now();
+            loop {
+                match receiver.recv_timeout(Duration::from_secs(1)) {
+                    Ok(Entry::Line(line)) => {
+                        let _ = stderr.lock().write_all(line.as_bytes());
+                    }
+                    Ok(Entry::Flush(done)) => {
+                        let _ = done.send(());
+                    }
+                    Err(RecvTimeoutError::Timeout) => (),
+                    Err(RecvTimeoutError::Disconnected) => return,
+                }
+
+                let dropped = logger.dropped.swap(0, Ordering::Relaxed);
+                if dropped > 0 {
+                    let line = format_line(
+                        log::Level::Warn,
+                        module_path!(),
+                        format_args!("{} messages were dropped by a full log queue", dropped),
+                    );
+                    let _ = stderr.lock().write_all(line.as_bytes());
+                }
+                if last_report.elapsed() >= Duration::from_secs(1) {
+                    last_report = Instant::now();
+                    let now = coarse_secs();
+                    for callsite in logger.callsites.iter() {
+                        if callsite.window.load(Ordering::Relaxed) != now {
+                            logger.report_suppressed(callsite);
+                        }
+                    }
+                }
+            }
+        })
+        .expect("cannot spawn logger thread");
+    Ok(())
+}
+
+/// Apply the configuration to the logger installed by `init_logger`.
+pub(crate) fn configure(conf: &LogConf) {
+    if let Some(logger) = LOGGER.get() {
+        let limit = conf.rate_limit.unwrap_or(DEFAULT_RATE_LIMIT);
+        logger.rate_limit.store(limit, Ordering::Relaxed);
+    }
+}
+
+/// Logging function for plugins and the most verbose level, if `init_logger` is called.
+pub(crate) fn plugin_logger() -> Option<(common::DcLogFunc, u32)> {
+    LOGGER.get()?;
+    Some((plugin_log, log::max_level() as u32))
+}
+
+unsafe extern "C" fn plugin_log(
+    level: u32,
+    target: *const c_char,
+    file: *const c_char,
+    line: u32,
+    msg: *const c_char,
+    len: size_t,
+) {
+    let logger = match LOGGER.get() {
+        Some(logger) => logger,
+        None => return,
+    };
+    let level = match level {
+        1 => log::Level::Error,
+        2 => log::Level::Warn,
+        3 => log::Level::Info,
+        4 => log::Level::Debug,
+        5 => log::Level::Trace,
+        _ => return,
+    };
+    let str_of = |s: *const c_char| {
+        if s.is_null() {
+            None
+        } else {
+            Some(CStr::from_ptr(s).to_string_lossy())
+        }
+    };
+    let target = str_of(target);
+    let target = target.as_deref().unwrap_or("plugin");
+    let metadata = log::Metadata::builder().level(level).target(target).build();
+    if !log::Log::enabled(logger, &metadata) {
+        return;
+    }
+    let msg = String::from_utf8_lossy(std::slice::from_raw_parts(msg as *const u8, len));
+    let file = str_of(file);
+    logger.log_at(
+        level,
+        target,
+        file.as_deref(),
+        Some(line),
+        format_args!("{}", msg),
+    );
+}
+
+impl log::Log for AsyncLogger {
+    fn enabled(&self, metadata: &log::Metadata) -> bool {
+        self.filter.enabled(metadata)
+    }
+
+    fn log(&self, record: &log::Record) {
+        if self.filter.matches(record) {
+            self.log_at(
+                record.level(),
+                record.target(),
+                record.file(),
+                record.line(),
+                *record.args(),
+            );
+        }
+    }
+
+    /// Wait until queued messages are written.
+    fn flush(&self) {
+        for callsite in self.callsites.iter() {
+            self.report_suppressed(callsite);
+        }
+        let (done, wait) = bounded(1);
+        if self.sender.send(Entry::Flush(done)).is_ok() {
+            let _ = wait.recv_timeout(Duration::from_secs(1));
+        }
+    }
+}
+
+impl AsyncLogger {
+    fn log_at(
+        &self,
+        level: log::Level,
+        target: &str,
+        file: Option<&str>,
+        line: Option<u32>,
+        args: std::fmt::Arguments,
+    ) {
+        let file = file.unwrap_or(target);
+        let line = line.unwrap_or(0);
+        let callsite = &self.callsites[callsite_index(file, line)];
+        let (owner_file, owner_line) = callsite.key.get_or_init(|| (file.to_owned(), line));
+        if owner_file == file && *owner_line == line && self.limited(callsite) {
+            return;
+        }
+
+        self.push(format_line(level, target, args));
+    }
+
+    /// Count a message of the callsite and return true if it is beyond the rate limit.
+    fn limited(&self, callsite: &Callsite) -> bool {
+        let now = coarse_secs();
+        if callsite.window.load(Ordering::Relaxed) != now
+            && callsite.window.swap(now, Ordering::Relaxed) != now
+        {
+            callsite.count.store(0, Ordering::Relaxed);
+            self.report_suppressed(callsite);
+        }
+        let limit = self.rate_limit.load(Ordering::Relaxed);
+        if limit != 0 && callsite.count.fetch_add(1, Ordering::Relaxed) >= limit {
+            callsite.suppressed.fetch_add(1, Ordering::Relaxed);
+            return true;
+        }
+        false
+    }
+
+    fn report_suppressed(&self, callsite: &Callsite) {
+        let suppressed = callsite.suppressed.swap(0, Ordering::Relaxed);
+        if suppressed > 0 {
+            let (file, line) = callsite
+                .key
+                .get()
+                .expect("suppressed at an unowned callsite");
+            self.push(format_line(
+                log::Level::Warn,
+                module_path!(),
+                format_args!(
+                    "{} messages were suppressed at {}:{}",
+                    suppressed, file, line
+                ),
+            ));
+        }
+    }
+
+    fn push(&self, line: String) {
+        if self.sender.try_send(Entry::Line(line)).is_err() {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+fn callsite_index(file: &str, line: u32) -> usize {
+    let mut hasher = fnv::FnvHasher::default();
+    hasher.write(file.as_bytes());
+    hasher.write_u32(line);
+    hasher.finish() as usize % CALLSITES
+}
+
+fn coarse_secs() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC_COARSE, &mut ts) };
+    ts.tv_sec as u64
+}
+
+/// Format a line like the default format of env_logger.
+fn format_line(level: log::Level, target: &str, args: std::fmt::Arguments) -> String {
+    format!(
+        "[{} {:<5} {}] {}\n",
+        humantime::format_rfc3339_seconds(SystemTime::now()),
+        level,
+        target,
+        args
+    )
+}
+
+#[test]
+fn callsite_collision_test() {
+    let (sender, receiver) = bounded(QUEUE);
+    let logger = AsyncLogger {
+        filter: env_logger::Builder::new().build(),
+        sender,
+        rate_limit: AtomicU32::new(1),
+        callsites: (0..CALLSITES).map(|_| Callsite::default()).collect(),
+        dropped: AtomicU64::new(0),
+    };
+    let index = callsite_index("debug.rs", 1);
+    let line = (1..)
+        .find(|&line| callsite_index("error.rs", line) == index)
+        .unwrap();
+    let log = |file, line| {
+        logger.log_at(
+            log::Level::Error,
+            "test",
+            Some(file),
+            Some(line),
+            format_args!("{}:{}", file, line),
+        );
+    };
+
+    // The storm is limited at its callsite but the colliding one is not.
+    for _ in 0..10 {
+        log("debug.rs", 1);
+    }
+    for _ in 0..3 {
+        log("error.rs", line);
+    }
+    let lines: Vec<String> = receiver
+        .try_iter()
+        .map(|entry| match entry {
+            Entry::Line(line) => line,
+            Entry::Flush(_) => unreachable!(),
+        })
+        .collect();
+    let count = |location: &str| lines.iter().filter(|l| l.ends_with(location)).count();
+    assert!(count("] debug.rs:1\n") <= 2);
+    assert_eq!(count(&format!("] error.rs:{}\n", line)), 3);
+}
@@ -11,7 +11,7 @@ macro_rules! define_dc_load {
         unsafe extern "C" fn dc_load(plugin: *mut $crate::common::DcPlugin) -> bool {
             use $crate::macros::ctypes::*;
             use $crate::common::{
-                DcElement, DcElementResult, DcFinalizer, DcMsgReceiver, DcPipeline, dc_init
+                DcElement, DcElementResult, DcFinalizer, DcMsgReceiver, DcPipeline, dc_plugin_init
             };
             use $crate::{
                 ElementBuildable, ElementConf, ElementExecutable, ElementFinalizer, ElementValue,
@@ -26,11 +26,12 @@ macro_rules! define_dc_load {
             };
 
             let crate_name_c_str = CString::new(env!("CARGO_CRATE_NAME")).unwrap().into_raw();
-            dc_init(crate_name_c_str);
+            dc_plugin_init(plugin, crate_name_c_str);
 
             plugin.version = CString::new("0.1.0").unwrap().into_raw();
 
             let mut elements: Vec<DcElement> = Vec::new();
+            let mut element_flags: Vec<u32> = Vec::new();
 
             $({
                 use $t as TargetElement;
@@ -152,11 +153,14 @@ macro_rules! define_dc_load {
                 };
 
                 elements.push(element);
+                element_flags.push($crate::buildable_flags::<TargetElement>());
             })*
 
             let elements = std::mem::ManuallyDrop::new(elements);
+            let element_flags = std::mem::ManuallyDrop::new(element_flags);
             plugin.n_element = elements.len();
             plugin.elements = elements.as_ptr();
+            plugin.element_flags = element_flags.as_ptr();
 
             true
         }
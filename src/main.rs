@@ -1,23 +1,25 @@
 use anyhow::Result;
 use clap::Parser;
-use env_logger::Builder;
 use std::path::PathBuf;
 
 use device_connector::conf::Conf;
 use device_connector::{ElementBank, LoadedPlugin, RunnerBuilder};
 
+#[cfg(feature = "alloc-stats")]
+#[global_allocator]
+static ALLOCATOR: device_connector::CountingAllocator = device_connector::CountingAllocator;
+
 #[derive(Parser)]
 struct Args {
     #[clap(short, long)]
     config: PathBuf,
+    /// Validate the config, write the task graph in DOT to this file or `-` for stdout, and exit.
+    #[clap(long)]
+    dot: Option<PathBuf>,
 }
 
 fn main() -> Result<()> {
-    if std::env::var("RUST_LOG").is_ok() {
-        Builder::from_env("RUST_LOG").init();
-    } else {
-        Builder::new().filter_level(log::LevelFilter::Info).init();
-    };
+    device_connector::init_logger()?;
 
     let args = Args::parse();
     let conf = Conf::read_from_file(&args.config)?;
@@ -25,6 +27,19 @@ fn main() -> Result<()> {
     let loaded_plugin = LoadedPlugin::from_conf(&conf.plugin)?;
     loaded_plugin.load_plugins(&mut bank)?;
 
+    if let Some(path) = &args.dot {
+        let mut runner_builder = RunnerBuilder::new(&bank, &loaded_plugin, &conf);
+        runner_builder.append_from_conf(&conf.tasks)?;
+        let dot = runner_builder.dot()?;
+        if path.as_os_str() == "-" {
+            print!("{}", dot);
+        } else {
+            std::fs::write(path, dot)?;
+        }
+        log::logger().flush();
+        return Ok(());
+    }
+
     // Start bg processes
     device_connector::process::start_bg_processes(&conf.bg_processes)?;
 
@@ -39,7 +54,9 @@ fn main() -> Result<()> {
     runner_builder.append_from_conf(&conf.tasks)?;
     let runner = runner_builder.build()?;
 
-    runner.run()?;
+    let result = runner.run();
+    log::logger().flush();
+    result?;
 
     Ok(())
 }
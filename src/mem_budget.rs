@@ -0,0 +1,203 @@
+//! Byte accounting of messages held in channels.
+
+use crate::conf::MemoryBudgetPolicy;
+use once_cell::sync::Lazy;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Condvar, Mutex};
+use std::time::Duration;
+
+static IN_FLIGHT_BYTES: AtomicUsize = AtomicUsize::new(0);
+static PEAK_BYTES: AtomicUsize = AtomicUsize::new(0);
+static DROPPED_MSGS: AtomicU64 = AtomicU64::new(0);
+static DROPPED_BYTES: AtomicU64 = AtomicU64::new(0);
+/// Global limit in bytes. Zero means unlimited.
+static TOTAL_LIMIT: AtomicUsize = AtomicUsize::new(0);
+
+static WAITERS: AtomicUsize = AtomicUsize::new(0);
+static RELEASED: Lazy<(Mutex<()>, Condvar)> = Lazy::new(|| (Mutex::new(()), Condvar::new()));
+
+/// Upper bound of a blocked sender's sleep, in case a release notification is missed.
+const WAIT_TIMEOUT: Duration = Duration::from_millis(10);
+
+/// Memory usage of messages held in channels.
+#[derive(Clone, Copy, PartialEq, Eq, Debug, Default)]
+pub struct MemoryUsage {
+    /// Bytes currently queued in all channels.
+    pub in_flight_bytes: usize,
+    /// Maximum of `in_flight_bytes` since start.
+    pub peak_bytes: usize,
+    /// Messages dropped by the `drop` policy.
+    pub dropped_msgs: u64,
+    /// Bytes dropped by the `drop` policy.
+    pub dropped_bytes: u64,
+}
+
+/// Get current memory usage of messages held in channels.
+pub fn memory_usage() -> MemoryUsage {
+    MemoryUsage {
+        in_flight_bytes: IN_FLIGHT_BYTES.load(Ordering::Relaxed),
+        peak_bytes: PEAK_BYTES.load(Ordering::Relaxed),
+        dropped_msgs: DROPPED_MSGS.load(Ordering::Relaxed),
+        dropped_bytes: DROPPED_BYTES.load(Ordering::Relaxed),
+    }
+}
+
+pub(crate) fn set_total_limit(limit: Option<usize>) {
+    TOTAL_LIMIT.store(limit.unwrap_or(0), Ordering::Relaxed);
+}
+
+/// Accounting of bytes queued for one receiving port.
+pub(crate) struct EdgeAccount {
+    bytes: AtomicUsize,
+    /// Counted only while the watchdog or snapshots track queue depths.
+    msgs: AtomicUsize,
+    count_msgs: bool,
+    limit: Option<usize>,
+    policy: MemoryBudgetPolicy,
+}
+
+impl EdgeAccount {
+    pub fn new(limit: Option<usize>, policy: MemoryBudgetPolicy) -> Self {
+        EdgeAccount {
+            bytes: AtomicUsize::new(0),
+            msgs: AtomicUsize::new(0),
+            // Accounts are created after tracking is enabled.
+            count_msgs: crate::watchdog::tracking(),
+            limit,
+            policy,
+        }
+    }
+
+    /// Reserve `size` bytes before sending a message.
+    /// Returns false if the message must be dropped.
+    pub fn acquire(&self, size: usize) -> bool {
+        loop {
+            let edge = self.bytes.fetch_add(size, Ordering::Relaxed) + size;
+            let total = IN_FLIGHT_BYTES.fetch_add(size, Ordering::Relaxed) + size;
+
+            // A message is always admitted when nothing else is queued, so that a message
+            // larger than the budget cannot block forever.
+            let total_limit = TOTAL_LIMIT.load(Ordering::Relaxed);
+            let over_total = total_limit != 0 && total > total_limit && total != size;
+            let over_edge = matches!(self.limit, Some(limit) if edge > limit && edge != size);
+
+            if !over_total && !over_edge {
+                PEAK_BYTES.fetch_max(total, Ordering::Relaxed);
+                if self.count_msgs {
+                    self.msgs.fetch_add(1, Ordering::Relaxed);
+                }
+                return true;
+            }
+
+            self.unreserve(size);
+
+            match self.policy {
+                MemoryBudgetPolicy::Drop => {
+                    DROPPED_MSGS.fetch_add(1, Ordering::Relaxed);
+                    DROPPED_BYTES.fetch_add(size as u64, Ordering::Relaxed);
+                    return false;
+                }
+                MemoryBudgetPolicy::Block => {
+                    if crate::task_closing() {
+                        return false;
+                    }
+                    wait_release();
+                }
+            }
+        }
+    }
+
+    /// Bytes queued now.
+    pub fn bytes(&self) -> usize {
+        self.bytes.load(Ordering::Relaxed)
+    }
+
+    /// Messages queued now, or 0 if they are not counted.
+    pub fn msgs(&self) -> usize {
+        self.msgs.load(Ordering::Relaxed)
+    }
+
+    /// Release bytes of a received message.
+    pub fn release(&self, size: usize) {
+        if self.count_msgs {
+            self.msgs.fetch_sub(1, Ordering::Relaxed);
+        }
+        self.unreserve(size);
+    }
+
+    fn unreserve(&self, size: usize) {
+        self.bytes.fetch_sub(size, Ordering::Relaxed);
+        IN_FLIGHT_BYTES.fetch_sub(size, Ordering::Relaxed);
+
+        if WAITERS.load(Ordering::Relaxed) > 0 {
+            let _lock = RELEASED.0.lock().unwrap();
+            RELEASED.1.notify_all();
+        }
+    }
+}
+
+fn wait_release() {
+    WAITERS.fetch_add(1, Ordering::Relaxed);
+    let lock = RELEASED.0.lock().unwrap();
+    let _ = RELEASED.1.wait_timeout(lock, WAIT_TIMEOUT).unwrap();
+    WAITERS.fetch_sub(1, Ordering::Relaxed);
+}
+
+#[test]
+fn drop_policy_test() {
+    let dropped = || {
+        let usage = memory_usage();
+        (usage.dropped_msgs, usage.dropped_bytes)
+    };
+
+    // Beyond the edge limit, unless nothing else is queued.
+    let edge = EdgeAccount::new(Some(100), MemoryBudgetPolicy::Drop);
+    let (msgs, bytes) = dropped();
+    assert!(edge.acquire(80));
+    assert!(!edge.acquire(30));
+    assert_eq!(dropped(), (msgs + 1, bytes + 30));
+    assert_eq!(edge.bytes(), 80);
+    edge.release(80);
+    assert!(edge.acquire(30));
+    edge.release(30);
+    assert!(edge.acquire(200));
+    edge.release(200);
+    assert_eq!(edge.bytes(), 0);
+
+    // Beyond the total limit. Sizes are large so that other tests do not matter.
+    set_total_limit(Some(1_000_000));
+    let a = EdgeAccount::new(None, MemoryBudgetPolicy::Drop);
+    let b = EdgeAccount::new(None, MemoryBudgetPolicy::Drop);
+    let (msgs, bytes) = dropped();
+    assert!(a.acquire(600_000));
+    assert!(memory_usage().peak_bytes >= 600_000);
+    assert!(!b.acquire(600_000));
+    assert_eq!(dropped(), (msgs + 1, bytes + 600_000));
+    assert_eq!(b.bytes(), 0);
+    a.release(600_000);
+    assert!(b.acquire(600_000));
+    b.release(600_000);
+    set_total_limit(None);
+}
+
+#[test]
+fn block_policy_test() {
+    let edge = std::sync::Arc::new(EdgeAccount::new(Some(100), MemoryBudgetPolicy::Block));
+    assert!(edge.acquire(80));
+
+    // The sender waits until the queued message is released.
+    let (done, finished) = crossbeam_channel::bounded(1);
+    let thread = {
+        let edge = edge.clone();
+        std::thread::spawn(move || {
+            let acquired = edge.acquire(30);
+            done.send(()).unwrap();
+            acquired
+        })
+    };
+    assert!(finished.recv_timeout(Duration::from_millis(100)).is_err());
+    edge.release(80);
+    assert!(thread.join().unwrap());
+    assert_eq!(edge.bytes(), 30);
+    edge.release(30);
+}
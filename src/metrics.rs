@@ -0,0 +1,221 @@
+//! Metrics registered by elements through the pipeline.
+//!
+//! Each thread updates its own shard of a counter or histogram, so updates take no lock
+//! except for the first one of each metric in a thread. Shards are merged when metrics are
+//! read. Metric ids are indices plus one.
+
+use crate::histogram::{AtomicHistogram, Histogram};
+use common::DcMetricKind;
+use once_cell::sync::Lazy;
+use std::cell::RefCell;
+use std::sync::atomic::{AtomicI64, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+static METRICS: Lazy<Mutex<Vec<Arc<Metric>>>> = Lazy::new(Mutex::default);
+
+thread_local! {
+    static SHARDS: RefCell<Vec<Option<Arc<Shard>>>> = RefCell::new(Vec::new());
+}
+
+struct Metric {
+    name: String,
+    kind: DcMetricKind,
+    gauge: AtomicI64,
+    shards: Mutex<Vec<Arc<Shard>>>,
+}
+
+/// Part of a metric updated only by one thread.
+enum Shard {
+    Counter(AtomicU64),
+    Gauge(Arc<Metric>),
+    Histogram(AtomicHistogram),
+}
+
+/// Current value of a metric.
+#[derive(Clone, Debug)]
+pub enum MetricValue {
+    Counter(u64),
+    Gauge(i64),
+    Histogram(Histogram),
+}
+
+impl std::fmt::Display for MetricValue {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            MetricValue::Counter(value) => write!(f, "{}", value),
+            MetricValue::Gauge(value) => write!(f, "{}", value),
+            MetricValue::Histogram(h) => write!(
+                f,
+                "count {}, mean {:.0}, p50 {}, p99 {}, max {}",
+                h.count(),
+                h.mean(),
+                h.value_at_quantile(0.5),
+                h.value_at_quantile(0.99),
+                h.max()
+            ),
+        }
+    }
+}
+
+/// Register the metric `name`, or get the metric with the same name and kind.
+/// Returns 0 if `name` is registered with another kind.
+pub(crate) fn register(name: &str, kind: DcMetricKind) -> u64 {
+    let mut metrics = METRICS.lock().unwrap();
+    if let Some(i) = metrics.iter().position(|metric| metric.name == name) {
+        if metrics[i].kind != kind {
+            log::warn!(
+                "metric {} is already registered as {:?}",
+                name,
+                metrics[i].kind
+            );
+            return 0;
+        }
+        return i as u64 + 1;
+    }
+    metrics.push(Arc::new(Metric {
+        name: name.to_owned(),
+        kind,
+        gauge: AtomicI64::new(0),
+        shards: Mutex::new(Vec::new()),
+    }));
+    metrics.len() as u64
+}
+
+/// Update the metric in the shard of the current thread. Unknown ids are ignored.
+#[inline]
+pub(crate) fn update(metric: u64, value: i64) {
+    let index = match (metric as usize).checked_sub(1) {
+        Some(index) => index,
+        None => return,
+    };
+    SHARDS.with(|shards| {
+        let mut shards = shards.borrow_mut();
+        if shards.get(index).map_or(true, Option::is_none) {
+            match new_shard(index) {
+                Some(shard) => {
+                    if shards.len() <= index {
+                        shards.resize(index + 1, None);
+                    }
+                    shards[index] = Some(shard);
+                }
+                None => return,
+            }
+        }
+
+        match shards[index].as_deref().unwrap() {
+            Shard::Counter(count) => {
+                let value = value.max(0) as u64;
+                count.store(
+                    count.load(Ordering::Relaxed).wrapping_add(value),
+                    Ordering::Relaxed,
+                );
+            }
+            Shard::Gauge(metric) => metric.gauge.store(value, Ordering::Relaxed),
+            Shard::Histogram(h) => h.record(value.max(0) as u64),
+        }
+    });
+}
+
+fn new_shard(index: usize) -> Option<Arc<Shard>> {
+    let metric = METRICS.lock().unwrap().get(index)?.clone();
+    let shard = Arc::new(match metric.kind {
+        DcMetricKind::Counter => Shard::Counter(AtomicU64::new(0)),
+        DcMetricKind::Gauge => Shard::Gauge(metric.clone()),
+        DcMetricKind::Histogram => Shard::Histogram(AtomicHistogram::default()),
+    });
+    if metric.kind != DcMetricKind::Gauge {
+        metric.shards.lock().unwrap().push(shard.clone());
+    }
+    Some(shard)
+}
+
+/// Get current values of metrics registered by elements, in the order of registration.
+pub fn metrics() -> Vec<(String, MetricValue)> {
+    let metrics = METRICS.lock().unwrap().clone();
+    metrics
+        .iter()
+        .map(|metric| (metric.name.clone(), metric.value()))
+        .collect()
+}
+
+impl Metric {
+    fn value(&self) -> MetricValue {
+        let shards = self.shards.lock().unwrap();
+        match self.kind {
+            DcMetricKind::Counter => MetricValue::Counter(
+                shards
+                    .iter()
+                    .map(|shard| match &**shard {
+                        Shard::Counter(count) => count.load(Ordering::Relaxed),
+                        _ => 0,
+                    })
+                    .sum(),
+            ),
+            DcMetricKind::Gauge => MetricValue::Gauge(self.gauge.load(Ordering::Relaxed)),
+            DcMetricKind::Histogram => {
+                let mut sum = Histogram::default();
+                for shard in shards.iter() {
+                    if let Shard::Histogram(h) = &**shard {
+                        sum.merge(&h.snapshot());
+                    }
+                }
+                MetricValue::Histogram(sum)
+            }
+        }
+    }
+}
+
+/// Log current values of metrics.
+pub(crate) fn log_metrics() {
+    for (name, value) in metrics() {
+        log::info!("metric {}: {}", name, value);
+    }
+}
+
+#[test]
+fn metrics_test() {
+    let counter = register("test.counter", DcMetricKind::Counter);
+    let histogram = register("test.histogram", DcMetricKind::Histogram);
+    let gauge = register("test.gauge", DcMetricKind::Gauge);
+    assert_ne!(counter, 0);
+    assert_eq!(register("test.counter", DcMetricKind::Counter), counter);
+    assert_eq!(register("test.counter", DcMetricKind::Histogram), 0);
+    assert_eq!(register("test.gauge", DcMetricKind::Counter), 0);
+
+    // Shards of each thread are merged, including ones of finished threads.
+    let threads: Vec<_> = (0..4)
+        .map(|_| {
+            std::thread::spawn(move || {
+                for i in 1..=1000 {
+                    update(counter, 1);
+                    update(histogram, i);
+                }
+                update(counter, -5);
+            })
+        })
+        .collect();
+    for thread in threads {
+        thread.join().unwrap();
+    }
+    update(gauge, 3);
+    update(gauge, -2);
+    update(0, 1);
+    update(u64::MAX, 1);
+
+    let value = |name: &str| {
+        metrics()
+            .into_iter()
+            .find(|(metric, _)| metric == name)
+            .unwrap()
+            .1
+    };
+    assert!(matches!(value("test.counter"), MetricValue::Counter(4000)));
+    assert!(matches!(value("test.gauge"), MetricValue::Gauge(-2)));
+    match value("test.histogram") {
+        MetricValue::Histogram(h) => {
+            assert_eq!(h.count(), 4000);
+            assert_eq!(h.max(), 1000);
+        }
+        value => panic!("unexpected value {:?}", value),
+    }
+}
@@ -1,15 +1,18 @@
+use crate::buf_pool::BufPool;
 use common::{DcMsg, DcMsgBuf, DcMsgInner, Msg, SendableMsg};
 
 const INITIAL_CAP: usize = 1024;
 
 pub struct MsgBufInner {
     buf: Vec<u8>,
+    pub(crate) pool: Option<&'static BufPool>,
 }
 
 impl MsgBufInner {
     pub fn new() -> Self {
         MsgBufInner {
             buf: Vec::with_capacity(INITIAL_CAP),
+            pool: None,
         }
     }
 
@@ -17,6 +20,13 @@ impl MsgBufInner {
         self.buf.clear();
     }
 
+    /// Allocate and touch `size` bytes of the buffer.
+    pub fn preallocate(&mut self, size: usize) {
+        let len = self.buf.len();
+        self.buf.resize(len.max(size), 0);
+        self.buf.truncate(len);
+    }
+
     pub fn into_ffi(self) -> DcMsgBuf {
         let msg_buf = Box::new(self);
 
@@ -39,6 +49,10 @@ impl MsgBufInner {
     }
 
     pub fn get_msg_cloned(&self) -> DcMsg {
+        if let Some(msg) = self.pool.and_then(|pool| pool.get_msg(&self.buf)) {
+            return msg;
+        }
+
         let mut v = std::mem::ManuallyDrop::new(self.buf.clone());
         DcMsg {
             inner: DcMsgInner {
@@ -60,6 +74,16 @@ unsafe extern "C" fn msg_cloned_drop(p: *mut u8, len: usize, capacity: usize) {
     let _v = Vec::from_raw_parts(p, len, capacity);
 }
 
+/// Take ownership of `msg`, copying it only if it refers to a buffer of another task.
+pub fn into_sendable(msg: Msg) -> SendableMsg {
+    let msg = msg.into_ffi();
+    if msg.drop.is_some() {
+        SendableMsg(unsafe { Msg::new(msg) })
+    } else {
+        msg_clone(&unsafe { Msg::new(msg) })
+    }
+}
+
 pub fn msg_clone(msg: &Msg) -> SendableMsg {
     let data: &[u8] = msg.as_bytes();
 
@@ -1,8 +1,20 @@
+use crate::buf_pool::BufPool;
 use crate::element::Port;
 use crate::error::TypeCheckError;
+use crate::resource::ResourceRegistry;
+use crate::scratch::ScratchArena;
 use crate::task::TaskId;
+use crate::timer::Timer;
 use crate::type_check::TypeChecker;
-use common::{DcMsgBuf, DcMsgType, DcPipeline, DcPipelineInner, MsgType};
+use crate::worker_pool::JobGroup;
+use common::{
+    DcJobFunc, DcMetricKind, DcMsgBuf, DcMsgType, DcParallelForFunc, DcPipeline, DcPipelineInner,
+    DcResource, DcTimestamp, MsgType,
+};
+use libc::{c_char, c_void};
+use std::ffi::CStr;
+use std::sync::Arc;
+use std::time::Duration;
 
 /// Pipeline handler from elements.
 pub struct PipelineInner {
@@ -10,15 +22,24 @@ pub struct PipelineInner {
     tc: TypeChecker,
     send_msg_type_checked: bool,
     pub(crate) msg_buf: DcMsgBuf,
+    pub(crate) scratch: ScratchArena,
+    jobs: Arc<JobGroup>,
+    resources: Arc<ResourceRegistry>,
+    /// Timers of the task. Timer ids are indices plus one.
+    timers: Vec<Option<Timer>>,
 }
 
 impl PipelineInner {
-    pub fn new(tc: TypeChecker) -> Self {
+    pub fn new(tc: TypeChecker, resources: Arc<ResourceRegistry>) -> Self {
         PipelineInner {
             self_taskid: None,
             tc,
             send_msg_type_checked: false,
             msg_buf: crate::msg_buf::MsgBufInner::new().into_ffi(),
+            scratch: ScratchArena::default(),
+            jobs: Arc::default(),
+            resources,
+            timers: Vec::new(),
         }
     }
 
@@ -28,9 +49,31 @@ impl PipelineInner {
             tc: self.tc.clone(),
             send_msg_type_checked: self.send_msg_type_checked,
             msg_buf: crate::msg_buf::MsgBufInner::new().into_ffi(),
+            scratch: ScratchArena::default(),
+            jobs: Arc::default(),
+            resources: self.resources.clone(),
+            timers: Vec::new(),
         }
     }
 
+    /// Send messages through buffers of `pool`.
+    pub fn set_buf_pool(&mut self, pool: &'static BufPool) {
+        let msg_buf = unsafe { &mut *(self.msg_buf.inner as *mut crate::msg_buf::MsgBufInner) };
+        msg_buf.pool = Some(pool);
+    }
+
+    /// Allocate and touch message buffer and scratch arena memory.
+    pub fn preallocate(&mut self, size: usize) {
+        let msg_buf = unsafe { &mut *(self.msg_buf.inner as *mut crate::msg_buf::MsgBufInner) };
+        msg_buf.preallocate(size);
+        self.scratch.preallocate(size);
+    }
+
+    fn timer(&self, timer: u64) -> Option<&Timer> {
+        let index = (timer as usize).checked_sub(1)?;
+        self.timers.get(index)?.as_ref()
+    }
+
     pub fn self_taskid(&self) -> TaskId {
         self.self_taskid
             .expect("called self_taskid from out of task")
@@ -60,6 +103,19 @@ impl PipelineInner {
             send_msg_type_checked,
             check_send_msg_type,
             msg_buf,
+            scratch_alloc,
+            submit_job,
+            wait_jobs,
+            parallel_for,
+            resource,
+            timer_register,
+            timer_expired,
+            timer_wait,
+            timer_cancel,
+            now,
+            sleep,
+            metric_register,
+            metric_update,
         }
     }
 }
@@ -84,3 +140,98 @@ unsafe fn msg_buf(inner: *mut DcPipelineInner) -> *mut DcMsgBuf {
     crate::msg_buf::msg_buf_clear(&mut inner.msg_buf);
     &mut inner.msg_buf
 }
+
+unsafe fn scratch_alloc(inner: *mut DcPipelineInner, size: usize) -> *mut c_void {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    inner.scratch.alloc(size) as *mut c_void
+}
+
+unsafe fn submit_job(inner: *mut DcPipelineInner, func: DcJobFunc, arg: *mut c_void) {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    inner.jobs.submit(func, arg);
+}
+
+unsafe fn wait_jobs(inner: *mut DcPipelineInner) {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    inner.jobs.wait();
+}
+
+unsafe fn parallel_for(
+    _inner: *mut DcPipelineInner,
+    n: usize,
+    func: DcParallelForFunc,
+    arg: *mut c_void,
+) {
+    crate::worker_pool::parallel_for(n, func, arg);
+}
+
+unsafe fn resource(
+    inner: *mut DcPipelineInner,
+    name: *const c_char,
+    resource: *mut DcResource,
+) -> bool {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    let name = CStr::from_ptr(name).to_string_lossy();
+    match inner.resources.acquire(&name) {
+        Some(acquired) => {
+            *resource = acquired;
+            true
+        }
+        None => false,
+    }
+}
+
+unsafe fn timer_register(inner: *mut DcPipelineInner, interval_ns: u64, periodic: bool) -> u64 {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    let timer = Timer::new(Duration::from_nanos(interval_ns), periodic);
+    inner.timers.push(Some(timer));
+    inner.timers.len() as u64
+}
+
+unsafe fn timer_expired(inner: *mut DcPipelineInner, timer: u64) -> u64 {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    inner.timer(timer).map_or(0, Timer::expired)
+}
+
+unsafe fn timer_wait(inner: *mut DcPipelineInner, timer: u64) -> u64 {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    let _wait = crate::watchdog::Wait::sleep();
+    inner.timer(timer).map_or(0, Timer::wait)
+}
+
+unsafe fn timer_cancel(inner: *mut DcPipelineInner, timer: u64) {
+    let inner: &mut PipelineInner = &mut *(inner as *mut PipelineInner);
+    if let Some(slot) = (timer as usize)
+        .checked_sub(1)
+        .and_then(|index| inner.timers.get_mut(index))
+    {
+        *slot = None;
+    }
+}
+
+unsafe fn now(_inner: *mut DcPipelineInner, coarse: bool) -> DcTimestamp {
+    crate::clock::now(coarse)
+}
+
+unsafe fn sleep(_inner: *mut DcPipelineInner, ns: u64) {
+    let duration = Duration::from_nanos(ns);
+    let _wait = crate::watchdog::Wait::sleep();
+    if crate::virtual_time::enabled() {
+        Timer::new(duration, false).wait();
+    } else {
+        std::thread::sleep(duration);
+    }
+}
+
+unsafe fn metric_register(
+    _inner: *mut DcPipelineInner,
+    name: *const c_char,
+    kind: DcMetricKind,
+) -> u64 {
+    let name = CStr::from_ptr(name).to_string_lossy();
+    crate::metrics::register(&name, kind)
+}
+
+unsafe fn metric_update(_inner: *mut DcPipelineInner, metric: u64, value: i64) {
+    crate::metrics::update(metric, value)
+}
@@ -11,7 +11,7 @@ use std::{
 };
 
 impl ElementBank {
-    pub(crate) fn append_plugin(&mut self, element: DcElement) -> Result<(), Error> {
+    pub(crate) fn append_plugin(&mut self, element: DcElement, flags: u32) -> Result<(), Error> {
         let name = unsafe { CStr::from_ptr(element.name) }.to_str()?;
 
         let builder = ElementBuilder::Plugin(element);
@@ -32,7 +32,7 @@ impl ElementBank {
 
         let ports = (element.recv_ports, element.send_ports);
 
-        self.append(name, builder, Box::new(acceptable_msg_types), ports)?;
+        self.append(name, builder, Box::new(acceptable_msg_types), ports, flags)?;
         Ok(())
     }
 }
@@ -0,0 +1,66 @@
+//! Memory locking and prefaulting for realtime deployments.
+
+use anyhow::{bail, Result};
+use std::io;
+
+const PAGE_SIZE: usize = 4096;
+
+/// Stack size of threads spawned by `std::thread` without an explicit size.
+const DEFAULT_STACK_SIZE: usize = 2 * 1024 * 1024;
+
+/// Stack left untouched for frames above the prefaulting function.
+const STACK_MARGIN: usize = 64 * 1024;
+
+/// Lock all current and future pages of the process in memory.
+pub(crate) fn lock_all_memory() -> Result<()> {
+    if unsafe { libc::mlockall(libc::MCL_CURRENT | libc::MCL_FUTURE) } != 0 {
+        bail!("mlockall failed: {}", io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Limit `bytes` to prefault so that it fits a stack of `stack_size`.
+pub(crate) fn clamp_stack_prefault(bytes: usize, stack_size: Option<usize>) -> usize {
+    let stack_size = stack_size.unwrap_or(DEFAULT_STACK_SIZE);
+    bytes.min(stack_size.saturating_sub(STACK_MARGIN))
+}
+
+/// Touch `bytes` of the current thread's stack below the caller's frame.
+///
+/// Pages are touched in a loop down to the bottom of the stack reported by pthread, so the
+/// prefaulting itself uses only one frame.
+#[inline(never)]
+pub(crate) fn prefault_stack(bytes: usize) {
+    let marker = 0u8;
+    let sp = std::hint::black_box(&marker) as *const u8 as usize;
+    let mut low = sp.saturating_sub(bytes);
+    if let Some(bottom) = stack_bottom() {
+        low = low.max(bottom + PAGE_SIZE);
+    }
+
+    // Start a page below this frame, out of the red zone.
+    let mut addr = (sp & !(PAGE_SIZE - 1)).saturating_sub(PAGE_SIZE);
+    while addr >= low && addr > 0 {
+        unsafe {
+            let p = addr as *mut u8;
+            // Write the same value back, so that the page is private and nothing changes.
+            p.write_volatile(p.read_volatile());
+        }
+        addr -= PAGE_SIZE;
+    }
+}
+
+/// Get the lowest address of the current thread's stack.
+fn stack_bottom() -> Option<usize> {
+    unsafe {
+        let mut attr: libc::pthread_attr_t = std::mem::zeroed();
+        if libc::pthread_getattr_np(libc::pthread_self(), &mut attr) != 0 {
+            return None;
+        }
+        let mut addr = std::ptr::null_mut();
+        let mut size = 0;
+        let result = libc::pthread_attr_getstack(&attr, &mut addr, &mut size);
+        libc::pthread_attr_destroy(&mut attr);
+        (result == 0).then_some(addr as usize)
+    }
+}
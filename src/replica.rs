@@ -0,0 +1,251 @@
+//! Parallel instances of a task.
+//!
+//! A dispatcher thread receives messages of the task and distributes them to instances.
+//! A merger thread forwards outputs of instances in the order of inputs, or in the order of
+//! arrival for hash dispatch.
+
+use crate::channel::{ChannelBuilder, EdgeOptions, QueueDepths};
+use crate::conf::{DispatchPolicy, PartitionKeyConf, WaitConf};
+use crate::element::*;
+use crate::error::Error;
+use crate::finalizer::FinalizerHolder;
+use crate::msg_buf::into_sendable;
+use crate::task::Task;
+use common::SendableMsg;
+use crossbeam_channel::{bounded, unbounded, Receiver};
+use std::hash::Hasher;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::thread::{spawn as spawn_thread, JoinHandle};
+
+/// Output of an instance and the number of messages it had received at that point.
+/// `None` tells that the instance is waiting for input.
+pub(crate) type ReplicaOutput = (u64, Option<SendableMsg>);
+
+/// Instances added to a task, and how to feed them.
+pub(crate) struct ReplicaGroup {
+    pub replicas: Vec<Task>,
+    pub dispatch: DispatchPolicy,
+    pub partition_key: Option<PartitionKeyConf>,
+    pub options: EdgeOptions,
+    pub wait: WaitConf,
+}
+
+/// Spawn `task` and its replicas. The returned handle finishes after all instances.
+pub(crate) fn spawn(
+    mut task: Task,
+    group: ReplicaGroup,
+    fh: &mut FinalizerHolder,
+) -> Result<JoinHandle<ElementResult>, Error> {
+    let id = task.id();
+    let (sender, receiver) = task.take_channel().split();
+    let mut replicas = vec![task];
+    replicas.extend(group.replicas);
+    let n = replicas.len();
+    let ordered = group.dispatch != DispatchPolicy::Hash;
+
+    let mut edges = Vec::new();
+    let mut outputs = Vec::new();
+    let (shared_output_sender, shared_output_receiver) = bounded(group.options.capacity * n);
+    let mut handles = Vec::new();
+    for mut replica in replicas {
+        let mut channel = ChannelBuilder::new(1, 0, group.options);
+        channel.set_wait(&group.wait);
+        edges.push(channel.get_sender(0));
+        let mut channel = channel.build();
+
+        if ordered {
+            let (output_sender, output_receiver) = bounded(group.options.capacity);
+            let idle_sender = output_sender.clone();
+            channel.receiver.set_on_idle(Box::new(move |received| {
+                let _ = idle_sender.send((received, None));
+            }));
+            replica.set_replica_output(output_sender);
+            outputs.push(output_receiver);
+        } else {
+            replica.set_replica_output(shared_output_sender.clone());
+        }
+        replica.set_channel(channel);
+        handles.push(replica.spawn(fh)?);
+    }
+    drop(shared_output_sender);
+
+    let outstanding: Arc<Vec<AtomicUsize>> =
+        Arc::new((0..n).map(|_| AtomicUsize::new(0)).collect());
+    let (log_sender, log_receiver) = unbounded();
+
+    let dispatcher = {
+        let outstanding = outstanding.clone();
+        let mut receiver = receiver;
+        let queues = receiver.queue_depths();
+        let busy = crate::virtual_time::Busy::new();
+        spawn_thread(move || {
+            let _busy = busy;
+            let _stats = crate::task_stats::register(format!("task {} dispatcher", id));
+            let _trace = crate::trace::register(format!("task {} dispatcher", id));
+            let _watchdog =
+                crate::watchdog::register(format!("task {} dispatcher", id), id, queues);
+            let mut next = 0;
+            while let Ok(msg) = receiver.recv(0) {
+                let msg = into_sendable(msg);
+                let i = match group.dispatch {
+                    DispatchPolicy::RoundRobin => next,
+                    DispatchPolicy::LeastLoaded => least_loaded(&outstanding, next),
+                    DispatchPolicy::Hash => {
+                        let key = group.partition_key.as_ref().unwrap().key(msg.0.as_bytes());
+                        let mut hasher = fnv::FnvHasher::default();
+                        hasher.write(key);
+                        (hasher.finish() % n as u64) as usize
+                    }
+                };
+                next = (next + 1) % n;
+
+                if ordered {
+                    outstanding[i].fetch_add(1, Ordering::Relaxed);
+                    if log_sender.send(i).is_err() {
+                        break;
+                    }
+                }
+                if edges[i].send(msg).is_err() {
+                    break;
+                }
+                crate::watchdog::msg_sent();
+            }
+            log::info!("dispatcher of task {} is closed", id);
+        })
+    };
+
+    Ok(spawn_thread(move || {
+        let _stats = crate::task_stats::register(format!("task {} merger", id));
+        let _trace = crate::trace::register(format!("task {} merger", id));
+        let _watchdog =
+            crate::watchdog::register(format!("task {} merger", id), id, QueueDepths::default());
+        let forward = |msg| {
+            if let Err(e) = sender.send(msg, 0) {
+                log::error!("task {} occured sending error\n{}", id, e);
+            }
+            crate::watchdog::msg_sent();
+            crate::watchdog::progress();
+            crate::virtual_time::end();
+        };
+        if ordered {
+            merge(&log_receiver, &outputs, &outstanding, forward);
+        } else {
+            std::iter::from_fn(|| recv(&shared_output_receiver))
+                .filter_map(|(_, msg)| msg)
+                .for_each(forward);
+        }
+
+        let _ = dispatcher.join();
+        let mut result = Ok(ElementValue::Close);
+        for handle in handles {
+            match handle.join() {
+                Ok(Err(e)) if result.is_ok() => result = Err(e),
+                _ => (),
+            }
+        }
+        result
+    }))
+}
+
+/// Forward outputs in the order of the instance indices in `log`.
+fn merge(
+    log: &Receiver<usize>,
+    outputs: &[Receiver<ReplicaOutput>],
+    outstanding: &[AtomicUsize],
+    mut forward: impl FnMut(SendableMsg),
+) {
+    let mut dispatched = vec![0; outputs.len()];
+    let mut peeked: Vec<Option<ReplicaOutput>> = outputs.iter().map(|_| None).collect();
+
+    while let Some(i) = recv(log) {
+        dispatched[i] += 1;
+        let seq = dispatched[i];
+
+        // Forward outputs produced after receiving the `seq`th message, until the instance
+        // receives the next one or waits for it.
+        loop {
+            let output = match peeked[i].take() {
+                Some(output) => output,
+                None => match recv(&outputs[i]) {
+                    Some(output) => output,
+                    None => break,
+                },
+            };
+            match output {
+                (received, Some(msg)) if received <= seq => forward(msg),
+                (received, None) if received < seq => (),
+                (received, None) if received == seq => break,
+                output => {
+                    peeked[i] = Some(output);
+                    break;
+                }
+            }
+        }
+        outstanding[i].fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+/// Receive in the merger, which the watchdog sees as waiting meanwhile.
+fn recv<T>(receiver: &Receiver<T>) -> Option<T> {
+    let _wait = crate::watchdog::Wait::recv_any();
+    receiver.recv().ok()
+}
+
+/// Get the instance with the fewest unfinished messages. Ties are broken from `start`.
+fn least_loaded(outstanding: &[AtomicUsize], start: usize) -> usize {
+    let n = outstanding.len();
+    (0..n)
+        .map(|i| (start + i) % n)
+        .min_by_key(|&i| outstanding[i].load(Ordering::Relaxed))
+        .unwrap()
+}
+
+#[test]
+fn merge_test() {
+    use common::{DcMsg, DcMsgInner, Msg};
+
+    fn msg(data: &[u8]) -> SendableMsg {
+        let msg = DcMsg {
+            inner: DcMsgInner {
+                msg_ref: data.as_ptr(),
+            },
+            len: data.len(),
+            capacity: 0,
+            drop: None,
+        };
+        crate::msg_buf::msg_clone(&unsafe { Msg::new(msg) })
+    }
+
+    // Inputs 1 and 3 went to instance 0, and 2 and 4 to instance 1.
+    let (log_sender, log) = unbounded();
+    for i in [0, 1, 0, 1] {
+        log_sender.send(i).unwrap();
+    }
+    drop(log_sender);
+
+    let (sender0, output0) = unbounded();
+    let (sender1, output1) = unbounded();
+    // Instance 1 finished input 4 before instance 0 started input 3.
+    sender1.send((0, None)).unwrap();
+    sender1.send((1, None)).unwrap();
+    sender1.send((2, Some(msg(b"4")))).unwrap();
+    // Instance 0 sent two outputs for input 1, and did not wait before input 3.
+    sender0.send((0, None)).unwrap();
+    sender0.send((1, Some(msg(b"1a")))).unwrap();
+    sender0.send((1, Some(msg(b"1b")))).unwrap();
+    sender0.send((2, Some(msg(b"3")))).unwrap();
+    sender0.send((2, None)).unwrap();
+    drop((sender0, sender1));
+
+    let outstanding = [AtomicUsize::new(2), AtomicUsize::new(2)];
+    let mut forwarded = Vec::new();
+    merge(&log, &[output0, output1], &outstanding, |msg| {
+        forwarded.push(msg.0.as_bytes().to_vec())
+    });
+
+    assert_eq!(forwarded, [&b"1a"[..], b"1b", b"3", b"4"]);
+    assert!(outstanding
+        .iter()
+        .all(|count| count.load(Ordering::Relaxed) == 0));
+}
@@ -0,0 +1,147 @@
+//! Immutable data loaded once and shared by all tasks.
+
+use crate::conf::ResourceConf;
+use anyhow::{anyhow, bail, Result};
+use common::DcResource;
+use libc::c_void;
+use std::collections::HashMap;
+use std::fs::File;
+use std::io;
+use std::os::unix::io::AsRawFd;
+use std::sync::Arc;
+
+/// Resources declared in the configuration, by name.
+///
+/// Each resource is unloaded when the registry and all handles acquired by elements are
+/// dropped.
+#[derive(Default)]
+pub struct ResourceRegistry {
+    resources: HashMap<String, Arc<Resource>>,
+}
+
+enum Resource {
+    Loaded(Vec<u8>),
+    Mapped { ptr: *mut libc::c_void, len: usize },
+}
+
+unsafe impl Send for Resource {}
+unsafe impl Sync for Resource {}
+
+impl ResourceRegistry {
+    /// Load all resources of `confs`.
+    pub fn load(confs: &[ResourceConf]) -> Result<Self> {
+        let mut resources = HashMap::new();
+        for conf in confs {
+            if resources.contains_key(&conf.name) {
+                bail!("duplicated resource \"{}\"", conf.name);
+            }
+            let resource = Resource::load(conf).map_err(|e| {
+                anyhow!(
+                    "cannot load resource \"{}\" from {:?}\n{}",
+                    conf.name,
+                    conf.path,
+                    e
+                )
+            })?;
+            log::debug!(
+                "loaded resource \"{}\" ({} bytes)",
+                conf.name,
+                resource.as_bytes().len()
+            );
+            resources.insert(conf.name.clone(), Arc::new(resource));
+        }
+        Ok(ResourceRegistry { resources })
+    }
+
+    /// Get a handle to a resource for elements, released by `dc_resource_release`.
+    pub fn acquire(&self, name: &str) -> Option<DcResource> {
+        let resource = self.resources.get(name)?.clone();
+        let data = resource.as_bytes();
+        Some(DcResource {
+            data: data.as_ptr(),
+            len: data.len(),
+            inner: Arc::into_raw(resource) as *mut c_void,
+            release: Some(release),
+        })
+    }
+}
+
+unsafe extern "C" fn release(inner: *mut c_void) {
+    drop(Arc::from_raw(inner as *const Resource));
+}
+
+impl Resource {
+    fn load(conf: &ResourceConf) -> Result<Self> {
+        if !conf.mmap {
+            return Ok(Resource::Loaded(std::fs::read(&conf.path)?));
+        }
+
+        let file = File::open(&conf.path)?;
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Ok(Resource::Loaded(Vec::new()));
+        }
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            bail!("mmap failed: {}", io::Error::last_os_error());
+        }
+        Ok(Resource::Mapped { ptr, len })
+    }
+
+    fn as_bytes(&self) -> &[u8] {
+        match self {
+            Resource::Loaded(data) => data,
+            Resource::Mapped { ptr, len } => unsafe {
+                std::slice::from_raw_parts(*ptr as *const u8, *len)
+            },
+        }
+    }
+}
+
+impl Drop for Resource {
+    fn drop(&mut self) {
+        if let Resource::Mapped { ptr, len } = *self {
+            unsafe { libc::munmap(ptr, len) };
+        }
+    }
+}
+
+#[test]
+fn resource_test() {
+    let path = std::env::temp_dir().join(format!("dc-resource-test-{}", std::process::id()));
+    std::fs::write(&path, b"weights").unwrap();
+    let confs: Vec<ResourceConf> = [false, true]
+        .iter()
+        .map(|&mmap| ResourceConf {
+            name: format!("mmap {}", mmap),
+            path: path.clone(),
+            mmap,
+        })
+        .collect();
+    let registry = ResourceRegistry::load(&confs).unwrap();
+    std::fs::remove_file(&path).unwrap();
+    assert!(registry.acquire("none").is_none());
+
+    // Handles keep resources loaded after the registry is dropped.
+    let mut resources: Vec<DcResource> = confs
+        .iter()
+        .map(|conf| registry.acquire(&conf.name).unwrap())
+        .collect();
+    drop(registry);
+    for resource in &mut resources {
+        let data = unsafe { std::slice::from_raw_parts(resource.data, resource.len) };
+        assert_eq!(data, b"weights");
+        unsafe { common::dc_resource_release(resource) };
+        assert!(resource.release.is_none());
+        unsafe { common::dc_resource_release(resource) };
+    }
+}
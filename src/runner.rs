@@ -1,13 +1,20 @@
-use crate::channel::ChannelBuilder;
+use crate::buf_pool::BufPool;
+use crate::channel::{
+    Channel, ChannelBuilder, EdgeOptions, DEFAULT_CHANNEL_CAPACITY, DEFAULT_MAX_BATCH,
+};
 use crate::conf::*;
 use crate::element::*;
 use crate::finalizer::FinalizerHolder;
+use crate::graph::{Graph, GraphEdge, GraphTask};
 use crate::loaded_plugin::LoadedPlugin;
 use crate::pipeline::PipelineInner;
+use crate::replica::ReplicaGroup;
+use crate::resource::ResourceRegistry;
 use crate::task::*;
 use crate::type_check::TypeChecker;
 use anyhow::{bail, Result};
 use std::collections::HashMap;
+use std::sync::Arc;
 
 /// Run built tasks.
 pub struct Runner<'b, 'p> {
@@ -23,6 +30,7 @@ pub struct RunnerBuilder<'b, 'p> {
     tasks: Vec<Task>,
     channels: HashMap<TaskId, Vec<Vec<TaskPort>>>,
     ports: HashMap<TaskId, (Port, Port)>,
+    task_confs: HashMap<TaskId, TaskConf>,
     conf: Conf,
     bank: &'b ElementBank,
     loaded_plugin: &'p LoadedPlugin,
@@ -36,6 +44,7 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
             tasks: Vec::new(),
             channels: HashMap::new(),
             ports: HashMap::new(),
+            task_confs: HashMap::new(),
             conf: conf.clone(),
             bank,
             loaded_plugin,
@@ -51,7 +60,7 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
         receive_from: &[Vec<TaskPort>],
         ports: (Port, Port),
     ) {
-        let task = Task::new(
+        let mut task = Task::new(
             id,
             element,
             self.pipeline
@@ -59,6 +68,9 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
                 .map(|pipeline| pipeline.clone())
                 .unwrap(),
         );
+        if let Some(bytes) = self.conf.runner.realtime.preallocate_bytes {
+            task.preallocate(bytes);
+        }
         self.tasks.push(task);
         self.channels.insert(id, receive_from.to_vec());
         self.ports.insert(id, ports);
@@ -66,21 +78,108 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
 
     pub fn append_from_conf(&mut self, conf: &[TaskConf]) -> Result<()> {
         let tc = TypeChecker::new(self.bank, conf)?;
-        let pipeline = PipelineInner::new(tc);
+        let resources = ResourceRegistry::load(&self.conf.resources)?;
+        let pipeline = PipelineInner::new(tc, Arc::new(resources));
         self.pipeline = Some(pipeline);
 
         for task_conf in conf {
+            if let Some(cpu) = task_conf
+                .cpu_affinity
+                .iter()
+                .find(|&&cpu| cpu >= libc::CPU_SETSIZE as usize)
+            {
+                bail!(
+                    "CPU {} in cpu_affinity of task {} must be less than {}",
+                    cpu,
+                    task_conf.id,
+                    libc::CPU_SETSIZE
+                );
+            }
             let element = self.conf_to_element(task_conf)?;
             // TODO: Port handling for plugin elements
             let ports = self.bank.ports(&task_conf.element)?;
+            if task_conf.parallelism.unwrap_or(1) <= 1
+                && (task_conf.dispatch.is_some() || task_conf.partition_key.is_some())
+            {
+                bail!(
+                    "dispatch and partition_key of task {} need parallelism more than 1",
+                    task_conf.id
+                );
+            }
+            if let Some(parallelism) = task_conf.parallelism {
+                if parallelism == 0 {
+                    bail!("parallelism of task {} must be positive", task_conf.id);
+                }
+                let (replicable, kind) = if task_conf.dispatch == Some(DispatchPolicy::Hash) {
+                    if task_conf.partition_key.is_none() {
+                        bail!(
+                            "task {} needs partition_key for hash dispatch",
+                            task_conf.id
+                        );
+                    }
+                    (
+                        self.bank.partitionable(&task_conf.element)?,
+                        "partitionable",
+                    )
+                } else {
+                    (self.bank.replicable(&task_conf.element)?, "replicable")
+                };
+                if parallelism > 1 && !replicable {
+                    bail!(
+                        "element \"{}\" of task {} is not {}",
+                        task_conf.element,
+                        task_conf.id,
+                        kind
+                    );
+                }
+                if parallelism > 1 && ports != (1, 1) {
+                    bail!(
+                        "task {} must have one receiving and one sending port to be replicated",
+                        task_conf.id
+                    );
+                }
+            }
             self.append_task(task_conf.id, element, &task_conf.from, ports);
+            self.task_confs.insert(task_conf.id, task_conf.clone());
         }
 
         Ok(())
     }
 
     pub fn build(mut self) -> Result<Runner<'b, 'p>> {
+        if self.conf.runner.realtime.mlockall {
+            crate::realtime::lock_all_memory()?;
+        }
+        if self.conf.runner.virtual_time {
+            crate::virtual_time::enable();
+        }
+        if let Some(task_stats) = &self.conf.runner.task_stats {
+            crate::task_stats::enable(task_stats);
+        }
+        if let Some(trace) = &self.conf.runner.trace {
+            crate::trace::enable(trace);
+        }
+        crate::logger::configure(&self.conf.runner.log);
+        if let Some(watchdog) = &self.conf.runner.watchdog {
+            crate::watchdog::enable(watchdog, self.task_confs.values());
+        }
+        if let Some(snapshot) = &self.conf.runner.snapshot {
+            crate::graph::set(self.graph()?);
+            if snapshot.dot_path.is_some() {
+                crate::graph::enable_live();
+            }
+            crate::snapshot::enable(snapshot);
+        }
+        crate::mem_budget::set_total_limit(self.conf.runner.memory_budget.total_bytes);
+        let pinned: Vec<usize> = self
+            .task_confs
+            .values()
+            .flat_map(|conf| conf.cpu_affinity.iter().copied())
+            .collect();
+        crate::worker_pool::init(&self.conf.runner.worker_pool, &pinned);
         self.set_channel()?;
+        self.set_task_options()?;
+        self.set_replicas()?;
 
         Ok(Runner {
             tasks: self.tasks,
@@ -106,15 +205,16 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
                 bail!("task id duplication detected (id: {})", task_id);
             }
             let ports = self.ports[task_id];
-            channels.insert(*task_id, ChannelBuilder::new(ports.0, ports.1));
+            let mut channel = ChannelBuilder::new(ports.0, ports.1, self.edge_options(*task_id));
+            channel.set_wait(self.wait_conf(*task_id));
+            channels.insert(*task_id, channel);
         }
 
         // Set channels
         for task_id in &task_ids {
             // Receive from these ports
             if let Some(origins) = self.channels.get(task_id) {
-                if origins.len() == 1 && origins[0].len() == 1 {
-                    let child_task_port = origins[0][0];
+                if let Some(child_task_port) = self.fused_origin(*task_id) {
                     let child_task_id = child_task_port.0;
                     let i = self.tasks.iter().enumerate().find_map(|(i, task)| {
                         if task.id() == child_task_id {
@@ -126,7 +226,7 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
                     let i = if let Some(i) = i { i } else { todo!() };
                     let mut child_task = self.tasks.remove(i);
                     if let Some(channel) = channels.remove(&child_task_id) {
-                        child_task.set_channel(channel.build());
+                        child_task.set_channel(build_channel(child_task_id, channel));
                     } else {
                         bail!(
                             "task {} not found that is referenced by task {}",
@@ -142,10 +242,14 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
                     for (recv_port, origins) in origins.iter().enumerate() {
                         for origin in origins {
                             // Set channel origin -> task_id:recv_port
-                            let sender = channels
+                            let mut sender = channels
                                 .get_mut(task_id)
                                 .unwrap()
                                 .get_sender(recv_port as Port);
+                            let to = TaskPort(*task_id, recv_port as Port);
+                            if let Some(counters) = crate::graph::register_edge(*origin, to) {
+                                sender.set_counters(counters);
+                            }
                             if let Some(origin_channel) = channels.get_mut(&origin.0) {
                                 origin_channel.set_sender(sender, origin.1);
                             } else {
@@ -165,7 +269,7 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
         for task in &mut self.tasks {
             let task_id = task.id();
             if let Some(channel) = channels.remove(&task_id) {
-                task.set_channel(channel.build());
+                task.set_channel(build_channel(task_id, channel));
             } else {
                 todo!()
             }
@@ -173,6 +277,203 @@ impl<'b, 'p> RunnerBuilder<'b, 'p> {
 
         Ok(())
     }
+
+    /// Set thread options and buffer pools for tasks that run on their own threads.
+    fn set_task_options(&mut self) -> Result<()> {
+        let mut tasks = std::mem::take(&mut self.tasks);
+        for task in &mut tasks {
+            self.set_options(task)?;
+        }
+        self.tasks = tasks;
+        Ok(())
+    }
+
+    fn set_options(&self, task: &mut Task) -> Result<()> {
+        let task_id = task.id();
+        let realtime = &self.conf.runner.realtime;
+        let mut stack_size = realtime.stack_size;
+        if let Some(conf) = self.task_confs.get(&task_id) {
+            task.set_cpu_affinity(conf.cpu_affinity.clone());
+            stack_size = conf.stack_size.or(stack_size);
+        }
+        task.set_stack(stack_size, realtime.prefault_stack_bytes);
+
+        let pool_conf = if let Some(pool_conf) = &self.conf.runner.buffer_pool {
+            pool_conf
+        } else {
+            return Ok(());
+        };
+        if self.ports[&task_id].1 == 0 {
+            return Ok(());
+        }
+        let numa_node = if pool_conf.numa {
+            consumer_cpu(&self.task_confs, task_id).and_then(crate::cpu::numa_node_of_cpu)
+        } else {
+            None
+        };
+        task.set_buf_pool(BufPool::new(pool_conf, numa_node)?);
+        Ok(())
+    }
+
+    /// Add instances to tasks that have `parallelism`.
+    fn set_replicas(&mut self) -> Result<()> {
+        let mut tasks = std::mem::take(&mut self.tasks);
+        for task in &mut tasks {
+            let conf = &self.task_confs[&task.id()];
+            let parallelism = conf.parallelism.unwrap_or(1);
+            if parallelism <= 1 {
+                continue;
+            }
+
+            let mut replicas = Vec::new();
+            for _ in 1..parallelism {
+                let mut replica = Task::new(
+                    conf.id,
+                    self.conf_to_element(conf)?,
+                    self.pipeline.as_ref().unwrap().clone(),
+                );
+                if let Some(bytes) = self.conf.runner.realtime.preallocate_bytes {
+                    replica.preallocate(bytes);
+                }
+                self.set_options(&mut replica)?;
+                replicas.push(replica);
+            }
+            task.set_replicas(ReplicaGroup {
+                replicas,
+                dispatch: conf.dispatch.unwrap_or_default(),
+                partition_key: conf.partition_key.clone(),
+                options: self.edge_options(conf.id),
+                wait: self.wait_conf(conf.id).clone(),
+            });
+        }
+        self.tasks = tasks;
+        Ok(())
+    }
+
+    /// Get the sending port of the task that runs in the thread of `task_id` as its child.
+    fn fused_origin(&self, task_id: TaskId) -> Option<TaskPort> {
+        let origins = self.channels.get(&task_id)?;
+        // Replicated tasks need a channel to their merger thread.
+        if origins.len() == 1 && origins[0].len() == 1 && !self.replicated(origins[0][0].0) {
+            Some(origins[0][0])
+        } else {
+            None
+        }
+    }
+
+    /// Export the graph of appended tasks in the DOT language of Graphviz.
+    pub fn dot(&self) -> Result<String> {
+        Ok(self.graph()?.to_dot())
+    }
+
+    fn graph(&self) -> Result<Graph> {
+        let mut ids: Vec<TaskId> = self.task_confs.keys().copied().collect();
+        ids.sort();
+
+        let mut parents: HashMap<TaskId, TaskId> = HashMap::new();
+        let mut edges = Vec::new();
+        for id in &ids {
+            let fused = self.fused_origin(*id);
+            if let Some(origin) = fused {
+                if let Some(other) = parents.insert(origin.0, *id) {
+                    bail!(
+                        "task {} cannot run in the threads of both task {} and task {}",
+                        origin.0,
+                        other,
+                        id
+                    );
+                }
+            }
+            for (port, origins) in self.channels[id].iter().enumerate() {
+                for origin in origins {
+                    if !self.task_confs.contains_key(&origin.0) {
+                        bail!(
+                            "task {} not found that is referenced by task {}",
+                            origin,
+                            id
+                        );
+                    }
+                    edges.push(GraphEdge {
+                        from: *origin,
+                        to: TaskPort(*id, port as Port),
+                        fused: fused == Some(*origin),
+                    });
+                }
+            }
+        }
+
+        let tasks = ids
+            .iter()
+            .map(|id| {
+                let conf = &self.task_confs[id];
+                let mut thread = *id;
+                while let Some(parent) = parents.get(&thread) {
+                    thread = *parent;
+                }
+                GraphTask {
+                    id: *id,
+                    element: conf.element.clone(),
+                    ports: self.ports[id],
+                    thread,
+                    parallelism: conf.parallelism.unwrap_or(1),
+                    cpu_affinity: conf.cpu_affinity.clone(),
+                    budget: self.edge_options(*id).budget,
+                }
+            })
+            .collect();
+        Ok(Graph { tasks, edges })
+    }
+
+    fn replicated(&self, task_id: TaskId) -> bool {
+        self.task_confs
+            .get(&task_id)
+            .and_then(|conf| conf.parallelism)
+            .unwrap_or(1)
+            > 1
+    }
+
+    fn edge_options(&self, task_id: TaskId) -> EdgeOptions {
+        let runner_conf = &self.conf.runner;
+        let task_conf = self.task_confs.get(&task_id);
+        EdgeOptions {
+            capacity: runner_conf
+                .channel_capacity
+                .unwrap_or(DEFAULT_CHANNEL_CAPACITY),
+            max_batch: runner_conf.max_batch.unwrap_or(DEFAULT_MAX_BATCH),
+            budget: task_conf
+                .and_then(|conf| conf.edge_budget_bytes)
+                .or(runner_conf.memory_budget.edge_bytes),
+            budget_policy: runner_conf.memory_budget.policy,
+        }
+    }
+
+    fn wait_conf(&self, task_id: TaskId) -> &WaitConf {
+        self.task_confs
+            .get(&task_id)
+            .and_then(|conf| conf.wait.as_ref())
+            .unwrap_or(&self.conf.runner.wait)
+    }
+}
+
+/// Build the channel of task `id` and keep its receiving ports to read their depths.
+fn build_channel(id: TaskId, channel: ChannelBuilder) -> Channel {
+    let channel = channel.build();
+    crate::watchdog::register_queues(id, channel.receiver.queue_depths());
+    channel
+}
+
+/// Get a pinned CPU of the task with the lowest id that receives from `task_id`, or of
+/// `task_id` itself.
+fn consumer_cpu(task_confs: &HashMap<TaskId, TaskConf>, task_id: TaskId) -> Option<usize> {
+    let consumer = task_confs
+        .values()
+        .filter(|conf| {
+            !conf.cpu_affinity.is_empty() && conf.from.iter().flatten().any(|tp| tp.0 == task_id)
+        })
+        .min_by_key(|conf| conf.id);
+    consumer
+        .or_else(|| task_confs.get(&task_id))
+        .and_then(|conf| conf.cpu_affinity.first().copied())
 }
 
 impl<'b, 'p> Runner<'b, 'p> {
@@ -181,11 +482,14 @@ impl<'b, 'p> Runner<'b, 'p> {
         // Start tasks
         let mut fh = self.fh;
         let mut tasks = Vec::new();
+        // Keep the virtual clock until all tasks are spawned.
+        let busy = crate::virtual_time::Busy::new();
         for task in self.tasks.into_iter() {
             log::info!("spawn task {}", task.id());
             let jh = task.spawn(&mut fh)?;
             tasks.push(jh);
         }
+        drop(busy);
 
         crate::finalizer::register(fh);
 
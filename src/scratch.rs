@@ -0,0 +1,96 @@
+//! Per-task scratch arena.
+
+use std::mem::MaybeUninit;
+
+/// Alignment of memory returned by `ScratchArena::alloc`.
+pub const SCRATCH_ALIGN: usize = 16;
+
+/// Size of the first chunk in bytes.
+const MIN_CHUNK_SIZE: usize = 4096;
+
+#[derive(Clone, Copy)]
+#[repr(C, align(16))]
+struct Block([u8; SCRATCH_ALIGN]);
+
+/// Bump allocator for temporary buffers used inside `next()`.
+///
+/// Allocations are valid until `reset()`, which the task loop calls after each `next()`.
+/// Chunks added during one call are merged on reset, so steady state needs no allocation.
+#[derive(Default)]
+pub struct ScratchArena {
+    chunk: Vec<MaybeUninit<Block>>,
+    used: usize,
+    retired: Vec<Vec<MaybeUninit<Block>>>,
+    retired_blocks: usize,
+}
+
+impl ScratchArena {
+    /// Allocate `size` bytes aligned to `SCRATCH_ALIGN`. The memory is not initialized.
+    pub fn alloc(&mut self, size: usize) -> *mut u8 {
+        let blocks = (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN;
+
+        if self.chunk.len() - self.used < blocks || self.chunk.is_empty() {
+            let new_len = blocks
+                .max(self.chunk.len() * 2)
+                .max(MIN_CHUNK_SIZE / SCRATCH_ALIGN);
+            let old = std::mem::replace(&mut self.chunk, new_chunk(new_len));
+            if !old.is_empty() {
+                self.retired_blocks += old.len();
+                self.retired.push(old);
+            }
+            self.used = 0;
+        }
+
+        let p = unsafe { self.chunk.as_mut_ptr().add(self.used) };
+        self.used += blocks;
+        p as *mut u8
+    }
+
+    /// Allocate and touch a chunk of at least `size` bytes.
+    pub fn preallocate(&mut self, size: usize) {
+        let blocks = (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN;
+        if self.chunk.len() < blocks && self.used == 0 {
+            self.chunk = new_chunk(blocks);
+        }
+        unsafe { std::ptr::write_bytes(self.chunk.as_mut_ptr(), 0, self.chunk.len()) };
+    }
+
+    /// Release all allocations.
+    pub fn reset(&mut self) {
+        if !self.retired.is_empty() {
+            let len = self.chunk.len() + self.retired_blocks;
+            self.retired.clear();
+            self.retired_blocks = 0;
+            self.chunk = new_chunk(len);
+        }
+        self.used = 0;
+    }
+}
+
+fn new_chunk(len: usize) -> Vec<MaybeUninit<Block>> {
+    let mut v = Vec::with_capacity(len);
+    v.resize_with(len, MaybeUninit::uninit);
+    v
+}
+
+#[test]
+fn scratch_arena_test() {
+    let mut arena = ScratchArena::default();
+
+    let a = arena.alloc(3);
+    let b = arena.alloc(100);
+    assert_eq!(a as usize % SCRATCH_ALIGN, 0);
+    assert_eq!(b as usize % SCRATCH_ALIGN, 0);
+    assert_eq!(b as usize - a as usize, SCRATCH_ALIGN);
+
+    // Overflow the first chunk, then check that reset merges chunks.
+    let _c = arena.alloc(MIN_CHUNK_SIZE * 3);
+    arena.reset();
+    assert!(arena.chunk.len() * SCRATCH_ALIGN >= MIN_CHUNK_SIZE * 4);
+
+    let capacity = arena.chunk.len() * SCRATCH_ALIGN;
+    let d = arena.alloc(MIN_CHUNK_SIZE * 3);
+    arena.reset();
+    assert_eq!(arena.chunk.len() * SCRATCH_ALIGN, capacity);
+    assert_eq!(arena.alloc(1), d);
+}
@@ -0,0 +1,154 @@
+//! Snapshots of the runtime state in JSON, taken on a signal or a connection to a socket.
+//!
+//! A snapshot has an entry for each configured task with the depths of its receiving ports and
+//! the state of the threads that run it, tracked by the watchdog module. Fused child tasks
+//! have no thread of their own and are shown with the threads of their parent. The memory
+//! usage of channels and metrics follow. Task states are read from atomics updated by the
+//! tasks. Snapshots taken on the signal can also write the task graph with current rates.
+//!
+//! ```sh
+//! socat - UNIX-CONNECT:/run/device-connector.sock
+//! ```
+
+use crate::conf::SnapshotConf;
+use crate::metrics::MetricValue;
+use serde_json::{json, Value};
+use std::io::Write;
+use std::os::unix::net::UnixListener;
+use std::path::{Path, PathBuf};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+/// Track the state of tasks and start waiting for snapshot requests.
+pub(crate) fn enable(conf: &SnapshotConf) {
+    crate::watchdog::track();
+
+    if let Some(signal) = conf.signal {
+        match crate::process::signal_waiter(signal) {
+            Ok(receiver) => {
+                let path = conf.path.clone();
+                let dot_path = conf.dot_path.clone();
+                std::thread::spawn(move || {
+                    while receiver.recv().is_ok() {
+                        write_snapshot(path.as_ref());
+                        if let Some(dot_path) = &dot_path {
+                            write_dot(dot_path);
+                        }
+                    }
+                });
+            }
+            Err(e) => log::error!("cannot wait for signal to take snapshots\n{:?}", e),
+        }
+    }
+
+    if let Some(path) = &conf.socket {
+        // Remove the socket left by a previous run.
+        let _ = std::fs::remove_file(path);
+        match UnixListener::bind(path) {
+            Ok(listener) => {
+                std::thread::spawn(move || {
+                    for stream in listener.incoming() {
+                        let result = stream.and_then(|mut stream| {
+                            let mut json = snapshot().to_string();
+                            json.push('\n');
+                            stream.write_all(json.as_bytes())
+                        });
+                        if let Err(e) = result {
+                            log::warn!("cannot send snapshot\n{}", e);
+                        }
+                    }
+                });
+            }
+            Err(e) => log::error!("cannot listen on {}\n{}", path.display(), e),
+        }
+    }
+}
+
+fn write_snapshot(path: Option<&PathBuf>) {
+    let json = snapshot().to_string();
+    match path {
+        Some(path) => match std::fs::write(path, json + "\n") {
+            Ok(()) => log::info!("wrote snapshot to {}", path.display()),
+            Err(e) => log::error!("cannot write snapshot to {}\n{}", path.display(), e),
+        },
+        None => log::info!("snapshot {}", json),
+    }
+}
+
+fn write_dot(path: &Path) {
+    if let Some(dot) = crate::graph::live_dot() {
+        if let Err(e) = std::fs::write(path, dot) {
+            log::error!("cannot write task graph to {}\n{}", path.display(), e);
+        }
+    }
+}
+
+/// Take a snapshot of the runtime state.
+pub(crate) fn snapshot() -> Value {
+    let time = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map_or(0.0, |d| d.as_secs_f64());
+    let threads = crate::watchdog::tasks();
+    let tasks: Vec<Value> = crate::graph::get()
+        .map_or(&[][..], |graph| &graph.tasks)
+        .iter()
+        .map(|task| {
+            let queues: Vec<Value> = crate::watchdog::queue_depths(task.id)
+                .iter()
+                .map(|depth| json!({ "msgs": depth.msgs, "bytes": depth.bytes }))
+                .collect();
+            let threads: Vec<Value> = threads
+                .iter()
+                .filter(|thread| thread.id == task.thread)
+                .map(|thread| {
+                    json!({
+                        "name": thread.name,
+                        "state": thread.state,
+                        "port": thread.port,
+                        "idle_ms": thread.idle.as_millis() as u64,
+                        "received": thread.received,
+                        "sent": thread.sent,
+                    })
+                })
+                .collect();
+            json!({
+                "task": task.id.0,
+                "element": task.element,
+                // Task whose threads run this task, which differs for fused child tasks.
+                "thread": task.thread.0,
+                "threads": threads,
+                "queues": queues,
+            })
+        })
+        .collect();
+
+    let memory = crate::mem_budget::memory_usage();
+    let metrics: serde_json::Map<String, Value> = crate::metrics::metrics()
+        .into_iter()
+        .map(|(name, value)| {
+            let value = match value {
+                MetricValue::Counter(value) => json!(value),
+                MetricValue::Gauge(value) => json!(value),
+                MetricValue::Histogram(h) => json!({
+                    "count": h.count(),
+                    "mean": h.mean(),
+                    "p50": h.value_at_quantile(0.5),
+                    "p99": h.value_at_quantile(0.99),
+                    "max": h.max(),
+                }),
+            };
+            (name, value)
+        })
+        .collect();
+
+    json!({
+        "time": time,
+        "tasks": tasks,
+        "memory": {
+            "in_flight_bytes": memory.in_flight_bytes,
+            "peak_bytes": memory.peak_bytes,
+            "dropped_msgs": memory.dropped_msgs,
+            "dropped_bytes": memory.dropped_bytes,
+        },
+        "metrics": metrics,
+    })
+}
@@ -1,13 +1,19 @@
+use crate::buf_pool::BufPool;
 use crate::channel::{Channel, MsgReceiverInner};
 use crate::element::*;
 use crate::error::{Error, ReceiveError};
 use crate::finalizer::FinalizerHolder;
 use crate::msg_buf::MsgBufInner;
 use crate::pipeline::PipelineInner;
+use crate::replica::{ReplicaGroup, ReplicaOutput};
+use crate::trace;
+use crate::usdt::probe;
+use crate::watchdog;
 use common::{DcMsgReceiver, DcPipeline, Msg, SendableMsg};
+use crossbeam_channel::Sender;
 use serde_derive::{Deserialize, Serialize};
 use std::sync::atomic::{AtomicBool, Ordering};
-use std::thread::{spawn, JoinHandle};
+use std::thread::{Builder, JoinHandle};
 
 const CHANNEL_NONE_ERR_MSG: &str = "task channel is not set";
 
@@ -44,6 +50,12 @@ pub struct Task {
     element: ElementPreBuild,
     channel: Option<Channel>,
     pipeline: Option<PipelineInner>,
+    cpu_affinity: Vec<usize>,
+    stack_size: Option<usize>,
+    prefault_stack_bytes: Option<usize>,
+    replicas: Option<ReplicaGroup>,
+    /// Output to the merger if this task is a replica.
+    replica_output: Option<Sender<ReplicaOutput>>,
 }
 
 pub(crate) struct ChildTask {
@@ -51,6 +63,8 @@ pub(crate) struct ChildTask {
     next_boxed: ElementNextBoxed,
     pipeline: DcPipeline,
     msg_receiver: DcMsgReceiverWrapped,
+    /// Slot of allocation statistics.
+    alloc_slot: usize,
 }
 
 /// Wrapped DcMsgReceiver for drop.
@@ -77,6 +91,11 @@ impl Task {
             element,
             channel: None,
             pipeline: Some(pipeline),
+            cpu_affinity: Vec::new(),
+            stack_size: None,
+            prefault_stack_bytes: None,
+            replicas: None,
+            replica_output: None,
         }
     }
 
@@ -88,9 +107,50 @@ impl Task {
         self.channel = Some(channel);
     }
 
+    pub(crate) fn take_channel(&mut self) -> Channel {
+        self.channel.take().expect(CHANNEL_NONE_ERR_MSG)
+    }
+
+    /// Run this task with additional instances in `group`.
+    pub(crate) fn set_replicas(&mut self, group: ReplicaGroup) {
+        self.replicas = Some(group);
+    }
+
+    /// Send outputs with the number of received messages to a merger.
+    pub(crate) fn set_replica_output(&mut self, output: Sender<ReplicaOutput>) {
+        self.replica_output = Some(output);
+    }
+
+    /// Pin the task thread to these CPUs.
+    pub fn set_cpu_affinity(&mut self, cpus: Vec<usize>) {
+        self.cpu_affinity = cpus;
+    }
+
+    /// Set stack size of the task thread and bytes of the stack to touch before start.
+    pub fn set_stack(&mut self, stack_size: Option<usize>, prefault_bytes: Option<usize>) {
+        self.stack_size = stack_size;
+        self.prefault_stack_bytes =
+            prefault_bytes.map(|bytes| crate::realtime::clamp_stack_prefault(bytes, stack_size));
+    }
+
+    /// Allocate and touch message buffer and scratch arena memory.
+    pub fn preallocate(&mut self, size: usize) {
+        self.pipeline.as_mut().unwrap().preallocate(size);
+    }
+
+    /// Send messages through buffers of `pool`.
+    pub fn set_buf_pool(&mut self, pool: &'static BufPool) {
+        self.pipeline.as_mut().unwrap().set_buf_pool(pool);
+    }
+
     /// Spawn task under tokio runtime.
     pub fn spawn(mut self, fh: &mut FinalizerHolder) -> Result<JoinHandle<ElementResult>, Error> {
+        if let Some(group) = self.replicas.take() {
+            return crate::replica::spawn(self, group, fh);
+        }
+
         let (sender, receiver) = self.channel.take().expect(CHANNEL_NONE_ERR_MSG).split();
+        let queues = receiver.queue_depths();
         let mut move_value = MoveValue {
             pipeline: self.pipeline.take().unwrap().into_ffi(),
             msg_receiver: DcMsgReceiverWrapped(receiver.into_ffi()),
@@ -104,40 +164,87 @@ impl Task {
         if let Some(finalizer) = finalizer {
             fh.append(finalizer);
         }
+        let cpu_affinity = self.cpu_affinity;
+        let prefault_stack_bytes = self.prefault_stack_bytes;
+        let replica_output = self.replica_output;
 
-        Ok(spawn(move || loop {
-            if CLOSING.load(Ordering::Relaxed) {
-                log::info!("closing task {}", id);
-                return Ok(ElementValue::Close);
-            }
+        let mut builder = Builder::new();
+        if let Some(stack_size) = self.stack_size {
+            builder = builder.stack_size(stack_size);
+        }
 
-            let result = next_boxed(&mut move_value.pipeline, &mut move_value.msg_receiver.0);
+        // Counted before spawning, so the clock cannot advance until the thread starts.
+        let busy = crate::virtual_time::Busy::new();
+        Ok(builder.spawn(move || {
+            let _busy = busy;
+            let _stats = crate::task_stats::register(format!("task {}", id));
+            let _trace = trace::register(format!("task {}", id));
+            let _alloc = crate::alloc_stats::enter(crate::alloc_stats::register(id));
+            let _watchdog = watchdog::register(format!("task {}", id), id, queues);
+            if !cpu_affinity.is_empty() {
+                if let Err(e) = crate::cpu::pin_current_thread(&cpu_affinity) {
+                    log::error!("task {} cannot set CPU affinity\n{}", id, e);
+                }
+            }
+            if let Some(bytes) = prefault_stack_bytes {
+                crate::realtime::prefault_stack(bytes);
+            }
 
-            match result {
-                Ok(ElementValue::Close) => {
-                    log::info!("task {} is closed normally", id);
-                    crate::close::close();
+            loop {
+                if CLOSING.load(Ordering::Relaxed) {
+                    log::info!("closing task {}", id);
                     return Ok(ElementValue::Close);
                 }
-                Ok(ElementValue::MsgBuf) => {
-                    let msg = unsafe {
-                        let pipeline_inner =
-                            &mut *(move_value.pipeline.inner as *mut PipelineInner);
-                        let msg_buf = &mut *(pipeline_inner.msg_buf.inner as *mut MsgBufInner);
-                        // Use cloned message to pass msg between threads safely.
-                        Msg::new(msg_buf.get_msg_cloned())
-                    };
-                    if let Err(e) = sender.send(SendableMsg(msg), 0) {
-                        log::error!("task {} occured sending error\n{}", id, e);
-                    }
+
+                let span = trace::start();
+                probe!(next_entry, id.0);
+                let result = next_boxed(&mut move_value.pipeline, &mut move_value.msg_receiver.0);
+                probe!(next_exit, id.0, next_result_code(&result));
+                watchdog::progress();
+                trace::end(trace::Kind::Next, span, 0);
+                unsafe {
+                    let pipeline_inner = &mut *(move_value.pipeline.inner as *mut PipelineInner);
+                    pipeline_inner.scratch.reset();
                 }
-                Err(e) => {
-                    log::error!("task {} is closed with error\n{}", id, e);
-                    crate::close::close();
-                    return Err(e);
+
+                match result {
+                    Ok(ElementValue::Close) => {
+                        log::info!("task {} is closed normally", id);
+                        crate::close::close();
+                        return Ok(ElementValue::Close);
+                    }
+                    Ok(ElementValue::MsgBuf) => {
+                        crate::alloc_stats::msg_sent();
+                        watchdog::msg_sent();
+                        let msg = unsafe {
+                            let pipeline_inner =
+                                &mut *(move_value.pipeline.inner as *mut PipelineInner);
+                            let msg_buf = &mut *(pipeline_inner.msg_buf.inner as *mut MsgBufInner);
+                            // Use cloned message to pass msg between threads safely.
+                            Msg::new(msg_buf.get_msg_cloned())
+                        };
+                        if let Some(output) = &replica_output {
+                            let received = unsafe {
+                                let msg_receiver = move_value.msg_receiver.0.inner;
+                                (*(msg_receiver as *const MsgReceiverInner)).received()
+                            };
+                            crate::virtual_time::begin();
+                            if let Err(e) = output.send((received, Some(SendableMsg(msg)))) {
+                                crate::virtual_time::end();
+                                log::error!("task {} occured sending error\n{}", id, e);
+                            }
+                        } else if let Err(e) = sender.send(SendableMsg(msg), 0) {
+                            log::error!("task {} occured sending error\n{}", id, e);
+                        }
+                    }
+                    Err(e) => {
+                        log::error!("task {} is closed with error\n{}", id, e);
+                        crate::close::close();
+                        return Err(e);
+                    }
                 }
             }
-        }))
+        })?)
     }
 
     pub(crate) fn child(mut self, fh: &mut FinalizerHolder) -> Result<ChildTask, Error> {
@@ -155,6 +262,7 @@ impl Task {
             pipeline: self.pipeline.unwrap().into_ffi(),
             next_boxed,
             msg_receiver: DcMsgReceiverWrapped(msg_receiver.into_ffi()),
+            alloc_slot: crate::alloc_stats::register(self.id),
         })
     }
 }
@@ -167,7 +275,19 @@ impl ChildTask {
             return Err(ReceiveError);
         }
 
+        let alloc = crate::alloc_stats::enter(self.alloc_slot);
+        probe!(next_entry, self.id.0);
         let result = (self.next_boxed)(&mut self.pipeline, &mut self.msg_receiver.0);
+        probe!(next_exit, self.id.0, next_result_code(&result));
+        watchdog::progress();
+        unsafe {
+            let pipeline_inner = &mut *(self.pipeline.inner as *mut PipelineInner);
+            pipeline_inner.scratch.reset();
+        }
+        if let Ok(ElementValue::MsgBuf) = result {
+            crate::alloc_stats::msg_sent();
+        }
+        drop(alloc);
         match result {
             Ok(ElementValue::Close) => {
                 log::info!("task {} is closed normally", self.id);
@@ -190,6 +310,15 @@ impl ChildTask {
     }
 }
 
+/// Result of `next` given to probes.
+fn next_result_code(result: &ElementResult) -> u64 {
+    match result {
+        Ok(ElementValue::MsgBuf) => 0,
+        Ok(ElementValue::Close) => 1,
+        Err(_) => 2,
+    }
+}
+
 impl std::str::FromStr for TaskPort {
     type Err = crate::error::TaskPortParseError;
 
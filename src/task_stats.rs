@@ -0,0 +1,262 @@
+//! CPU time and scheduling statistics of task threads.
+//!
+//! Task threads only add up the time they are blocked in send and recv. CPU time and context
+//! switches are read from the CPU clock of each thread and procfs while it runs, and sampled
+//! by the thread itself when it exits. Threads with the same name are reported together.
+//! Fused child tasks have no thread of their own and are counted in their parent.
+
+use crate::conf::TaskStatsConf;
+use once_cell::sync::Lazy;
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static START: Lazy<Instant> = Lazy::new(Instant::now);
+static THREADS: Lazy<Mutex<Vec<Arc<ThreadStats>>>> = Lazy::new(Mutex::default);
+
+thread_local! {
+    static CURRENT: RefCell<Option<Arc<ThreadStats>>> = RefCell::new(None);
+}
+
+struct ThreadStats {
+    name: String,
+    tid: libc::pid_t,
+    cpu_clock: libc::clockid_t,
+    send_blocked_ns: AtomicU64,
+    recv_blocked_ns: AtomicU64,
+    /// Sample taken by the thread when it exited.
+    exited: Mutex<Option<Sample>>,
+}
+
+#[derive(Clone, Copy, Default)]
+struct Sample {
+    threads: usize,
+    cpu_ns: u64,
+    voluntary_switches: u64,
+    involuntary_switches: u64,
+    send_blocked_ns: u64,
+    recv_blocked_ns: u64,
+}
+
+/// Start collecting statistics of threads registered after this.
+pub(crate) fn enable(conf: &TaskStatsConf) {
+    Lazy::force(&START);
+    ENABLED.store(true, Ordering::SeqCst);
+
+    if let Some(interval_ms) = conf.interval_ms.filter(|&ms| ms > 0) {
+        let interval = Duration::from_millis(interval_ms);
+        std::thread::spawn(move || {
+            let mut last = HashMap::new();
+            let mut last_time = Instant::now();
+            loop {
+                std::thread::sleep(interval);
+                // Sleeping can take longer than the interval.
+                let now = Instant::now();
+                let samples = sample_all();
+                log_samples("in last interval", &samples, &last, now - last_time);
+                last_time = now;
+                crate::metrics::log_metrics();
+                crate::alloc_stats::log_stats();
+                last = samples.into_iter().collect();
+            }
+        });
+    }
+}
+
+/// Log statistics since start.
+pub(crate) fn log_summary() {
+    if ENABLED.load(Ordering::Relaxed) {
+        log_samples("in total", &sample_all(), &HashMap::new(), START.elapsed());
+    }
+}
+
+/// Counts the current thread in statistics under `name` until dropped.
+pub(crate) struct Registration(Arc<ThreadStats>);
+
+pub(crate) fn register(name: String) -> Option<Registration> {
+    if !ENABLED.load(Ordering::Relaxed) {
+        return None;
+    }
+
+    let mut cpu_clock = 0;
+    if unsafe { libc::pthread_getcpuclockid(libc::pthread_self(), &mut cpu_clock) } != 0 {
+        log::warn!("cannot get CPU clock of {}", name);
+        return None;
+    }
+    let stats = Arc::new(ThreadStats {
+        name,
+        tid: unsafe { libc::syscall(libc::SYS_gettid) } as libc::pid_t,
+        cpu_clock,
+        send_blocked_ns: AtomicU64::new(0),
+        recv_blocked_ns: AtomicU64::new(0),
+        exited: Mutex::new(None),
+    });
+    THREADS.lock().unwrap().push(stats.clone());
+    CURRENT.with(|current| *current.borrow_mut() = Some(stats.clone()));
+    Some(Registration(stats))
+}
+
+impl Drop for Registration {
+    fn drop(&mut self) {
+        CURRENT.with(|current| current.borrow_mut().take());
+
+        let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+        unsafe { libc::getrusage(libc::RUSAGE_THREAD, &mut usage) };
+        let sample = Sample {
+            threads: 1,
+            cpu_ns: cpu_time_ns(libc::CLOCK_THREAD_CPUTIME_ID).unwrap_or(0),
+            voluntary_switches: usage.ru_nvcsw as u64,
+            involuntary_switches: usage.ru_nivcsw as u64,
+            ..self.0.blocked()
+        };
+        *self.0.exited.lock().unwrap() = Some(sample);
+    }
+}
+
+/// Measures time blocked in send or recv of the current thread until dropped.
+pub(crate) struct Blocked {
+    start: Option<Instant>,
+    send: bool,
+}
+
+impl Blocked {
+    pub fn send() -> Self {
+        Blocked::new(true)
+    }
+
+    pub fn recv() -> Self {
+        Blocked::new(false)
+    }
+
+    fn new(send: bool) -> Self {
+        let start = ENABLED.load(Ordering::Relaxed).then(Instant::now);
+        Blocked { start, send }
+    }
+}
+
+impl Drop for Blocked {
+    fn drop(&mut self) {
+        let start = match self.start {
+            Some(start) => start,
+            None => return,
+        };
+        let ns = start.elapsed().as_nanos() as u64;
+        CURRENT.with(|current| {
+            if let Some(stats) = &*current.borrow() {
+                let counter = if self.send {
+                    &stats.send_blocked_ns
+                } else {
+                    &stats.recv_blocked_ns
+                };
+                counter.fetch_add(ns, Ordering::Relaxed);
+            }
+        });
+    }
+}
+
+impl ThreadStats {
+    fn blocked(&self) -> Sample {
+        Sample {
+            send_blocked_ns: self.send_blocked_ns.load(Ordering::Relaxed),
+            recv_blocked_ns: self.recv_blocked_ns.load(Ordering::Relaxed),
+            ..Default::default()
+        }
+    }
+
+    fn sample(&self) -> Sample {
+        // The thread waits for this lock to store its last sample, so it is still alive.
+        let exited = self.exited.lock().unwrap();
+        if let Some(sample) = *exited {
+            return sample;
+        }
+
+        let (voluntary_switches, involuntary_switches) = context_switches(self.tid);
+        Sample {
+            threads: 1,
+            cpu_ns: cpu_time_ns(self.cpu_clock).unwrap_or(0),
+            voluntary_switches,
+            involuntary_switches,
+            ..self.blocked()
+        }
+    }
+}
+
+/// Sample threads, summed by name in the order of registration.
+fn sample_all() -> Vec<(String, Sample)> {
+    let threads = THREADS.lock().unwrap().clone();
+    let mut samples: Vec<(String, Sample)> = Vec::new();
+    for thread in threads {
+        let sample = thread.sample();
+        let sum = match samples.iter_mut().find(|(name, _)| *name == thread.name) {
+            Some((_, sum)) => sum,
+            None => {
+                samples.push((thread.name.clone(), Sample::default()));
+                &mut samples.last_mut().unwrap().1
+            }
+        };
+        sum.threads += sample.threads;
+        sum.cpu_ns += sample.cpu_ns;
+        sum.voluntary_switches += sample.voluntary_switches;
+        sum.involuntary_switches += sample.involuntary_switches;
+        sum.send_blocked_ns += sample.send_blocked_ns;
+        sum.recv_blocked_ns += sample.recv_blocked_ns;
+    }
+    samples
+}
+
+fn log_samples(
+    period: &str,
+    samples: &[(String, Sample)],
+    last: &HashMap<String, Sample>,
+    elapsed: Duration,
+) {
+    let elapsed_ns = elapsed.as_nanos().max(1) as f64;
+    let percent = |ns: u64| ns as f64 * 100.0 / elapsed_ns;
+    for (name, sample) in samples {
+        let last = last.get(name).copied().unwrap_or_default();
+        let threads = if sample.threads > 1 {
+            format!(" ({} threads)", sample.threads)
+        } else {
+            String::new()
+        };
+        log::info!(
+            "{}{} {}: cpu {:.1}%, blocked in recv {:.1}%, in send {:.1}%, context switches {} voluntary, {} involuntary",
+            name,
+            threads,
+            period,
+            percent(sample.cpu_ns.saturating_sub(last.cpu_ns)),
+            percent(sample.recv_blocked_ns.saturating_sub(last.recv_blocked_ns)),
+            percent(sample.send_blocked_ns.saturating_sub(last.send_blocked_ns)),
+            sample.voluntary_switches.saturating_sub(last.voluntary_switches),
+            sample.involuntary_switches.saturating_sub(last.involuntary_switches),
+        );
+    }
+}
+
+fn cpu_time_ns(clock: libc::clockid_t) -> Option<u64> {
+    let mut ts: libc::timespec = unsafe { std::mem::zeroed() };
+    if unsafe { libc::clock_gettime(clock, &mut ts) } != 0 {
+        return None;
+    }
+    Some(ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64)
+}
+
+/// Read voluntary and involuntary context switches of a thread of this process.
+fn context_switches(tid: libc::pid_t) -> (u64, u64) {
+    let status = std::fs::read_to_string(format!("/proc/self/task/{}/status", tid));
+    let status = status.unwrap_or_default();
+    let field = |key: &str| {
+        status
+            .lines()
+            .find_map(|line| line.strip_prefix(key))
+            .and_then(|value| value.trim().parse().ok())
+            .unwrap_or(0)
+    };
+    (
+        field("voluntary_ctxt_switches:"),
+        field("nonvoluntary_ctxt_switches:"),
+    )
+}
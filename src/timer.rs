@@ -0,0 +1,384 @@
+//! Timer service shared by all tasks.
+//!
+//! One thread keeps timers in a hierarchical timer wheel and sleeps on a timerfd armed to the
+//! next expiration. Tasks read expiration counts from atomics, so no clock is read per message.
+//! With the virtual clock, the thread instead advances the clock when all tasks are idle.
+
+use crossbeam_channel::{unbounded, Receiver, Sender};
+use once_cell::sync::Lazy;
+use std::io;
+use std::os::unix::io::RawFd;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::Duration;
+
+/// Resolution of the wheel.
+const TICK_NS: u64 = 100_000;
+const SLOT_BITS: u32 = 6;
+const SLOTS: usize = 1 << SLOT_BITS;
+const LEVELS: usize = 6;
+/// Timers further than this are clamped. About 80 days.
+const MAX_TICKS: u64 = (1 << (SLOT_BITS * LEVELS as u32)) - 1;
+
+static SERVICE: Lazy<TimerService> = Lazy::new(|| {
+    TimerService::start().unwrap_or_else(|e| panic!("cannot start timer service: {}", e))
+});
+
+/// Timer registered by a task. The timer is cancelled when dropped.
+pub(crate) struct Timer {
+    state: Arc<TimerState>,
+}
+
+#[derive(Default)]
+struct TimerState {
+    expirations: AtomicU64,
+    cancelled: AtomicBool,
+    /// A one-shot timer expired and will not fire again.
+    finished: AtomicBool,
+    waiter: Mutex<WaiterState>,
+    fired: Condvar,
+}
+
+#[derive(Default)]
+struct WaiterState {
+    waiting: bool,
+    /// An expiration woke the waiter and is counted as virtual time work.
+    woken: bool,
+}
+
+impl Timer {
+    /// Start a timer that expires after `interval`, and then every `interval` if `periodic`.
+    pub fn new(interval: Duration, periodic: bool) -> Self {
+        let state = Arc::new(TimerState::default());
+        let interval_ns = interval.as_nanos().min(u64::MAX as u128) as u64;
+        let entry = Entry {
+            when_ns: crate::clock::monotonic_ns().saturating_add(interval_ns),
+            period_ns: if periodic { interval_ns.max(1) } else { 0 },
+            state: state.clone(),
+        };
+        SERVICE.register(entry);
+        Timer { state }
+    }
+
+    /// Take the number of expirations since the last call.
+    pub fn expired(&self) -> u64 {
+        if self.state.expirations.load(Ordering::Relaxed) == 0 {
+            return 0;
+        }
+        self.state.expirations.swap(0, Ordering::Acquire)
+    }
+
+    /// Wait for an expiration and take the number of expirations since the last call.
+    /// Returns 0 for a one-shot timer whose expiration was already taken.
+    pub fn wait(&self) -> u64 {
+        let mut waiter = self.state.waiter.lock().unwrap();
+        let mut idle = None;
+        loop {
+            let expirations = self.expired();
+            if expirations > 0 {
+                waiter.waiting = false;
+                drop(idle);
+                if std::mem::take(&mut waiter.woken) {
+                    crate::virtual_time::end();
+                }
+                return expirations;
+            }
+            if self.state.finished.load(Ordering::Relaxed) {
+                return 0;
+            }
+            waiter.waiting = true;
+            idle.get_or_insert_with(crate::virtual_time::Idle::new);
+            waiter = self.state.fired.wait(waiter).unwrap();
+        }
+    }
+}
+
+impl Drop for Timer {
+    fn drop(&mut self) {
+        self.state.cancelled.store(true, Ordering::Relaxed);
+    }
+}
+
+impl TimerState {
+    fn fire(&self, expirations: u64, last: bool) {
+        let mut waiter = self.waiter.lock().unwrap();
+        self.expirations.fetch_add(expirations, Ordering::Release);
+        if last {
+            self.finished.store(true, Ordering::Relaxed);
+        }
+        if waiter.waiting && !waiter.woken {
+            waiter.woken = true;
+            crate::virtual_time::begin();
+        }
+        self.fired.notify_all();
+    }
+}
+
+struct Entry {
+    when_ns: u64,
+    /// Zero for one-shot timers.
+    period_ns: u64,
+    state: Arc<TimerState>,
+}
+
+struct TimerService {
+    sender: Sender<Entry>,
+    event_fd: RawFd,
+}
+
+impl TimerService {
+    fn start() -> io::Result<Self> {
+        let timer_fd = cvt(unsafe {
+            libc::timerfd_create(
+                libc::CLOCK_MONOTONIC,
+                libc::TFD_CLOEXEC | libc::TFD_NONBLOCK,
+            )
+        })?;
+        let event_fd = cvt(unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) })?;
+        let (sender, receiver) = unbounded();
+
+        std::thread::Builder::new()
+            .name("dc-timer".into())
+            .spawn(move || run(timer_fd, event_fd, receiver))?;
+
+        Ok(TimerService { sender, event_fd })
+    }
+
+    fn register(&self, entry: Entry) {
+        if self.sender.send(entry).is_ok() {
+            self.wake();
+        }
+    }
+
+    fn wake(&self) {
+        let one: u64 = 1;
+        unsafe { libc::write(self.event_fd, &one as *const u64 as *const _, 8) };
+    }
+}
+
+/// Let the service check whether the virtual clock can advance.
+pub(crate) fn wake() {
+    SERVICE.wake();
+}
+
+fn run(timer_fd: RawFd, event_fd: RawFd, receiver: Receiver<Entry>) {
+    let mut wheel = Wheel::new(crate::clock::monotonic_ns() / TICK_NS);
+    let mut fds = [
+        libc::pollfd {
+            fd: timer_fd,
+            events: libc::POLLIN,
+            revents: 0,
+        },
+        libc::pollfd {
+            fd: event_fd,
+            events: libc::POLLIN,
+            revents: 0,
+        },
+    ];
+
+    loop {
+        let now = crate::clock::monotonic_ns();
+        for entry in receiver.try_iter() {
+            wheel.schedule(entry, now);
+        }
+        wheel.advance(now);
+        let next = wheel.next_expiration().map(|(_, _, tick)| tick * TICK_NS);
+
+        let deadline = if crate::virtual_time::enabled() {
+            // Idle tasks cannot register timers, so the queue is complete once it is empty.
+            if crate::virtual_time::idle() {
+                if !receiver.is_empty() {
+                    continue;
+                }
+                if let Some(next) = next {
+                    crate::virtual_time::advance_to(next);
+                    continue;
+                }
+            }
+            0
+        } else {
+            next.unwrap_or(0)
+        };
+        let spec = libc::itimerspec {
+            it_interval: timespec(0),
+            // Zero disarms the timer.
+            it_value: timespec(deadline),
+        };
+        unsafe {
+            libc::timerfd_settime(
+                timer_fd,
+                libc::TFD_TIMER_ABSTIME,
+                &spec,
+                std::ptr::null_mut(),
+            );
+            libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, -1);
+        }
+        for fd in &mut fds {
+            let mut buf = 0u64;
+            if fd.revents != 0 {
+                unsafe { libc::read(fd.fd, &mut buf as *mut u64 as *mut _, 8) };
+            }
+            fd.revents = 0;
+        }
+    }
+}
+
+/// Hierarchical timer wheel. Level `n` has slots of `SLOTS^n` ticks.
+struct Wheel {
+    /// Ticks processed so far.
+    elapsed: u64,
+    slots: Vec<Vec<Vec<Entry>>>,
+    occupied: [u64; LEVELS],
+}
+
+impl Wheel {
+    fn new(elapsed: u64) -> Self {
+        Wheel {
+            elapsed,
+            slots: (0..LEVELS)
+                .map(|_| (0..SLOTS).map(|_| Vec::new()).collect())
+                .collect(),
+            occupied: [0; LEVELS],
+        }
+    }
+
+    /// Fire `entry` if it is due at `now_ns`, and put it on the wheel if it expires later.
+    fn schedule(&mut self, mut entry: Entry, now_ns: u64) {
+        if entry.state.cancelled.load(Ordering::Relaxed) {
+            return;
+        }
+
+        let when = ticks_ceil(entry.when_ns);
+        if when <= self.elapsed {
+            if entry.period_ns == 0 {
+                entry.state.fire(1, true);
+                return;
+            }
+            let expirations = now_ns.saturating_sub(entry.when_ns) / entry.period_ns + 1;
+            entry.state.fire(expirations, false);
+            entry.when_ns = entry
+                .when_ns
+                .saturating_add(expirations.saturating_mul(entry.period_ns));
+            return self.schedule(entry, now_ns);
+        }
+
+        let when = when.min(self.elapsed + MAX_TICKS);
+        let level = level_for(self.elapsed, when);
+        let slot = slot_for(when, level);
+        self.slots[level][slot].push(entry);
+        self.occupied[level] |= 1 << slot;
+    }
+
+    /// Process all slots due at `now_ns`.
+    fn advance(&mut self, now_ns: u64) {
+        let now = now_ns / TICK_NS;
+        while let Some((level, slot, tick)) = self.next_expiration() {
+            if tick > now {
+                break;
+            }
+            self.elapsed = tick;
+            self.occupied[level] &= !(1 << slot);
+            for entry in std::mem::take(&mut self.slots[level][slot]) {
+                self.schedule(entry, now_ns);
+            }
+        }
+        self.elapsed = self.elapsed.max(now);
+    }
+
+    /// Get the earliest occupied slot and the tick it starts at.
+    fn next_expiration(&self) -> Option<(usize, usize, u64)> {
+        (0..LEVELS).find_map(|level| {
+            let occupied = self.occupied[level];
+            if occupied == 0 {
+                return None;
+            }
+            let slot_ticks = 1u64 << (SLOT_BITS * level as u32);
+            let level_ticks = slot_ticks << SLOT_BITS;
+            let current = slot_for(self.elapsed, level);
+            let slot =
+                (occupied.rotate_right(current as u32).trailing_zeros() as usize + current) % SLOTS;
+            let mut tick = (self.elapsed & !(level_ticks - 1)) + slot as u64 * slot_ticks;
+            if slot < current {
+                tick += level_ticks;
+            }
+            Some((level, slot, tick.max(self.elapsed)))
+        })
+    }
+}
+
+fn level_for(elapsed: u64, when: u64) -> usize {
+    let significant = ((elapsed ^ when) | (SLOTS as u64 - 1)).min(MAX_TICKS);
+    ((63 - significant.leading_zeros()) / SLOT_BITS) as usize
+}
+
+fn slot_for(tick: u64, level: usize) -> usize {
+    ((tick >> (SLOT_BITS * level as u32)) as usize) & (SLOTS - 1)
+}
+
+fn ticks_ceil(ns: u64) -> u64 {
+    ns / TICK_NS + (ns % TICK_NS != 0) as u64
+}
+
+fn timespec(ns: u64) -> libc::timespec {
+    libc::timespec {
+        tv_sec: (ns / 1_000_000_000) as libc::time_t,
+        tv_nsec: (ns % 1_000_000_000) as libc::c_long,
+    }
+}
+
+fn cvt(ret: libc::c_int) -> io::Result<libc::c_int> {
+    if ret < 0 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(ret)
+    }
+}
+
+#[test]
+fn wheel_test() {
+    let entry = |when_ticks: u64, period_ticks: u64| {
+        let state = Arc::new(TimerState::default());
+        let entry = Entry {
+            when_ns: when_ticks * TICK_NS,
+            period_ns: period_ticks * TICK_NS,
+            state: state.clone(),
+        };
+        (entry, state)
+    };
+    let mut wheel = Wheel::new(0);
+
+    // Timers on higher levels cascade down and fire on their tick.
+    let (near, near_state) = entry(70, 0);
+    let (far, far_state) = entry(5000, 0);
+    wheel.schedule(near, 0);
+    wheel.schedule(far, 0);
+    wheel.advance(69 * TICK_NS);
+    assert_eq!(near_state.expirations.load(Ordering::Relaxed), 0);
+    wheel.advance(70 * TICK_NS);
+    assert_eq!(near_state.expirations.load(Ordering::Relaxed), 1);
+    assert!(near_state.finished.load(Ordering::Relaxed));
+    wheel.advance(4999 * TICK_NS);
+    assert_eq!(far_state.expirations.load(Ordering::Relaxed), 0);
+    wheel.advance(5000 * TICK_NS);
+    assert_eq!(far_state.expirations.load(Ordering::Relaxed), 1);
+    assert_eq!(wheel.next_expiration().map(|(_, _, tick)| tick), None);
+
+    // Periodic timers are put back on the wheel and count missed expirations.
+    let (periodic, periodic_state) = entry(5010, 10);
+    wheel.schedule(periodic, 5000 * TICK_NS);
+    wheel.advance(5035 * TICK_NS);
+    assert_eq!(periodic_state.expirations.swap(0, Ordering::Relaxed), 3);
+    wheel.advance(5040 * TICK_NS);
+    assert_eq!(periodic_state.expirations.swap(0, Ordering::Relaxed), 1);
+    assert!(!periodic_state.finished.load(Ordering::Relaxed));
+
+    // Cancelled timers are removed on their next tick.
+    periodic_state.cancelled.store(true, Ordering::Relaxed);
+    wheel.advance(5100 * TICK_NS);
+    assert_eq!(periodic_state.expirations.load(Ordering::Relaxed), 0);
+    assert_eq!(wheel.next_expiration().map(|(_, _, tick)| tick), None);
+
+    let timer = Timer::new(Duration::from_millis(1), false);
+    assert_eq!(timer.wait(), 1);
+    assert_eq!(timer.wait(), 0);
+}
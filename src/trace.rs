@@ -0,0 +1,379 @@
+//! Timeline of task execution in the Chrome trace event format, viewable in Perfetto.
+//!
+//! Each thread records events into its own ring buffer, overwriting the oldest ones.
+//! Only the owning thread writes a ring, and readers skip slots being overwritten, so
+//! recording takes no lock. Messages are identified by a sequence number stamped by their
+//! sender, to link senders and receivers.
+
+use crate::conf::TraceConf;
+use once_cell::sync::{Lazy, OnceCell};
+use std::cell::RefCell;
+use std::fmt::Write as _;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Instant;
+
+const DEFAULT_EVENTS_PER_THREAD: usize = 1 << 16;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static EPOCH: Lazy<Instant> = Lazy::new(Instant::now);
+static CONF: OnceCell<(PathBuf, usize)> = OnceCell::new();
+static RINGS: Lazy<Mutex<Vec<Arc<Ring>>>> = Lazy::new(Mutex::default);
+static SENDERS: AtomicU64 = AtomicU64::new(1);
+
+thread_local! {
+    static CURRENT: RefCell<Option<Arc<Ring>>> = RefCell::new(None);
+}
+
+/// Kinds of recorded events.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+#[repr(u64)]
+pub(crate) enum Kind {
+    /// A call of `next` of an element.
+    Next = 1,
+    /// Sending a message to an edge.
+    Send = 2,
+    /// Waiting for a full queue while sending.
+    SendWait = 3,
+    /// Waiting for an empty queue while receiving.
+    RecvWait = 4,
+    /// Taking a message from a queue.
+    Recv = 5,
+}
+
+impl Kind {
+    fn from_u64(v: u64) -> Option<Kind> {
+        Some(match v {
+            1 => Kind::Next,
+            2 => Kind::Send,
+            3 => Kind::SendWait,
+            4 => Kind::RecvWait,
+            5 => Kind::Recv,
+            _ => return None,
+        })
+    }
+
+    fn name(self) -> &'static str {
+        match self {
+            Kind::Next => "next",
+            Kind::Send => "send",
+            Kind::SendWait => "send wait",
+            Kind::RecvWait => "recv wait",
+            Kind::Recv => "recv",
+        }
+    }
+}
+
+struct Ring {
+    name: String,
+    tid: u64,
+    slots: Vec<Slot>,
+    /// The number of events recorded so far.
+    head: AtomicU64,
+}
+
+/// Recorded event. `seq` is odd while the slot is written, and the event number otherwise.
+#[derive(Default)]
+struct Slot {
+    seq: AtomicU64,
+    kind: AtomicU64,
+    start_ns: AtomicU64,
+    dur_ns: AtomicU64,
+    msg_id: AtomicU64,
+}
+
+struct Event {
+    kind: Kind,
+    start_ns: u64,
+    dur_ns: u64,
+    msg_id: u64,
+}
+
+/// Start recording events of threads registered after this.
+pub(crate) fn enable(conf: &TraceConf) {
+    let events = conf
+        .events_per_thread
+        .unwrap_or(DEFAULT_EVENTS_PER_THREAD)
+        .max(1);
+    if CONF.set((conf.path.clone(), events)).is_err() {
+        return;
+    }
+    Lazy::force(&EPOCH);
+    ENABLED.store(true, Ordering::SeqCst);
+
+    if let Some(signal) = conf.dump_signal {
+        match crate::process::signal_waiter(signal) {
+            Ok(receiver) => {
+                std::thread::spawn(move || {
+                    while receiver.recv().is_ok() {
+                        dump();
+                    }
+                });
+            }
+            Err(e) => log::error!("cannot wait for signal to dump trace\n{:?}", e),
+        }
+    }
+}
+
+#[inline]
+pub(crate) fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// Record events of the current thread under `name` until dropped.
+pub(crate) struct Registration(());
+
+pub(crate) fn register(name: String) -> Option<Registration> {
+    let events = CONF.get().filter(|_| enabled())?.1;
+    let ring = Arc::new(Ring {
+        name,
+        tid: unsafe { libc::syscall(libc::SYS_gettid) } as u64,
+        slots: (0..events).map(|_| Slot::default()).collect(),
+        head: AtomicU64::new(0),
+    });
+    RINGS.lock().unwrap().push(ring.clone());
+    CURRENT.with(|current| *current.borrow_mut() = Some(ring));
+    Some(Registration(()))
+}
+
+impl Drop for Registration {
+    fn drop(&mut self) {
+        CURRENT.with(|current| current.borrow_mut().take());
+    }
+}
+
+/// Get the start time of a span, or `None` if tracing is disabled.
+#[inline]
+pub(crate) fn start() -> Option<u64> {
+    if enabled() {
+        Some(now_ns())
+    } else {
+        None
+    }
+}
+
+/// Record a span from `start` to now.
+#[inline]
+pub(crate) fn end(kind: Kind, start: Option<u64>, msg_id: u64) {
+    if let Some(start) = start {
+        record(kind, start, now_ns().saturating_sub(start), msg_id);
+    }
+}
+
+/// Record an instant event.
+#[inline]
+pub(crate) fn instant(kind: Kind, msg_id: u64) {
+    if enabled() {
+        record(kind, now_ns(), 0, msg_id);
+    }
+}
+
+/// Records a span until dropped.
+pub(crate) struct Span {
+    kind: Kind,
+    start: Option<u64>,
+}
+
+impl Span {
+    #[inline]
+    pub fn new(kind: Kind) -> Self {
+        Span {
+            kind,
+            start: start(),
+        }
+    }
+}
+
+impl Drop for Span {
+    #[inline]
+    fn drop(&mut self) {
+        end(self.kind, self.start, 0);
+    }
+}
+
+/// Ids of messages from one sender. The sender is in the upper bits and a sequence number
+/// in the lower 32 bits, which wraps long after the events of the message are overwritten.
+pub(crate) struct FlowIds {
+    sender: u64,
+    seq: AtomicU64,
+}
+
+impl Default for FlowIds {
+    fn default() -> Self {
+        FlowIds {
+            sender: SENDERS.fetch_add(1, Ordering::Relaxed),
+            seq: AtomicU64::new(0),
+        }
+    }
+}
+
+impl FlowIds {
+    /// Get the id of the next message, or 0 if tracing is disabled.
+    #[inline]
+    pub fn next(&self) -> u64 {
+        if !enabled() {
+            return 0;
+        }
+        let seq = self.seq.fetch_add(1, Ordering::Relaxed) & 0xffff_ffff;
+        self.sender << 32 | seq
+    }
+}
+
+fn now_ns() -> u64 {
+    EPOCH.elapsed().as_nanos() as u64
+}
+
+fn record(kind: Kind, start_ns: u64, dur_ns: u64, msg_id: u64) {
+    CURRENT.with(|current| {
+        if let Some(ring) = &*current.borrow() {
+            ring.push(kind, start_ns, dur_ns, msg_id);
+        }
+    });
+}
+
+impl Ring {
+    fn push(&self, kind: Kind, start_ns: u64, dur_ns: u64, msg_id: u64) {
+        let n = self.head.load(Ordering::Relaxed);
+        let slot = &self.slots[(n % self.slots.len() as u64) as usize];
+        slot.seq.store(n * 2 + 1, Ordering::Relaxed);
+        std::sync::atomic::fence(Ordering::Release);
+        slot.kind.store(kind as u64, Ordering::Relaxed);
+        slot.start_ns.store(start_ns, Ordering::Relaxed);
+        slot.dur_ns.store(dur_ns, Ordering::Relaxed);
+        slot.msg_id.store(msg_id, Ordering::Relaxed);
+        slot.seq.store(n * 2 + 2, Ordering::Release);
+        self.head.store(n + 1, Ordering::Release);
+    }
+
+    /// Copy events that are not overwritten while reading, oldest first.
+    fn events(&self) -> Vec<Event> {
+        let head = self.head.load(Ordering::Acquire);
+        let first = head.saturating_sub(self.slots.len() as u64);
+        let mut events = Vec::with_capacity((head - first) as usize);
+        for n in first..head {
+            let slot = &self.slots[(n % self.slots.len() as u64) as usize];
+            if slot.seq.load(Ordering::Acquire) != n * 2 + 2 {
+                continue;
+            }
+            let kind = slot.kind.load(Ordering::Relaxed);
+            let start_ns = slot.start_ns.load(Ordering::Relaxed);
+            let dur_ns = slot.dur_ns.load(Ordering::Relaxed);
+            let msg_id = slot.msg_id.load(Ordering::Relaxed);
+            std::sync::atomic::fence(Ordering::Acquire);
+            if slot.seq.load(Ordering::Relaxed) != n * 2 + 2 {
+                continue;
+            }
+            if let Some(kind) = Kind::from_u64(kind) {
+                events.push(Event {
+                    kind,
+                    start_ns,
+                    dur_ns,
+                    msg_id,
+                });
+            }
+        }
+        events
+    }
+}
+
+/// Write recorded events to the configured file.
+pub(crate) fn dump() {
+    let path = match CONF.get().filter(|_| enabled()) {
+        Some((path, _)) => path,
+        None => return,
+    };
+    let rings = RINGS.lock().unwrap().clone();
+    let pid = std::process::id();
+
+    let mut out = String::from("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    let mut first = true;
+    let mut sep = |out: &mut String| {
+        if !std::mem::take(&mut first) {
+            out.push_str(",\n");
+        }
+    };
+    for ring in &rings {
+        sep(&mut out);
+        let _ = write!(
+            out,
+            "{{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":{},\"tid\":{},\"args\":{{\"name\":{:?}}}}}",
+            pid, ring.tid, ring.name
+        );
+        for event in ring.events() {
+            let ts = event.start_ns as f64 / 1000.0;
+            sep(&mut out);
+            match event.kind {
+                Kind::Recv => {
+                    // End of the flow from the sender, bound to the enclosing `next`.
+                    let _ = write!(
+                        out,
+                        "{{\"ph\":\"f\",\"bp\":\"e\",\"name\":\"msg\",\"cat\":\"msg\",\"id\":{},\"pid\":{},\"tid\":{},\"ts\":{:.3}}}",
+                        event.msg_id, pid, ring.tid, ts
+                    );
+                }
+                kind => {
+                    let _ = write!(
+                        out,
+                        "{{\"ph\":\"X\",\"name\":\"{}\",\"cat\":\"task\",\"pid\":{},\"tid\":{},\"ts\":{:.3},\"dur\":{:.3}}}",
+                        kind.name(),
+                        pid,
+                        ring.tid,
+                        ts,
+                        event.dur_ns as f64 / 1000.0
+                    );
+                    if kind == Kind::Send {
+                        sep(&mut out);
+                        let _ = write!(
+                            out,
+                            "{{\"ph\":\"s\",\"name\":\"msg\",\"cat\":\"msg\",\"id\":{},\"pid\":{},\"tid\":{},\"ts\":{:.3}}}",
+                            event.msg_id, pid, ring.tid, ts
+                        );
+                    }
+                }
+            }
+        }
+    }
+    out.push_str("\n]}\n");
+
+    match std::fs::write(path, out) {
+        Ok(()) => log::info!("trace is written to \"{}\"", path.display()),
+        Err(e) => log::error!("cannot write trace to \"{}\"\n{}", path.display(), e),
+    }
+}
+
+#[test]
+fn ring_wraparound_test() {
+    let ring = Ring {
+        name: "test".to_owned(),
+        tid: 0,
+        slots: (0..4).map(|_| Slot::default()).collect(),
+        head: AtomicU64::new(0),
+    };
+    assert!(ring.events().is_empty());
+
+    for i in 0..3 {
+        ring.push(Kind::Send, i, 1, 100 + i);
+    }
+    let events = ring.events();
+    assert_eq!(events.len(), 3);
+    assert_eq!(events[0].msg_id, 100);
+
+    // The oldest events are overwritten and the rest are returned oldest first.
+    for i in 3..10 {
+        ring.push(
+            if i % 2 == 0 { Kind::Send } else { Kind::Recv },
+            i,
+            1,
+            100 + i,
+        );
+    }
+    let events = ring.events();
+    assert_eq!(events.len(), 4);
+    for (event, i) in events.iter().zip(6..) {
+        assert_eq!(event.kind, if i % 2 == 0 { Kind::Send } else { Kind::Recv });
+        assert_eq!(event.start_ns, i);
+        assert_eq!(event.dur_ns, 1);
+        assert_eq!(event.msg_id, 100 + i);
+    }
+}
@@ -20,10 +20,12 @@ struct TypeCheckerInner {
 
 impl TypeChecker {
     pub fn check(&self, from: TaskId, msg_type: MsgType, port: Port) -> Result<(), TypeCheckError> {
-        log::info!("task {} emits {}", from, msg_type);
-
         let tc = &*self.0;
         let taskport = TaskPort(from, port);
+        // Elements may check for each message, so only log changes.
+        if tc.checked.read().unwrap().get(&taskport) != Some(&msg_type) {
+            log::info!("task {} emits {}", from, msg_type);
+        }
         let dest = &tc.dest[&taskport];
 
         for dest_port in dest {
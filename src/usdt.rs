@@ -0,0 +1,99 @@
+//! USDT probes to attach bpftrace or perf to a running process.
+//!
+//! A probe is a `nop` described by an ELF note in the format of `sys/sdt.h` of SystemTap, so
+//! it costs only the `nop` and loading its arguments until a tracer is attached. All probes
+//! belong to the provider `device_connector` and take unsigned 64-bit arguments.
+//!
+//! ```sh
+//! bpftrace -e 'usdt:/usr/bin/device-connector:device_connector:send { @[arg0] = hist(arg1); }'
+//! ```
+//!
+//! | Probe              | Arguments                       |
+//! |--------------------|---------------------------------|
+//! | `next_entry`       | task id                         |
+//! | `next_exit`        | task id, result (0: msg buf, 1: close, 2: error) |
+//! | `send`             | sending port, size              |
+//! | `recv`             | receiving port, size            |
+//! | `send_blocked`     | size                            |
+//! | `send_unblocked`   | size                            |
+//! | `drop`             | size                            |
+//! | `finalizer_entry`  | index                           |
+//! | `finalizer_exit`   | index, result (0: ok, 1: error) |
+//!
+//! Probes are only emitted on Linux for x86_64 and aarch64, and do nothing elsewhere.
+
+/// Fire the probe `$name` with up to 3 arguments converted to `u64`.
+#[cfg(all(
+    target_os = "linux",
+    any(target_arch = "x86_64", target_arch = "aarch64")
+))]
+macro_rules! probe {
+    ($name:ident) => {
+        $crate::usdt::probe!(@asm $name, "",)
+    };
+    ($name:ident, $a0:expr) => {
+        $crate::usdt::probe!(@asm $name, "8@{0}", in(reg) ($a0) as u64,)
+    };
+    ($name:ident, $a0:expr, $a1:expr) => {
+        $crate::usdt::probe!(
+            @asm $name, "8@{0} 8@{1}",
+            in(reg) ($a0) as u64, in(reg) ($a1) as u64,
+        )
+    };
+    ($name:ident, $a0:expr, $a1:expr, $a2:expr) => {
+        $crate::usdt::probe!(
+            @asm $name, "8@{0} 8@{1} 8@{2}",
+            in(reg) ($a0) as u64, in(reg) ($a1) as u64, in(reg) ($a2) as u64,
+        )
+    };
+    (@asm $name:ident, $args:literal, $($operands:tt)*) => {{
+        // Arguments are given as registers, written like `%rax` on x86_64.
+        #[cfg(target_arch = "x86_64")]
+        $crate::usdt::probe!(@emit $name, $args, (att_syntax, readonly, nostack, preserves_flags), $($operands)*);
+        #[cfg(target_arch = "aarch64")]
+        $crate::usdt::probe!(@emit $name, $args, (readonly, nostack, preserves_flags), $($operands)*);
+    }};
+    (@emit $name:ident, $args:literal, ($($options:ident),*), $($operands:tt)*) => {
+        #[allow(unused_unsafe)]
+        unsafe {
+            std::arch::asm!(
+                "990: nop",
+                ".pushsection .note.stapsdt, \"\", \"note\"",
+                ".balign 4",
+                ".4byte 992f-991f, 994f-993f, 3",
+                "991: .asciz \"stapsdt\"",
+                "992: .balign 4",
+                "993: .8byte 990b",
+                ".8byte _.stapsdt.base",
+                ".8byte 0",
+                ".asciz \"device_connector\"",
+                concat!(".asciz \"", stringify!($name), "\""),
+                concat!(".asciz \"", $args, "\""),
+                "994: .balign 4",
+                ".popsection",
+                ".ifndef _.stapsdt.base",
+                ".pushsection .stapsdt.base, \"aG\", \"progbits\", .stapsdt.base, comdat",
+                ".weak _.stapsdt.base",
+                ".hidden _.stapsdt.base",
+                "_.stapsdt.base: .space 1",
+                ".size _.stapsdt.base, 1",
+                ".popsection",
+                ".endif",
+                $($operands)*
+                options($($options),*)
+            )
+        }
+    };
+}
+
+#[cfg(not(all(
+    target_os = "linux",
+    any(target_arch = "x86_64", target_arch = "aarch64")
+)))]
+macro_rules! probe {
+    ($name:ident $(, $arg:expr)*) => {{
+        $(let _ = $arg;)*
+    }};
+}
+
+pub(crate) use probe;
@@ -0,0 +1,84 @@
+//! Virtual clock that jumps forward when all tasks are idle.
+//!
+//! Unfinished work is counted in `ACTIVE`: running task threads, messages in flight and timer
+//! expirations not yet seen by a waiting task. When it drops to zero, the timer service moves
+//! the clock to the next timer expiration.
+
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static NOW_NS: AtomicU64 = AtomicU64::new(0);
+static ACTIVE: AtomicUsize = AtomicUsize::new(0);
+
+/// Use the virtual clock, starting at the current monotonic time.
+/// Must be called before tasks start.
+pub(crate) fn enable() {
+    NOW_NS.store(crate::clock::monotonic_ns(), Ordering::SeqCst);
+    ENABLED.store(true, Ordering::SeqCst);
+}
+
+pub(crate) fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// Get the virtual time in nanoseconds.
+pub(crate) fn now_ns() -> u64 {
+    NOW_NS.load(Ordering::SeqCst)
+}
+
+/// Move the clock forward to `ns`.
+pub(crate) fn advance_to(ns: u64) {
+    NOW_NS.fetch_max(ns, Ordering::SeqCst);
+}
+
+/// Whether no work is left until the clock advances.
+pub(crate) fn idle() -> bool {
+    ACTIVE.load(Ordering::SeqCst) == 0
+}
+
+/// Count a unit of work, such as a sent message.
+pub(crate) fn begin() {
+    if enabled() {
+        ACTIVE.fetch_add(1, Ordering::SeqCst);
+    }
+}
+
+/// Finish a unit of work counted by `begin`.
+pub(crate) fn end() {
+    if enabled() && ACTIVE.fetch_sub(1, Ordering::SeqCst) == 1 {
+        crate::timer::wake();
+    }
+}
+
+/// Counts a thread as running until dropped. Create it before spawning the thread and move it
+/// in, so the thread is counted before it starts.
+pub(crate) struct Busy(());
+
+impl Busy {
+    pub fn new() -> Self {
+        begin();
+        Busy(())
+    }
+}
+
+impl Drop for Busy {
+    fn drop(&mut self) {
+        end();
+    }
+}
+
+/// Counts the current thread as waiting until dropped.
+pub(crate) struct Idle(());
+
+impl Idle {
+    pub fn new() -> Self {
+        end();
+        Idle(())
+    }
+}
+
+impl Drop for Idle {
+    fn drop(&mut self) {
+        begin();
+    }
+}
@@ -0,0 +1,159 @@
+//! Strategies to wait for messages on receiving ports.
+
+use crate::conf::{WaitConf, WaitStrategy};
+use crossbeam_channel::{Receiver, RecvError, Select, TryRecvError};
+use std::time::{Duration, Instant};
+
+const DEFAULT_SPIN_COUNT: u32 = 10000;
+const DEFAULT_YIELD_COUNT: u32 = 10;
+
+/// Receives messages with a configured wait strategy.
+#[derive(Clone, Copy, Debug, Default)]
+pub(crate) struct Waiter {
+    strategy: WaitStrategy,
+    spin_count: u32,
+    spin_time: Option<Duration>,
+    yield_count: u32,
+    /// Receiver polled first, rotated so that a busy port cannot starve others.
+    first: usize,
+}
+
+impl Waiter {
+    pub fn new(conf: &WaitConf) -> Self {
+        Waiter {
+            strategy: conf.strategy,
+            spin_count: conf.spin_count.unwrap_or(DEFAULT_SPIN_COUNT),
+            spin_time: conf.spin_us.map(Duration::from_micros),
+            yield_count: conf.yield_count.unwrap_or(DEFAULT_YIELD_COUNT),
+            first: 0,
+        }
+    }
+
+    /// Receive a message from `receiver`.
+    pub fn recv<T>(&mut self, receiver: &Receiver<T>) -> Result<T, RecvError> {
+        self.recv_any(std::slice::from_ref(receiver))
+            .map(|(_, value)| value)
+    }
+
+    /// Receive a message from any of `receivers`. Returns the index of the ready receiver.
+    pub fn recv_any<T>(&mut self, receivers: &[Receiver<T>]) -> Result<(usize, T), RecvError> {
+        match self.strategy {
+            WaitStrategy::Park => {}
+            WaitStrategy::BusyPoll => loop {
+                if let Some(result) = self.try_recv_any(receivers) {
+                    return result;
+                }
+                std::hint::spin_loop();
+            },
+            WaitStrategy::SpinThenPark => {
+                let deadline = self.spin_time.map(|spin_time| Instant::now() + spin_time);
+                for _ in 0..self.spin_count {
+                    if let Some(result) = self.try_recv_any(receivers) {
+                        return result;
+                    }
+                    if matches!(deadline, Some(deadline) if Instant::now() >= deadline) {
+                        break;
+                    }
+                    std::hint::spin_loop();
+                }
+                for _ in 0..self.yield_count {
+                    if let Some(result) = self.try_recv_any(receivers) {
+                        return result;
+                    }
+                    std::thread::yield_now();
+                }
+            }
+        }
+
+        park_any(receivers)
+    }
+
+    /// Receive from a ready receiver without blocking.
+    fn try_recv_any<T>(
+        &mut self,
+        receivers: &[Receiver<T>],
+    ) -> Option<Result<(usize, T), RecvError>> {
+        let n = receivers.len();
+        for i in (self.first..n).chain(0..self.first.min(n)) {
+            match receivers[i].try_recv() {
+                Ok(value) => {
+                    self.first = (i + 1) % n;
+                    return Some(Ok((i, value)));
+                }
+                Err(TryRecvError::Disconnected) => return Some(Err(RecvError)),
+                Err(TryRecvError::Empty) => (),
+            }
+        }
+        None
+    }
+}
+
+fn park_any<T>(receivers: &[Receiver<T>]) -> Result<(usize, T), RecvError> {
+    if receivers.len() == 1 {
+        return receivers[0].recv().map(|value| (0, value));
+    }
+
+    let mut sel = Select::new();
+    for r in receivers {
+        sel.recv(r);
+    }
+    let oper = sel.select();
+    let index = oper.index();
+    oper.recv(&receivers[index]).map(|value| (index, value))
+}
+
+#[test]
+fn strategy_test() {
+    use crossbeam_channel::bounded;
+
+    let spin = WaitConf {
+        strategy: WaitStrategy::BusyPoll,
+        ..WaitConf::default()
+    };
+    let spin_yield = WaitConf {
+        strategy: WaitStrategy::SpinThenPark,
+        spin_count: Some(0),
+        yield_count: Some(u32::MAX),
+        ..WaitConf::default()
+    };
+    let spin_park = WaitConf {
+        strategy: WaitStrategy::SpinThenPark,
+        spin_count: Some(10),
+        spin_us: Some(10),
+        yield_count: Some(0),
+        ..WaitConf::default()
+    };
+    let park = WaitConf::default();
+
+    let later = |f: Box<dyn FnOnce() + Send>| {
+        std::thread::spawn(move || {
+            std::thread::sleep(Duration::from_millis(20));
+            f();
+        })
+    };
+    for conf in [spin, spin_yield, spin_park, park] {
+        let mut waiter = Waiter::new(&conf);
+
+        // Wakes on send.
+        let (sender, receiver) = bounded(1);
+        let thread = later(Box::new(move || sender.send(1).unwrap()));
+        assert_eq!(waiter.recv(&receiver), Ok(1), "{:?}", conf);
+        thread.join().unwrap();
+
+        let (senders, receivers): (Vec<_>, Vec<_>) = (0..3).map(|_| bounded(1)).unzip();
+        let sender = senders[2].clone();
+        let thread = later(Box::new(move || sender.send(2).unwrap()));
+        assert_eq!(waiter.recv_any(&receivers), Ok((2, 2)), "{:?}", conf);
+        thread.join().unwrap();
+
+        // Returns on disconnect.
+        let (sender, receiver) = bounded::<u32>(1);
+        let thread = later(Box::new(move || drop(sender)));
+        assert_eq!(waiter.recv(&receiver), Err(RecvError), "{:?}", conf);
+        thread.join().unwrap();
+
+        let thread = later(Box::new(move || drop(senders)));
+        assert_eq!(waiter.recv_any(&receivers), Err(RecvError), "{:?}", conf);
+        thread.join().unwrap();
+    }
+}
@@ -0,0 +1,425 @@
+//! Detection of tasks that stop making progress.
+//!
+//! Task threads record when they last returned from `next` or passed a message, with a coarse
+//! clock and a relaxed store, and whether they are waiting for input or a timer. A watchdog
+//! thread reports tasks that made no progress for longer than their threshold while running
+//! or blocked in send, with their state and queue depths, and optionally their stack.
+//! Fused child tasks are watched as part of the task whose thread runs them.
+//!
+//! The same state is read by snapshots, which track tasks without the watchdog thread.
+
+use crate::channel::{QueueDepth, QueueDepths};
+use crate::conf::{TaskConf, WatchdogConf};
+use crate::task::{TaskId, TaskPort};
+use common::DcMetricKind;
+use once_cell::sync::{Lazy, OnceCell};
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+const DEFAULT_THRESHOLD_MS: u64 = 10_000;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static WATCH: OnceCell<Watch> = OnceCell::new();
+static TASKS: Lazy<Mutex<Vec<Arc<TaskState>>>> = Lazy::new(Mutex::default);
+/// Receiving ports of each task, including fused and replicated ones.
+static QUEUES: Lazy<Mutex<HashMap<TaskId, QueueDepths>>> = Lazy::new(Mutex::default);
+
+thread_local! {
+    static CURRENT: RefCell<Option<Arc<TaskState>>> = RefCell::new(None);
+}
+
+struct Watch {
+    thresholds: HashMap<TaskId, Duration>,
+    /// Receiving ports that each task sends to.
+    downstream: HashMap<TaskId, Vec<TaskPort>>,
+    stack_trace: bool,
+    metric: u64,
+}
+
+const RUNNING: u64 = 0;
+const SLEEPING: u64 = 1;
+const SEND_WAIT: u64 = 2;
+const RECV_ANY_WAIT: u64 = 3;
+/// Waiting for a message on the receiving port `state - RECV_WAIT`.
+const RECV_WAIT: u64 = 4;
+
+struct TaskState {
+    name: String,
+    id: TaskId,
+    tid: libc::pid_t,
+    threshold_ns: u64,
+    last_progress_ns: AtomicU64,
+    state: AtomicU64,
+    stalled: AtomicBool,
+    queues: QueueDepths,
+    /// Messages received from queues and sent, updated only by the task thread.
+    received: AtomicU64,
+    sent: AtomicU64,
+}
+
+/// State of a task thread read from another thread.
+pub(crate) struct TaskSnapshot {
+    pub name: String,
+    pub id: TaskId,
+    /// `running`, `sleeping`, `send-blocked` or `recv-blocked`.
+    pub state: &'static str,
+    /// Receiving port waited for in the `recv-blocked` state, or `None` for any port.
+    pub port: Option<u64>,
+    /// Time since the last progress.
+    pub idle: Duration,
+    pub received: u64,
+    pub sent: u64,
+}
+
+/// Start watching tasks registered after this.
+pub(crate) fn enable<'a>(conf: &WatchdogConf, tasks: impl Iterator<Item = &'a TaskConf>) {
+    let default = Duration::from_millis(conf.threshold_ms.unwrap_or(DEFAULT_THRESHOLD_MS));
+    let mut thresholds = HashMap::new();
+    let mut downstream: HashMap<TaskId, Vec<TaskPort>> = HashMap::new();
+    for task in tasks {
+        let threshold = task.watchdog_threshold_ms.map(Duration::from_millis);
+        thresholds.insert(task.id, threshold.unwrap_or(default));
+        for (port, from) in task.from.iter().enumerate() {
+            for from in from {
+                downstream
+                    .entry(from.0)
+                    .or_default()
+                    .push(TaskPort(task.id, port as u8));
+            }
+        }
+    }
+    let interval = (thresholds.values().copied().min().unwrap_or(default) / 2)
+        .clamp(Duration::from_millis(10), Duration::from_secs(1));
+
+    if conf.stack_trace {
+        stack::install();
+    }
+    let watch = Watch {
+        thresholds,
+        downstream,
+        stack_trace: conf.stack_trace,
+        metric: crate::metrics::register("watchdog stalls", DcMetricKind::Counter),
+    };
+    if WATCH.set(watch).is_err() {
+        return;
+    }
+    track();
+
+    std::thread::spawn(move || loop {
+        std::thread::sleep(interval);
+        check();
+    });
+}
+
+/// Track the state of tasks registered after this, without reporting stalls.
+pub(crate) fn track() {
+    ENABLED.store(true, Ordering::SeqCst);
+}
+
+/// Whether the state of tasks is tracked.
+pub(crate) fn tracking() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// Watches the current thread until dropped.
+pub(crate) struct Registration(());
+
+/// Watch the current thread as `name`, running task `id` and receiving from `queues`.
+pub(crate) fn register(name: String, id: TaskId, queues: QueueDepths) -> Option<Registration> {
+    if !ENABLED.load(Ordering::Relaxed) {
+        return None;
+    }
+    let threshold = WATCH
+        .get()
+        .and_then(|watch| watch.thresholds.get(&id).copied())
+        .unwrap_or(Duration::from_millis(DEFAULT_THRESHOLD_MS));
+    let state = Arc::new(TaskState {
+        name,
+        id,
+        tid: unsafe { libc::syscall(libc::SYS_gettid) } as libc::pid_t,
+        threshold_ns: threshold.as_nanos() as u64,
+        last_progress_ns: AtomicU64::new(now_ns()),
+        state: AtomicU64::new(RUNNING),
+        stalled: AtomicBool::new(false),
+        queues,
+        received: AtomicU64::new(0),
+        sent: AtomicU64::new(0),
+    });
+    TASKS.lock().unwrap().push(state.clone());
+    CURRENT.with(|current| *current.borrow_mut() = Some(state));
+    Some(Registration(()))
+}
+
+impl Drop for Registration {
+    fn drop(&mut self) {
+        if let Some(state) = CURRENT.with(|current| current.borrow_mut().take()) {
+            TASKS
+                .lock()
+                .unwrap()
+                .retain(|task| !Arc::ptr_eq(task, &state));
+        }
+    }
+}
+
+/// Keep the receiving ports of task `id` to read their depths.
+pub(crate) fn register_queues(id: TaskId, queues: QueueDepths) {
+    QUEUES.lock().unwrap().insert(id, queues);
+}
+
+/// Get the depths of the receiving ports of task `id`.
+pub(crate) fn queue_depths(id: TaskId) -> Vec<QueueDepth> {
+    let queues = QUEUES.lock().unwrap().get(&id).cloned();
+    queues.map_or_else(Vec::new, |queues| queues.get())
+}
+
+/// Get the depth of a receiving port.
+pub(crate) fn queue_depth(port: TaskPort) -> Option<QueueDepth> {
+    queue_depths(port.0).get(port.1 as usize).copied()
+}
+
+/// Record progress of the current task.
+#[inline]
+pub(crate) fn progress() {
+    with_current(TaskState::progress);
+}
+
+/// Record a message received by the current task from a queue.
+#[inline]
+pub(crate) fn msg_received() {
+    with_current(|state| {
+        increment(&state.received);
+        state.progress();
+    });
+}
+
+/// Record a message sent by the current task.
+#[inline]
+pub(crate) fn msg_sent() {
+    with_current(|state| increment(&state.sent));
+}
+
+#[inline]
+fn with_current(f: impl FnOnce(&TaskState)) {
+    if ENABLED.load(Ordering::Relaxed) {
+        CURRENT.with(|current| {
+            if let Some(state) = &*current.borrow() {
+                f(state);
+            }
+        });
+    }
+}
+
+#[inline]
+fn increment(count: &AtomicU64) {
+    count.store(count.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+}
+
+/// Get the state of tracked tasks in the order of registration.
+pub(crate) fn tasks() -> Vec<TaskSnapshot> {
+    let tasks = TASKS.lock().unwrap().clone();
+    let now = now_ns();
+    tasks
+        .iter()
+        .map(|task| {
+            let (state, port) = match task.state.load(Ordering::Relaxed) {
+                RUNNING => ("running", None),
+                SLEEPING => ("sleeping", None),
+                SEND_WAIT => ("send-blocked", None),
+                RECV_ANY_WAIT => ("recv-blocked", None),
+                state => ("recv-blocked", Some(state - RECV_WAIT)),
+            };
+            let last_progress_ns = task.last_progress_ns.load(Ordering::Relaxed);
+            TaskSnapshot {
+                name: task.name.clone(),
+                id: task.id,
+                state,
+                port,
+                idle: Duration::from_nanos(now.saturating_sub(last_progress_ns)),
+                received: task.received.load(Ordering::Relaxed),
+                sent: task.sent.load(Ordering::Relaxed),
+            }
+        })
+        .collect()
+}
+
+/// Marks the current task as waiting until dropped.
+pub(crate) struct Wait(bool);
+
+impl Wait {
+    pub fn recv(port: usize) -> Self {
+        Wait::new(RECV_WAIT + port as u64)
+    }
+
+    pub fn recv_any() -> Self {
+        Wait::new(RECV_ANY_WAIT)
+    }
+
+    pub fn send() -> Self {
+        Wait::new(SEND_WAIT)
+    }
+
+    pub fn sleep() -> Self {
+        Wait::new(SLEEPING)
+    }
+
+    fn new(state: u64) -> Self {
+        if !ENABLED.load(Ordering::Relaxed) {
+            return Wait(false);
+        }
+        CURRENT.with(|current| match &*current.borrow() {
+            Some(task) => {
+                task.state.store(state, Ordering::Relaxed);
+                Wait(true)
+            }
+            None => Wait(false),
+        })
+    }
+}
+
+impl Drop for Wait {
+    fn drop(&mut self) {
+        if self.0 {
+            CURRENT.with(|current| {
+                if let Some(state) = &*current.borrow() {
+                    state.state.store(RUNNING, Ordering::Relaxed);
+                    state.progress();
+                }
+            });
+        }
+    }
+}
+
+impl TaskState {
+    #[inline]
+    fn progress(&self) {
+        self.last_progress_ns.store(now_ns(), Ordering::Relaxed);
+        if self.stalled.load(Ordering::Relaxed) {
+            self.stalled.store(false, Ordering::Relaxed);
+            log::info!("{} made progress again", self.name);
+        }
+    }
+
+    fn state_name(&self) -> String {
+        match self.state.load(Ordering::Relaxed) {
+            RUNNING => "running next".to_owned(),
+            SLEEPING => "sleeping".to_owned(),
+            SEND_WAIT => "blocked in send".to_owned(),
+            RECV_ANY_WAIT => "waiting for a message on any port".to_owned(),
+            state => format!("waiting for a message on port {}", state - RECV_WAIT),
+        }
+    }
+}
+
+fn check() {
+    let watch = WATCH.get().unwrap();
+    let tasks = TASKS.lock().unwrap().clone();
+    let now = now_ns();
+    for task in &tasks {
+        let state = task.state.load(Ordering::Relaxed);
+        if state != RUNNING && state != SEND_WAIT {
+            continue;
+        }
+        let idle_ns = now.saturating_sub(task.last_progress_ns.load(Ordering::Relaxed));
+        if idle_ns < task.threshold_ns || task.stalled.swap(true, Ordering::Relaxed) {
+            continue;
+        }
+
+        let mut report = format!(
+            "{} made no progress for {} ms: {}",
+            task.name,
+            idle_ns / 1_000_000,
+            task.state_name()
+        );
+        for (port, depth) in task.queues.get().iter().enumerate() {
+            let _ = write!(report, "; port {} has {}", port, depth);
+        }
+        for to in watch.downstream.get(&task.id).into_iter().flatten() {
+            if let Some(depth) = queue_depth(*to) {
+                let _ = write!(report, "; task {} has {}", to, depth);
+            }
+        }
+        log::warn!("{}", report);
+        crate::metrics::update(watch.metric, 1);
+
+        if watch.stack_trace {
+            log::warn!("stack of {} follows on stderr", task.name);
+            log::logger().flush();
+            stack::dump(task.tid);
+        }
+    }
+}
+
+fn now_ns() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC_COARSE, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// Stacks printed by the stalled thread itself from a signal handler.
+#[cfg(all(target_os = "linux", target_env = "gnu"))]
+mod stack {
+    use libc::{c_int, c_void};
+
+    const FRAMES: usize = 64;
+
+    extern "C" {
+        fn backtrace(buffer: *mut *mut c_void, size: c_int) -> c_int;
+        fn backtrace_symbols_fd(buffer: *const *mut c_void, size: c_int, fd: c_int);
+    }
+
+    fn signal() -> c_int {
+        libc::SIGRTMIN() + 1
+    }
+
+    pub fn install() {
+        unsafe {
+            // The first call loads libgcc, which is not safe in a signal handler.
+            let mut frames = [std::ptr::null_mut(); FRAMES];
+            backtrace(frames.as_mut_ptr(), FRAMES as c_int);
+
+            let mut action: libc::sigaction = std::mem::zeroed();
+            action.sa_sigaction = handler as usize;
+            action.sa_flags = libc::SA_RESTART;
+            libc::sigemptyset(&mut action.sa_mask);
+            if libc::sigaction(signal(), &action, std::ptr::null_mut()) != 0 {
+                log::warn!("cannot install the handler to print stacks of tasks");
+            }
+        }
+    }
+
+    pub fn dump(tid: libc::pid_t) {
+        unsafe {
+            libc::syscall(
+                libc::SYS_tgkill,
+                libc::getpid(),
+                tid,
+                signal() as libc::c_long,
+            )
+        };
+    }
+
+    extern "C" fn handler(_signal: c_int) {
+        // Only functions that do not allocate or lock.
+        unsafe {
+            let mut frames = [std::ptr::null_mut(); FRAMES];
+            let n = backtrace(frames.as_mut_ptr(), FRAMES as c_int);
+            backtrace_symbols_fd(frames.as_ptr(), n, libc::STDERR_FILENO);
+        }
+    }
+}
+
+#[cfg(not(all(target_os = "linux", target_env = "gnu")))]
+mod stack {
+    pub fn install() {
+        log::warn!("stack traces of tasks are not supported on this platform");
+    }
+
+    pub fn dump(_tid: libc::pid_t) {}
+}
@@ -0,0 +1,233 @@
+//! Worker threads shared by all tasks for data-parallel work inside `next()`.
+
+use crate::conf::WorkerPoolConf;
+use common::{DcJobFunc, DcParallelForFunc};
+use crossbeam_channel::{unbounded, Receiver, Sender};
+use libc::c_void;
+use once_cell::sync::OnceCell;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+
+static POOL: OnceCell<WorkerPool> = OnceCell::new();
+/// Configuration and CPUs of pinned tasks given to `init`.
+static CONF: OnceCell<(WorkerPoolConf, Vec<usize>)> = OnceCell::new();
+
+/// Jobs submitted by one task.
+#[derive(Default)]
+pub(crate) struct JobGroup {
+    pending: Mutex<usize>,
+    done: Condvar,
+}
+
+struct Job {
+    func: DcJobFunc,
+    arg: *mut c_void,
+    group: Arc<JobGroup>,
+}
+
+unsafe impl Send for Job {}
+
+impl Job {
+    fn run(self) {
+        unsafe { (self.func)(self.arg) };
+        let mut pending = self.group.pending.lock().unwrap();
+        *pending -= 1;
+        if *pending == 0 {
+            self.group.done.notify_all();
+        }
+    }
+}
+
+struct WorkerPool {
+    threads: usize,
+    sender: Sender<Job>,
+    receiver: Receiver<Job>,
+}
+
+/// Configure the pool. Workers avoid CPUs in `pinned`, which are used by pinned tasks.
+///
+/// The pool is started on the first job, once per process, and later calls are ignored.
+pub(crate) fn init(conf: &WorkerPoolConf, pinned: &[usize]) {
+    let _ = CONF.set((conf.clone(), pinned.to_vec()));
+}
+
+fn pool() -> &'static WorkerPool {
+    POOL.get_or_init(|| match CONF.get() {
+        Some((conf, pinned)) => WorkerPool::new(conf, pinned),
+        None => WorkerPool::new(&WorkerPoolConf::default(), &[]),
+    })
+}
+
+impl WorkerPool {
+    fn new(conf: &WorkerPoolConf, pinned: &[usize]) -> Self {
+        let cpus: Vec<usize> = crate::cpu::allowed_cpus()
+            .into_iter()
+            .filter(|cpu| !pinned.contains(cpu))
+            .collect();
+        let threads = conf.threads.unwrap_or(cpus.len()).max(1);
+        let (sender, receiver) = unbounded::<Job>();
+        // Only restrict workers when pinned tasks leave other CPUs to them.
+        let affinity = if pinned.is_empty() { Vec::new() } else { cpus };
+
+        for i in 0..threads {
+            let receiver = receiver.clone();
+            let affinity = affinity.clone();
+            let spawned = std::thread::Builder::new()
+                .name(format!("dc-worker-{}", i))
+                .spawn(move || {
+                    if !affinity.is_empty() {
+                        if let Err(e) = crate::cpu::pin_current_thread(&affinity) {
+                            log::warn!("cannot set CPU affinity of worker {}\n{}", i, e);
+                        }
+                    }
+                    for job in receiver.iter() {
+                        job.run();
+                    }
+                });
+            if let Err(e) = spawned {
+                log::error!("cannot spawn worker {}\n{}", i, e);
+            }
+        }
+        log::debug!("worker pool started with {} threads", threads);
+
+        WorkerPool {
+            threads,
+            sender,
+            receiver,
+        }
+    }
+}
+
+impl JobGroup {
+    /// Run `func(arg)` on a worker.
+    pub fn submit(self: &Arc<Self>, func: DcJobFunc, arg: *mut c_void) {
+        *self.pending.lock().unwrap() += 1;
+        let job = Job {
+            func,
+            arg,
+            group: self.clone(),
+        };
+        if let Err(e) = pool().sender.send(job) {
+            // Workers never exit, but run the job here rather than losing it.
+            e.into_inner().run();
+        }
+    }
+
+    /// Wait for all submitted jobs. Queued jobs are run on this thread meanwhile.
+    pub fn wait(&self) {
+        let pool = pool();
+        loop {
+            if *self.pending.lock().unwrap() == 0 {
+                return;
+            }
+            match pool.receiver.try_recv() {
+                Ok(job) => job.run(),
+                Err(_) => break,
+            }
+        }
+
+        let mut pending = self.pending.lock().unwrap();
+        while *pending > 0 {
+            pending = self.done.wait(pending).unwrap();
+        }
+    }
+}
+
+struct ParallelFor {
+    next: AtomicUsize,
+    n: usize,
+    func: DcParallelForFunc,
+    arg: *mut c_void,
+}
+
+impl ParallelFor {
+    unsafe fn run(&self) {
+        loop {
+            let i = self.next.fetch_add(1, Ordering::Relaxed);
+            if i >= self.n {
+                return;
+            }
+            (self.func)(self.arg, i);
+        }
+    }
+}
+
+unsafe extern "C" fn run_parallel_for(arg: *mut c_void) {
+    (*(arg as *const ParallelFor)).run()
+}
+
+/// Call `func(arg, i)` for each `i` in `0..n` on this thread and workers.
+///
+/// # Safety
+/// `func` must be safe to call with `arg` from multiple threads.
+pub(crate) unsafe fn parallel_for(n: usize, func: DcParallelForFunc, arg: *mut c_void) {
+    if n == 0 {
+        return;
+    }
+    let body = ParallelFor {
+        next: AtomicUsize::new(0),
+        n,
+        func,
+        arg,
+    };
+    let body_ptr = &body as *const ParallelFor as *mut c_void;
+
+    // Helpers finish quickly once indices run out, so waiting for them bounds `body`.
+    let group = Arc::new(JobGroup::default());
+    for _ in 0..pool().threads.min(n - 1) {
+        group.submit(run_parallel_for, body_ptr);
+    }
+    body.run();
+    group.wait();
+}
+
+#[test]
+fn worker_pool_test() {
+    use std::sync::atomic::AtomicBool;
+    use std::thread::ThreadId;
+    use std::time::Duration;
+
+    unsafe extern "C" fn count(arg: *mut c_void, i: usize) {
+        (&*(arg as *const Vec<AtomicUsize>))[i].fetch_add(1, Ordering::Relaxed);
+    }
+    for n in [0, 1, 2, 1000] {
+        let counts: Vec<AtomicUsize> = (0..n).map(|_| AtomicUsize::new(0)).collect();
+        unsafe { parallel_for(n, count, &counts as *const _ as *mut c_void) };
+        assert!(
+            counts.iter().all(|c| c.load(Ordering::Relaxed) == 1),
+            "{}",
+            n
+        );
+    }
+
+    // Occupy every worker, so that the last job can only run on the waiting thread.
+    unsafe extern "C" fn block(arg: *mut c_void) {
+        while !(*(arg as *const AtomicBool)).load(Ordering::Relaxed) {
+            std::thread::sleep(Duration::from_millis(1));
+        }
+    }
+    unsafe extern "C" fn record_thread(arg: *mut c_void) {
+        *(*(arg as *const Mutex<Option<ThreadId>>)).lock().unwrap() =
+            Some(std::thread::current().id());
+    }
+    let open = Arc::new(AtomicBool::new(false));
+    let ran_on = Mutex::new(None);
+    let group = Arc::new(JobGroup::default());
+    for _ in 0..pool().threads {
+        group.submit(block, &*open as *const _ as *mut c_void);
+    }
+    std::thread::sleep(Duration::from_millis(50));
+    group.submit(record_thread, &ran_on as *const _ as *mut c_void);
+    let opener = {
+        let open = open.clone();
+        std::thread::spawn(move || {
+            std::thread::sleep(Duration::from_millis(50));
+            open.store(true, Ordering::Relaxed);
+        })
+    };
+    group.wait();
+    assert_eq!(*ran_on.lock().unwrap(), Some(std::thread::current().id()));
+    assert!(open.load(Ordering::Relaxed));
+    assert_eq!(*group.pending.lock().unwrap(), 0);
+    opener.join().unwrap();
+}
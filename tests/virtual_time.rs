@@ -0,0 +1,182 @@
+use anyhow::Result;
+
+use device_connector::conf::Conf;
+use device_connector::{
+    ElementBank, ElementBuildable, ElementResult, ElementValue, EmptyElementConf, Error,
+    LoadedPlugin, MsgReceiver, MsgType, Pipeline, Port, RunnerBuilder,
+};
+use serde_derive::Deserialize;
+
+use std::io::Write;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{sync_channel, SyncSender};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+const CONFIG: &str = r#"
+runner:
+  virtual_time: true
+
+task:
+  - id: 1
+    element: tick-src
+    conf:
+      id: 1
+      period_ms: 300
+      count: 10
+
+  - id: 2
+    element: tick-src
+    conf:
+      id: 2
+      period_ms: 500
+      count: 10
+
+  - id: 3
+    element: order-sink
+    from:
+      - - 1
+        - 2
+"#;
+
+/// Virtual time and source of messages in the order the sink received them.
+static RECEIVED: Mutex<Vec<(u64, u8)>> = Mutex::new(Vec::new());
+/// Set if the clock moved while a task was running.
+static MOVED_WHILE_BUSY: AtomicBool = AtomicBool::new(false);
+/// Notified when all messages are received.
+static DONE: Mutex<Option<SyncSender<()>>> = Mutex::new(None);
+
+#[derive(Deserialize)]
+struct TickConf {
+    id: u8,
+    period_ms: u64,
+    count: usize,
+}
+
+/// Sends the virtual time of each expiration of a periodic timer.
+struct TickSrc {
+    conf: TickConf,
+    timer: Option<u64>,
+}
+
+impl ElementBuildable for TickSrc {
+    type Config = TickConf;
+
+    const NAME: &'static str = "tick-src";
+
+    const SEND_PORTS: Port = 1;
+
+    fn new(conf: Self::Config) -> Result<Self, Error> {
+        Ok(TickSrc { conf, timer: None })
+    }
+
+    fn next(&mut self, pipeline: &mut Pipeline, _receiver: &mut MsgReceiver) -> ElementResult {
+        let period = Duration::from_millis(self.conf.period_ms);
+        let timer = *self
+            .timer
+            .get_or_insert_with(|| pipeline.timer_register(period, true));
+        pipeline.timer_wait(timer);
+        // Closing a task exits the process, so keep waiting without sending instead.
+        while self.conf.count == 0 {
+            pipeline.timer_wait(timer);
+        }
+        self.conf.count -= 1;
+        if !pipeline.send_msg_type_checked() {
+            pipeline.check_send_msg_type(0, MsgType::binary)?;
+        }
+
+        // This task is busy, so the clock stays while other timers are due.
+        let now = pipeline.now(false).monotonic_ns;
+        std::thread::sleep(Duration::from_millis(20));
+        if pipeline.now(false).monotonic_ns != now {
+            MOVED_WHILE_BUSY.store(true, Ordering::Relaxed);
+        }
+
+        let mut buf = pipeline.msg_buf(0);
+        buf.write_all(&now.to_le_bytes())?;
+        buf.write_all(&[self.conf.id])?;
+        Ok(ElementValue::MsgBuf)
+    }
+}
+
+/// Records received ticks.
+struct OrderSink;
+
+impl ElementBuildable for OrderSink {
+    type Config = EmptyElementConf;
+
+    const NAME: &'static str = "order-sink";
+
+    const RECV_PORTS: Port = 1;
+
+    fn acceptable_msg_types() -> Vec<Vec<MsgType>> {
+        vec![vec![MsgType::any()]]
+    }
+
+    fn new(_conf: Self::Config) -> Result<Self, Error> {
+        Ok(OrderSink)
+    }
+
+    fn next(&mut self, _pipeline: &mut Pipeline, receiver: &mut MsgReceiver) -> ElementResult {
+        loop {
+            let msg = receiver.recv(0)?;
+            let bytes = msg.as_bytes();
+            let now = u64::from_le_bytes(bytes[..8].try_into().unwrap());
+            let mut received = RECEIVED.lock().unwrap();
+            received.push((now, bytes[8]));
+            if received.len() == 20 {
+                let _ = DONE.lock().unwrap().take().unwrap().send(());
+            }
+        }
+    }
+}
+
+fn run() -> Result<()> {
+    let conf = Conf::from_yaml(CONFIG)?;
+    let mut bank = ElementBank::new();
+    bank.append_from_buildable::<TickSrc>()?;
+    bank.append_from_buildable::<OrderSink>()?;
+    let loaded_plugin = LoadedPlugin::from_conf(&conf.plugin)?;
+    loaded_plugin.load_plugins(&mut bank)?;
+
+    let mut runner_builder = RunnerBuilder::new(&bank, &loaded_plugin, &conf);
+    runner_builder.append_from_conf(&conf.tasks)?;
+    let runner = runner_builder.build()?;
+    runner.run()
+}
+
+#[test]
+fn virtual_time() -> Result<()> {
+    let (done, wait) = sync_channel(1);
+    *DONE.lock().unwrap() = Some(done);
+    let start = Instant::now();
+    // Tasks do not finish, so the runner is left running in the background.
+    std::thread::spawn(run);
+    wait.recv_timeout(Duration::from_secs(10))?;
+    let elapsed = start.elapsed();
+
+    assert!(!MOVED_WHILE_BUSY.load(Ordering::Relaxed));
+    let received = RECEIVED.lock().unwrap().clone();
+    assert_eq!(received.len(), 20);
+
+    // Expirations are seen in virtual order, each source at its period.
+    assert!(received.windows(2).all(|w| w[0].0 <= w[1].0));
+    for (id, period_ms) in [(1, 300), (2, 500)] {
+        let times: Vec<u64> = received
+            .iter()
+            .filter(|(_, source)| *source == id)
+            .map(|(now, _)| *now)
+            .collect();
+        assert_eq!(times.len(), 10);
+        assert!(times
+            .windows(2)
+            .all(|w| w[1] - w[0] == period_ms * 1_000_000));
+    }
+
+    // The clock jumps over idle time.
+    let span = Duration::from_nanos(received.last().unwrap().0 - received[0].0);
+    assert!(span >= Duration::from_millis(4500));
+    assert!(elapsed < span);
+
+    Ok(())
+}